@@ -0,0 +1,476 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * cm-psu-proto.h - Decoder for the protocol of Cooler Master PSUs
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ *
+ * This is shared by the driver and the userspace tools, so it only uses
+ * functions that are available in both (see the protocol information in
+ * cm-psu.c for the format).
+ */
+
+#ifndef _CM_PSU_PROTO_H
+#define _CM_PSU_PROTO_H
+
+#ifdef __KERNEL__
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#include <linux/unaligned.h>
+
+#define cmpsu_load_le64(p) get_unaligned_le64(p)
+#define cmpsu_ffs(x) __ffs(x)
+#define cmpsu_div_u64(a, b) div_u64(a, b)
+#else
+#include <endian.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static inline uint64_t cmpsu_load_le64(const void *p)
+{
+	uint64_t x;
+	
+	memcpy(&x, p, sizeof(x));
+	return le64toh(x);
+}
+
+#define cmpsu_ffs(x) __builtin_ctz(x)
+#define cmpsu_div_u64(a, b) ((a) / (b))
+#endif
+
+#define CMPSU_VENDOR 0x2516
+
+/* Model flags */
+#define CMPSU_MODEL_FANLESS 0x1 /* No fan, R1 is always 0 */
+
+/*
+ * Supported models, pulled from MasterPlus' DeviceList.cfg (may contain
+ * unreleased models): X(USB product ID, rated wattage in W, flags, name)
+ */
+#define CMPSU_MODELS(X) \
+	X(0x0030, 1200, 0, "MasterWatt 1200") \
+	X(0x018D, 550, 0, "V550 GOLD i MULTI") \
+	X(0x018F, 650, 0, "V650 GOLD i MULTI") \
+	X(0x0191, 750, 0, "V750 GOLD i MULTI") \
+	X(0x0193, 850, 0, "V850 GOLD i MULTI") \
+	X(0x0195, 550, 0, "V550 GOLD i 12VO") \
+	X(0x0197, 650, 0, "V650 GOLD i 12VO") \
+	X(0x0199, 750, 0, "V750 GOLD i 12VO") \
+	X(0x019B, 850, 0, "V850 GOLD i 12VO") \
+	X(0x019D, 650, 0, "V650 PLATINUM i 12VO") \
+	X(0x019F, 750, 0, "V750 PLATINUM i 12VO") \
+	X(0x01A1, 850, 0, "V850 PLATINUM i 12VO") \
+	X(0x01A5, 1300, CMPSU_MODEL_FANLESS, "FANLESS 1300")
+
+struct cmpsu_model {
+	uint16_t product;
+	unsigned int rated; /* W */
+	unsigned int flags;
+	const char *name;
+};
+
+#define CMPSU_MODEL_ENTRY(product, rated, flags, name) \
+	{ product, rated, flags, name },
+
+/* Terminated by a zero entry */
+static const struct cmpsu_model cmpsu_models[] = {
+	CMPSU_MODELS(CMPSU_MODEL_ENTRY)
+	{ 0 }
+};
+
+/* Returns NULL for unknown products */
+static inline const struct cmpsu_model *cmpsu_model_find(uint16_t product)
+{
+	const struct cmpsu_model *model;
+	
+	for (model = cmpsu_models; model->product; model++) {
+		if (model->product == product)
+			return model;
+	}
+	
+	return NULL;
+}
+
+/* Channels of each type, in the order of the hwmon attributes */
+#define CMPSU_COUNT_VOLTAGE 5
+#define CMPSU_COUNT_CURRENT 5
+#define CMPSU_COUNT_POWER   2
+#define CMPSU_COUNT_TEMP    2
+#define CMPSU_COUNT_FAN     1
+#define CMPSU_COUNT_ALL     (CMPSU_COUNT_VOLTAGE + CMPSU_COUNT_CURRENT \
+			     + CMPSU_COUNT_POWER + CMPSU_COUNT_TEMP \
+			     + CMPSU_COUNT_FAN)
+
+/* Index of each type's first channel when all channels are numbered */
+#define CMPSU_CHAN_VOLTAGE_FIRST 0
+#define CMPSU_CHAN_CURRENT_FIRST (CMPSU_CHAN_VOLTAGE_FIRST + CMPSU_COUNT_VOLTAGE)
+#define CMPSU_CHAN_POWER_FIRST   (CMPSU_CHAN_CURRENT_FIRST + CMPSU_COUNT_CURRENT)
+#define CMPSU_CHAN_TEMP_FIRST    (CMPSU_CHAN_POWER_FIRST + CMPSU_COUNT_POWER)
+#define CMPSU_CHAN_FAN_FIRST     (CMPSU_CHAN_TEMP_FIRST + CMPSU_COUNT_TEMP)
+
+/* Longer gaps between two power events aren't counted towards the energy */
+#define CMPSU_ENERGY_MAX_GAP (5 * 1000000000ULL)
+
+/* Length of the reports sent by the PSU */
+#define CMPSU_EVENT_LEN 16
+
+/* Longest accepted record, including the brackets ("[P2xxxx/xxxx]" is 13) */
+#define CMPSU_RECORD_MAX 15
+
+struct cmpsu_record {
+	char type;            /* 'V', 'I', 'T', 'R' or 'P' (only P2) */
+	unsigned int channel; /* Starting at 0 */
+	unsigned int value1;  /* 0-999 for V/I/T, 0-9999 for R/P (P_in) */
+	unsigned int value2;  /* Decimal digit for V/I/T, 0-9999 for P (P_out) */
+};
+
+/* Called for each record found by cmpsu_parse() */
+typedef void (*cmpsu_record_fn)(void *ctx, const struct cmpsu_record *record);
+
+/* Parses a single null-terminated record */
+static inline bool cmpsu_parse_record(const char *data, int len,
+			struct cmpsu_record *record)
+{
+	int i;
+	
+	/* Enforce a minimum length
+	 * (square brackets + data type + channel index + value) */
+	if (len < 5)
+		return false;
+	
+	/*
+	 * sscanf() skips whitespace before numbers and glibc's also accepts a
+	 * sign (wrapping negative values), while the kernel's doesn't. Only
+	 * allowing digits and separators makes both accept the same records.
+	 */
+	for (i = 2; i < len - 1; i++) {
+		if ((data[i] < '0' || data[i] > '9') && data[i] != '.'
+		    && data[i] != '/')
+			return false;
+	}
+	
+	record->value2 = 0;
+	/* Pick the correct format string depending on the packet type */
+	switch (data[1]) {
+		/* Voltage, current, temperature: Single value with one decimal */
+		case 'V':
+		case 'I':
+		case 'T':
+			if (sscanf(data, "[%c%1u%03u.%1u]", &record->type,
+						&record->channel, &record->value1,
+						&record->value2) != 4)
+				return false;
+			break;
+		/* Fan RPM: Single value, no decimal */
+		case 'R':
+			if (sscanf(data, "[%c%1u%04u]", &record->type,
+						&record->channel, &record->value1) != 3)
+				return false;
+			break;
+		/* Power: Two values, no decimal */
+		case 'P':
+			/* Ignore packet P1 */
+			if (data[2] != '2')
+				return false;
+			if (sscanf(data, "[%c%1u%04u/%04u]", &record->type,
+						&record->channel, &record->value1,
+						&record->value2) != 4)
+				return false;
+			break;
+		default:
+			return false;
+	}
+	
+	/* Index from the device starts at 1 */
+	if (record->channel == 0)
+		return false;
+	record->channel -= 1;
+	
+	return true;
+}
+
+#define CMPSU_SWAR_ONES  0x0101010101010101ULL
+#define CMPSU_SWAR_HIGHS 0x8080808080808080ULL
+
+/* Sets the high bit of each byte in x that is zero */
+static inline uint64_t cmpsu_swar_zero(uint64_t x)
+{
+	return ~(((x & ~CMPSU_SWAR_HIGHS) + ~CMPSU_SWAR_HIGHS) | x)
+	       & CMPSU_SWAR_HIGHS;
+}
+
+/* Sets the high bit of each byte in x that is c */
+static inline uint64_t cmpsu_swar_equal(uint64_t x, uint8_t c)
+{
+	return cmpsu_swar_zero(x ^ (CMPSU_SWAR_ONES * c));
+}
+
+/* Sets the high bit of each byte in x that is an ASCII digit */
+static inline uint64_t cmpsu_swar_digit(uint64_t x)
+{
+	uint64_t t = x ^ (CMPSU_SWAR_ONES * '0');
+	
+	/* Digits are now 0-9, everything else is >= 10 */
+	return ~(((t & ~CMPSU_SWAR_HIGHS) + CMPSU_SWAR_ONES * (0x80 - 10)) | t)
+	       & CMPSU_SWAR_HIGHS;
+}
+
+/* Gathers the high bits of all bytes in x into bits 0-7 */
+static inline uint32_t cmpsu_swar_bits(uint64_t x)
+{
+	return ((x >> 7) * 0x0102040810204080ULL) >> 56;
+}
+
+/* Same for both halves of a report, giving one bit per byte */
+#define CMPSU_SWAR_MASK(lo, hi, fn, ...) \
+	(cmpsu_swar_bits(fn(lo, ##__VA_ARGS__)) \
+	 | cmpsu_swar_bits(fn(hi, ##__VA_ARGS__)) << 8)
+
+enum cmpsu_layout {
+	CMPSU_LAYOUT_INVALID, /* No record at all, can be dropped */
+	CMPSU_LAYOUT_OTHER,   /* Anything unusual, needs to be scanned */
+	CMPSU_LAYOUT_INTEGER, /* [R1650] */
+	CMPSU_LAYOUT_DECIMAL, /* [V1226.2] */
+	CMPSU_LAYOUT_SLASH,   /* [P20145/0137] */
+};
+
+/*
+ * Classifies a 16 byte report that starts with '['. On success, *close is the
+ * position of the ']' and *sep the position of the '.' or '/', if any.
+ */
+static inline enum cmpsu_layout cmpsu_classify(const uint8_t *data,
+			int *close, int *sep)
+{
+	uint64_t lo = cmpsu_load_le64(data);
+	uint64_t hi = cmpsu_load_le64(data + 8);
+	uint32_t digits = CMPSU_SWAR_MASK(lo, hi, cmpsu_swar_digit);
+	uint32_t dots = CMPSU_SWAR_MASK(lo, hi, cmpsu_swar_equal, '.');
+	uint32_t slashes = CMPSU_SWAR_MASK(lo, hi, cmpsu_swar_equal, '/');
+	uint32_t opens = CMPSU_SWAR_MASK(lo, hi, cmpsu_swar_equal, '[');
+	uint32_t closes = CMPSU_SWAR_MASK(lo, hi, cmpsu_swar_equal, ']');
+	uint32_t zeros = CMPSU_SWAR_MASK(lo, hi, cmpsu_swar_zero);
+	uint32_t body;
+	uint32_t tail;
+	uint32_t seps;
+	
+	/* Without a closing bracket, the scanner wouldn't find a record either */
+	if (!closes)
+		return CMPSU_LAYOUT_INVALID;
+	*close = cmpsu_ffs(closes);
+	
+	/* Another record might start inside this one */
+	if (opens != 1 || *close >= CMPSU_RECORD_MAX)
+		return CMPSU_LAYOUT_OTHER;
+	
+	/* Anything but padding after the record might be another record */
+	tail = 0xffff & ~((2U << *close) - 1);
+	if ((zeros & tail) != tail || (zeros & ~tail))
+		return CMPSU_LAYOUT_OTHER;
+	
+	/* Type, channel digit and at least one value digit */
+	if (*close < 4 || !(digits & (1U << 2)))
+		return CMPSU_LAYOUT_OTHER;
+	
+	/* The value may only contain digits and one inner separator */
+	body = ((1U << *close) - 1) & ~0x7U;
+	seps = (dots | slashes) & body;
+	if (((digits | seps) & body) != body || (seps & (seps - 1))
+	    || (seps & ((1U << 3) | (1U << (*close - 1)))))
+		return CMPSU_LAYOUT_OTHER;
+	
+	if (!seps)
+		return CMPSU_LAYOUT_INTEGER;
+	*sep = cmpsu_ffs(seps);
+	return (seps & dots) ? CMPSU_LAYOUT_DECIMAL : CMPSU_LAYOUT_SLASH;
+}
+
+static inline unsigned int cmpsu_digits(const uint8_t *data, int from, int to)
+{
+	unsigned int value = 0;
+	
+	for (; from < to; from++)
+		value = value * 10 + (data[from] - '0');
+	
+	return value;
+}
+
+/*
+ * Fast path for a 16 byte report that starts with '['. Returns 1 if it
+ * contains a single well-formed record, 0 if it doesn't contain any record
+ * and -1 if it needs to be scanned instead.
+ */
+static inline int cmpsu_parse_fast(const uint8_t *data,
+			struct cmpsu_record *record)
+{
+	enum cmpsu_layout layout;
+	int close;
+	int sep = 0;
+	
+	layout = cmpsu_classify(data, &close, &sep);
+	if (layout == CMPSU_LAYOUT_INVALID)
+		return 0;
+	if (layout == CMPSU_LAYOUT_OTHER)
+		return -1;
+	
+	record->type = data[1];
+	record->channel = data[2] - '0';
+	/* Same digit limits as the format strings in cmpsu_parse_record() */
+	switch (data[1]) {
+		case 'V':
+		case 'I':
+		case 'T':
+			if (layout != CMPSU_LAYOUT_DECIMAL || sep > 6
+			    || close != sep + 2)
+				return -1;
+			record->value1 = cmpsu_digits(data, 3, sep);
+			record->value2 = data[sep + 1] - '0';
+			break;
+		case 'R':
+			if (layout != CMPSU_LAYOUT_INTEGER || close > 7)
+				return -1;
+			record->value1 = cmpsu_digits(data, 3, close);
+			record->value2 = 0;
+			break;
+		case 'P':
+			/* Ignore packet P1 */
+			if (data[2] != '2')
+				return 0;
+			if (layout != CMPSU_LAYOUT_SLASH || sep > 7 || close - sep > 5)
+				return -1;
+			record->value1 = cmpsu_digits(data, 3, sep);
+			record->value2 = cmpsu_digits(data, sep + 1, close);
+			break;
+		default:
+			/* Unknown type, the scanner would ignore it as well */
+			return 0;
+	}
+	
+	/* Index from the device starts at 1 */
+	if (record->channel == 0)
+		return 0;
+	record->channel -= 1;
+	
+	return 1;
+}
+
+/*
+ * Calls fn for each record in a report of any length. 16 byte reports with a
+ * single record take the fast path, everything else is scanned for records.
+ */
+static inline void cmpsu_parse(const uint8_t *data, int size,
+			cmpsu_record_fn fn, void *ctx)
+{
+	struct cmpsu_record record;
+	char buf[CMPSU_RECORD_MAX + 1];
+	const uint8_t *end;
+	const uint8_t *start;
+	int len;
+	
+	if (size == CMPSU_EVENT_LEN && data[0] == '[') {
+		switch (cmpsu_parse_fast(data, &record)) {
+			case 1:
+				fn(ctx, &record);
+				return;
+			case 0:
+				return;
+		}
+	}
+	
+	while (size > 0) {
+		start = memchr(data, '[', size);
+		if (!start)
+			break;
+		size -= start - data;
+	
+		end = memchr(start, ']',
+					size < CMPSU_RECORD_MAX ? size : CMPSU_RECORD_MAX);
+		if (!end) {
+			/* Not a record, keep looking after the bracket */
+			data = start + 1;
+			size--;
+			continue;
+		}
+	
+		len = end - start + 1;
+		memcpy(buf, start, len);
+		buf[len] = 0;
+		if (cmpsu_parse_record(buf, len, &record))
+			fn(ctx, &record);
+	
+		data = end + 1;
+		size -= len;
+	}
+}
+
+/*
+ * Converts a record to the units of the hwmon attributes (mV, mA, m°C, RPM
+ * and uW). P2 gives P_in in values[0] and P_out in values[1], the others only
+ * values[0]. Returns the index of the (first) channel, or -1 for channels
+ * that aren't supported and values outside the ranges of struct cmpsu_record,
+ * so a decoder change that lets larger values through can't wrap them.
+ */
+static inline int cmpsu_record_convert(const struct cmpsu_record *record,
+			int64_t values[2])
+{
+	unsigned int channel = record->channel;
+	
+	if (record->type != 'R' && record->type != 'P'
+	    && (record->value1 > 999 || record->value2 > 9))
+		return -1;
+	
+	values[0] = (int64_t) record->value1 * 1000
+		    + (int64_t) record->value2 * 100;
+	switch (record->type) {
+		case 'V':
+			if (channel < CMPSU_COUNT_VOLTAGE)
+				return CMPSU_CHAN_VOLTAGE_FIRST + channel;
+			break;
+		case 'I':
+			if (channel < CMPSU_COUNT_CURRENT)
+				return CMPSU_CHAN_CURRENT_FIRST + channel;
+			break;
+		case 'T':
+			if (channel < CMPSU_COUNT_TEMP)
+				return CMPSU_CHAN_TEMP_FIRST + channel;
+			break;
+		case 'R':
+			if (channel >= CMPSU_COUNT_FAN || record->value1 > 9999)
+				break;
+			values[0] = record->value1;
+			return CMPSU_CHAN_FAN_FIRST + channel;
+		case 'P':
+			/* P2 contains both P_in and P_out */
+			if (channel != 1 || record->value1 > 9999
+			    || record->value2 > 9999)
+				break;
+			values[0] = (int64_t) record->value1 * 1000000;
+			values[1] = (int64_t) record->value2 * 1000000;
+			return CMPSU_CHAN_POWER_FIRST;
+	}
+	
+	return -1;
+}
+
+/*
+ * Energy step of a power event after gap ns at the previous P_in (uW, -1 if
+ * there was none). Sets *energy to the consumed energy in uJ and returns
+ * whether the interval counts, which it doesn't without a previous P_in or
+ * after a gap of more than CMPSU_ENERGY_MAX_GAP.
+ */
+static inline bool cmpsu_energy_step(int64_t p_in, uint64_t gap,
+			uint64_t *energy)
+{
+	*energy = 0;
+	if (p_in < 0 || gap > CMPSU_ENERGY_MAX_GAP)
+		return false;
+	
+	/* uW * us / 10^6 = uJ */
+	*energy = cmpsu_div_u64((uint64_t) p_in * cmpsu_div_u64(gap, 1000),
+				1000000);
+	return true;
+}
+
+#endif /* _CM_PSU_PROTO_H */
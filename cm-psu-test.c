@@ -0,0 +1,621 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cm-psu-test.c - KUnit tests for the cm-psu driver
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ *
+ * Runs cmpsu_classify(), cmpsu_parse_fast() and cmpsu_parse() on a table of
+ * reports and checks the decoded records, so changes to the decoder can be
+ * tested without a PSU. The timing cases print the time per report of each
+ * record type, for the fast path and for the scanner.
+ *
+ * The hwmon cases feed reports through cmpsu_decode() into a PSU that was
+ * only set up with cmpsu_setup() and check what cmpsu_hwmon_read() returns
+ * for them. Their timing case prints the time per report of
+ * cmpsu_raw_event() with the features the driver was built with. This file
+ * is included at the end of cm-psu.c to reach these.
+ */
+
+#include <kunit/test.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/string.h>
+
+/* Longest report in the table */
+#define CMPSU_TEST_MAX 32
+
+/* Number of reports decoded by each timing case */
+#define CMPSU_TEST_LOOPS 100000
+
+struct cmpsu_test_case {
+	const char *name;
+	u8 data[CMPSU_TEST_MAX];
+	int size;
+	/* Expected results, layout and fast are only checked for 16 byte
+	 * reports starting with '[' */
+	enum cmpsu_layout layout;
+	int fast;
+	int count;
+	struct cmpsu_record records[2];
+};
+
+#define CMPSU_TEST_RECORD(t, c, v1, v2) \
+	{ .type = (t), .channel = (c), .value1 = (v1), .value2 = (v2) }
+
+static const struct cmpsu_test_case cmpsu_test_cases[] = {
+	/* Valid reports as sent by the PSU */
+	{ "voltage", "[V1226.2]", 16, CMPSU_LAYOUT_DECIMAL, 1, 1,
+		{ CMPSU_TEST_RECORD('V', 0, 226, 2) } },
+	{ "voltage 12V1", "[V5012.1]", 16, CMPSU_LAYOUT_DECIMAL, 1, 1,
+		{ CMPSU_TEST_RECORD('V', 4, 12, 1) } },
+	{ "current", "[I2012.4]", 16, CMPSU_LAYOUT_DECIMAL, 1, 1,
+		{ CMPSU_TEST_RECORD('I', 1, 12, 4) } },
+	{ "temperature", "[T2042.5]", 16, CMPSU_LAYOUT_DECIMAL, 1, 1,
+		{ CMPSU_TEST_RECORD('T', 1, 42, 5) } },
+	{ "fan", "[R10650]", 16, CMPSU_LAYOUT_INTEGER, 1, 1,
+		{ CMPSU_TEST_RECORD('R', 0, 650, 0) } },
+	{ "power", "[P20145/0137]", 16, CMPSU_LAYOUT_SLASH, 1, 1,
+		{ CMPSU_TEST_RECORD('P', 1, 145, 137) } },
+	{ "P1 ignored", "[P10092/0000]", 16, CMPSU_LAYOUT_SLASH, 0, 0 },
+
+	/* Boundaries of the value ranges */
+	{ "voltage max", "[V9999.9]", 16, CMPSU_LAYOUT_DECIMAL, 1, 1,
+		{ CMPSU_TEST_RECORD('V', 8, 999, 9) } },
+	{ "voltage short", "[V10.1]", 16, CMPSU_LAYOUT_DECIMAL, 1, 1,
+		{ CMPSU_TEST_RECORD('V', 0, 0, 1) } },
+	{ "voltage too long", "[V11000.0]", 16, CMPSU_LAYOUT_DECIMAL, -1, 0 },
+	{ "fan max", "[R19999]", 16, CMPSU_LAYOUT_INTEGER, 1, 1,
+		{ CMPSU_TEST_RECORD('R', 0, 9999, 0) } },
+	/* sscanf() stops at the digit limit and ignores the rest */
+	{ "fan too long", "[R110000]", 16, CMPSU_LAYOUT_INTEGER, -1, 1,
+		{ CMPSU_TEST_RECORD('R', 0, 1000, 0) } },
+	{ "power max", "[P29999/9999]", 16, CMPSU_LAYOUT_SLASH, 1, 1,
+		{ CMPSU_TEST_RECORD('P', 1, 9999, 9999) } },
+	{ "channel 0", "[V0230.0]", 16, CMPSU_LAYOUT_DECIMAL, 0, 0 },
+	{ "shortest", "[R11]", 16, CMPSU_LAYOUT_INTEGER, 1, 1,
+		{ CMPSU_TEST_RECORD('R', 0, 1, 0) } },
+
+	/* Truncated reports */
+	{ "no close", "[V1226.2", 16, CMPSU_LAYOUT_INVALID, 0, 0 },
+	{ "no value", "[V1]", 16, CMPSU_LAYOUT_OTHER, -1, 0 },
+	{ "short report", "[V1226.2]", 8, 0, 0, 0 },
+	{ "empty", "", 16, CMPSU_LAYOUT_INVALID, 0, 0 },
+
+	/* Corrupted reports */
+	{ "bad digit", "[V12?6.2]", 16, CMPSU_LAYOUT_OTHER, -1, 0 },
+	{ "sign", "[V1-26.2]", 16, CMPSU_LAYOUT_OTHER, -1, 0 },
+	{ "space", "[V1 26.2]", 16, CMPSU_LAYOUT_OTHER, -1, 0 },
+	{ "two separators", "[P20145//137]", 16, CMPSU_LAYOUT_OTHER, -1, 0 },
+	{ "wrong separator", "[V1226/2]", 16, CMPSU_LAYOUT_SLASH, -1, 0 },
+	{ "unknown type", "[X1226.2]", 16, CMPSU_LAYOUT_DECIMAL, 0, 0 },
+	{ "garbage after", "[V1226.2]x", 16, CMPSU_LAYOUT_OTHER, -1, 1,
+		{ CMPSU_TEST_RECORD('V', 0, 226, 2) } },
+	{ "close too far", "[V1226.2\0\0\0\0\0\0\0]", 16, CMPSU_LAYOUT_OTHER, -1,
+		0 },
+
+	/* Several records or other framing */
+	{ "two records", "[R10650][R20700]", 16, CMPSU_LAYOUT_OTHER, -1, 2,
+		{ CMPSU_TEST_RECORD('R', 0, 650, 0),
+		  CMPSU_TEST_RECORD('R', 1, 700, 0) } },
+	{ "two records, long", "[V1226.2][P20145/0137]", 22, 0, 0, 2,
+		{ CMPSU_TEST_RECORD('V', 0, 226, 2),
+		  CMPSU_TEST_RECORD('P', 1, 145, 137) } },
+	{ "bad record first", "[V1?][T1038.5]", 16, CMPSU_LAYOUT_OTHER, -1, 1,
+		{ CMPSU_TEST_RECORD('T', 0, 38, 5) } },
+	{ "report ID", "\x01[V1226.2]", 16, 0, 0, 1,
+		{ CMPSU_TEST_RECORD('V', 0, 226, 2) } },
+	{ "nested open", "[V1[V1226.2]", 16, CMPSU_LAYOUT_OTHER, -1, 0 },
+};
+
+static void cmpsu_test_case_desc(const struct cmpsu_test_case *t, char *desc)
+{
+	strscpy(desc, t->name, KUNIT_PARAM_DESC_SIZE);
+}
+
+KUNIT_ARRAY_PARAM(cmpsu_test_cases, cmpsu_test_cases, cmpsu_test_case_desc);
+
+/* Whether cmpsu_parse() takes the fast path for a report */
+static bool cmpsu_test_fast_path(const struct cmpsu_test_case *t)
+{
+	return t->size == CMPSU_EVENT_LEN && t->data[0] == '[';
+}
+
+static void cmpsu_test_record_eq(struct kunit *test,
+			const struct cmpsu_record *record,
+			const struct cmpsu_record *expected)
+{
+	KUNIT_EXPECT_EQ(test, record->type, expected->type);
+	KUNIT_EXPECT_EQ(test, record->channel, expected->channel);
+	KUNIT_EXPECT_EQ(test, record->value1, expected->value1);
+	KUNIT_EXPECT_EQ(test, record->value2, expected->value2);
+}
+
+struct cmpsu_test_records {
+	struct cmpsu_record records[CMPSU_TEST_MAX / 5];
+	int count;
+};
+
+static void cmpsu_test_add(void *ctx, const struct cmpsu_record *record)
+{
+	struct cmpsu_test_records *found = ctx;
+	
+	if (found->count < ARRAY_SIZE(found->records))
+		found->records[found->count] = *record;
+	found->count++;
+}
+
+static void cmpsu_test_classify(struct kunit *test)
+{
+	const struct cmpsu_test_case *t = test->param_value;
+	enum cmpsu_layout layout;
+	int close = -1;
+	int sep = -1;
+	
+	if (!cmpsu_test_fast_path(t))
+		kunit_skip(test, "not classified");
+	
+	layout = cmpsu_classify(t->data, &close, &sep);
+	KUNIT_EXPECT_EQ(test, layout, t->layout);
+	if (layout == CMPSU_LAYOUT_INVALID)
+		return;
+	
+	KUNIT_ASSERT_GE(test, close, 0);
+	KUNIT_ASSERT_LT(test, close, CMPSU_EVENT_LEN);
+	KUNIT_EXPECT_EQ(test, t->data[close], ']');
+	if (layout == CMPSU_LAYOUT_DECIMAL)
+		KUNIT_EXPECT_EQ(test, t->data[sep], '.');
+	else if (layout == CMPSU_LAYOUT_SLASH)
+		KUNIT_EXPECT_EQ(test, t->data[sep], '/');
+}
+
+static void cmpsu_test_parse_fast(struct kunit *test)
+{
+	const struct cmpsu_test_case *t = test->param_value;
+	struct cmpsu_record record;
+	int ret;
+	
+	if (!cmpsu_test_fast_path(t))
+		kunit_skip(test, "not on the fast path");
+	
+	ret = cmpsu_parse_fast(t->data, &record);
+	KUNIT_EXPECT_EQ(test, ret, t->fast);
+	if (ret == 1)
+		cmpsu_test_record_eq(test, &record, &t->records[0]);
+}
+
+static void cmpsu_test_parse(struct kunit *test)
+{
+	const struct cmpsu_test_case *t = test->param_value;
+	struct cmpsu_test_records found = { .count = 0 };
+	int i;
+	
+	cmpsu_parse(t->data, t->size, cmpsu_test_add, &found);
+	KUNIT_ASSERT_EQ(test, found.count, t->count);
+	for (i = 0; i < found.count; i++)
+		cmpsu_test_record_eq(test, &found.records[i], &t->records[i]);
+}
+
+/* The scanner alone has to find the same records as the fast path */
+static void cmpsu_test_parse_scan(struct kunit *test)
+{
+	const struct cmpsu_test_case *t = test->param_value;
+	struct cmpsu_test_records fast = { .count = 0 };
+	struct cmpsu_test_records scan = { .count = 0 };
+	u8 data[CMPSU_EVENT_LEN + 1] = { 0 };
+	int i;
+	
+	if (!cmpsu_test_fast_path(t))
+		kunit_skip(test, "not on the fast path");
+	
+	/* A trailing zero byte changes nothing but the path */
+	memcpy(data, t->data, CMPSU_EVENT_LEN);
+	cmpsu_parse(t->data, CMPSU_EVENT_LEN, cmpsu_test_add, &fast);
+	cmpsu_parse(data, sizeof(data), cmpsu_test_add, &scan);
+	KUNIT_ASSERT_EQ(test, scan.count, fast.count);
+	for (i = 0; i < scan.count; i++)
+		cmpsu_test_record_eq(test, &scan.records[i], &fast.records[i]);
+}
+
+struct cmpsu_test_timing {
+	const char *name;
+	const char *report;
+	int size; /* 17 to use the scanner */
+};
+
+static const struct cmpsu_test_timing cmpsu_test_timings[] = {
+	{ "voltage", "[V1226.2]", 16 },
+	{ "current", "[I2012.4]", 16 },
+	{ "temperature", "[T2042.5]", 16 },
+	{ "fan", "[R10650]", 16 },
+	{ "power", "[P20145/0137]", 16 },
+	{ "voltage, scanner", "[V1226.2]", 17 },
+	{ "fan, scanner", "[R10650]", 17 },
+	{ "power, scanner", "[P20145/0137]", 17 },
+};
+
+static void cmpsu_test_timing_desc(const struct cmpsu_test_timing *t,
+			char *desc)
+{
+	strscpy(desc, t->name, KUNIT_PARAM_DESC_SIZE);
+}
+
+KUNIT_ARRAY_PARAM(cmpsu_test_timings, cmpsu_test_timings,
+			cmpsu_test_timing_desc);
+
+static void cmpsu_test_count(void *ctx, const struct cmpsu_record *record)
+{
+	unsigned long *count = ctx;
+	
+	(*count)++;
+}
+
+static void cmpsu_test_timing(struct kunit *test)
+{
+	const struct cmpsu_test_timing *t = test->param_value;
+	u8 data[CMPSU_EVENT_LEN + 1] = { 0 };
+	unsigned long count = 0;
+	u64 start;
+	u64 elapsed;
+	int i;
+	
+	memcpy(data, t->report, strlen(t->report));
+	start = ktime_get_ns();
+	for (i = 0; i < CMPSU_TEST_LOOPS; i++)
+		cmpsu_parse(data, t->size, cmpsu_test_count, &count);
+	elapsed = ktime_get_ns() - start;
+	
+	KUNIT_EXPECT_EQ(test, count, CMPSU_TEST_LOOPS);
+	kunit_info(test, "%s: %llu ns/report\n", t->name,
+				div_u64(elapsed, CMPSU_TEST_LOOPS));
+}
+
+/* Product used by the hwmon cases, a V850 GOLD i MULTI */
+#define CMPSU_TEST_PRODUCT 0x0193
+
+/* The PSU of a hwmon case, set up in cmpsu_test_hwmon_init() */
+struct cmpsu_test_psu {
+	struct cmpsu_data priv;
+	/* Only carry priv as driver data, like the real ones in probe */
+	struct hid_device hdev;
+	struct device dev;
+};
+
+static int cmpsu_test_hwmon_init(struct kunit *test)
+{
+	struct cmpsu_test_psu *psu;
+	
+	psu = kunit_kzalloc(test, sizeof(*psu), GFP_KERNEL);
+	if (!psu)
+		return -ENOMEM;
+	
+	/* Without cmpsu_defer_setup(), reports are always decoded directly */
+	cmpsu_setup(&psu->priv, cmpsu_model_find(CMPSU_TEST_PRODUCT));
+	psu->hdev.product = CMPSU_TEST_PRODUCT;
+	psu->hdev.dev.init_name = "cm-psu-test";
+	psu->priv.hdev = &psu->hdev;
+	hid_set_drvdata(&psu->hdev, &psu->priv);
+	dev_set_drvdata(&psu->dev, &psu->priv);
+	test->priv = psu;
+	return 0;
+}
+
+/* Same as the end of cmpsu_remove() for a PSU without registered devices */
+static void cmpsu_test_hwmon_exit(struct kunit *test)
+{
+	struct cmpsu_test_psu *psu = test->priv;
+	struct cmpsu_data *priv = &psu->priv;
+	
+	cmpsu_limits_remove(priv);
+	cmpsu_total_update(-max(priv->values_power[0], 0L),
+				-max(priv->values_power[1], 0L), 0);
+	cmpsu_thermal_remove(priv);
+}
+
+static void cmpsu_test_feed(struct kunit *test, const char *report)
+{
+	struct cmpsu_test_psu *psu = test->priv;
+	u8 data[CMPSU_EVENT_LEN] = { 0 };
+	
+	memcpy(data, report, strlen(report));
+	cmpsu_decode(&psu->priv, data, sizeof(data));
+}
+
+static long cmpsu_test_read(struct kunit *test, enum hwmon_sensor_types type,
+			u32 attr, int channel)
+{
+	struct cmpsu_test_psu *psu = test->priv;
+	long val = 0;
+	
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_read(&psu->dev, type, attr, channel,
+				&val), 0);
+	return val;
+}
+
+struct cmpsu_test_input {
+	const char *name;
+	const char *report;
+	enum hwmon_sensor_types type;
+	u32 attr;
+	int channel;
+	long value; /* Expected after the report, in the unit of the attribute */
+};
+
+static const struct cmpsu_test_input cmpsu_test_inputs[] = {
+	{ "in0", "[V1226.2]", hwmon_in, hwmon_in_input, 0, 226200 },
+	{ "in4", "[V5012.1]", hwmon_in, hwmon_in_input, 4, 12100 },
+	{ "curr1", "[I1001.2]", hwmon_curr, hwmon_curr_input, 0, 1200 },
+	{ "curr5", "[I5010.4]", hwmon_curr, hwmon_curr_input, 4, 10400 },
+	{ "power1", "[P20250/0230]", hwmon_power, hwmon_power_input, 0,
+		250000000 },
+	{ "power2", "[P20250/0230]", hwmon_power, hwmon_power_input, 1,
+		230000000 },
+	{ "temp1", "[T1038.5]", hwmon_temp, hwmon_temp_input, 0, 38500 },
+	{ "temp2", "[T2042.5]", hwmon_temp, hwmon_temp_input, 1, 42500 },
+	{ "fan1", "[R10650]", hwmon_fan, hwmon_fan_input, 0, 650 },
+	{ "fan1 max", "[R19999]", hwmon_fan, hwmon_fan_input, 0, 9999 },
+};
+
+static void cmpsu_test_input_desc(const struct cmpsu_test_input *t,
+			char *desc)
+{
+	strscpy(desc, t->name, KUNIT_PARAM_DESC_SIZE);
+}
+
+KUNIT_ARRAY_PARAM(cmpsu_test_inputs, cmpsu_test_inputs, cmpsu_test_input_desc);
+
+/* Every input stays -ENODATA until its first record */
+static void cmpsu_test_hwmon_nodata(struct kunit *test)
+{
+	const struct cmpsu_test_input *t = test->param_value;
+	struct cmpsu_test_psu *psu = test->priv;
+	long val;
+	
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_read(&psu->dev, t->type, t->attr,
+				t->channel, &val), -ENODATA);
+	
+	/* Records of unsupported channels and P1 are dropped */
+	cmpsu_test_feed(test, "[V6012.0]");
+	cmpsu_test_feed(test, "[I6001.0]");
+	cmpsu_test_feed(test, "[T3040.0]");
+	cmpsu_test_feed(test, "[R20650]");
+	cmpsu_test_feed(test, "[P10250/0230]");
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_read(&psu->dev, t->type, t->attr,
+				t->channel, &val), -ENODATA);
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_energy,
+				hwmon_energy_input, 0), 0);
+}
+
+static void cmpsu_test_hwmon_input(struct kunit *test)
+{
+	const struct cmpsu_test_input *t = test->param_value;
+	
+	cmpsu_test_feed(test, t->report);
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, t->type, t->attr, t->channel),
+				t->value);
+}
+
+/* Energy is only counted from the second power record on */
+static void cmpsu_test_hwmon_energy(struct kunit *test)
+{
+	struct cmpsu_test_psu *psu = test->priv;
+	
+	cmpsu_test_feed(test, "[P20250/0230]");
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_energy,
+				hwmon_energy_input, 0), 0);
+	
+	/* 250 W for one second */
+	psu->priv.energy_updated -= NSEC_PER_SEC;
+	cmpsu_test_feed(test, "[P20100/0090]");
+	KUNIT_EXPECT_GE(test, cmpsu_test_read(test, hwmon_energy,
+				hwmon_energy_input, 0), 250000000);
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_power,
+				hwmon_power_input, 0), 100000000);
+	
+	/* Gaps longer than CMPSU_ENERGY_MAX_GAP aren't counted */
+	psu->priv.energy = 0;
+	psu->priv.energy_updated -= 2 * CMPSU_ENERGY_MAX_GAP;
+	cmpsu_test_feed(test, "[P20100/0090]");
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_energy,
+				hwmon_energy_input, 0), 0);
+}
+
+#if IS_ENABLED(CONFIG_CM_PSU_LIMITS)
+
+static void cmpsu_test_hwmon_limits(struct kunit *test)
+{
+	struct cmpsu_test_psu *psu = test->priv;
+	
+	/* Defaults from cmpsu_limits_setup() */
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_in, hwmon_in_min, 1),
+				4750);
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_in, hwmon_in_max, 1),
+				5250);
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_temp, hwmon_temp_max,
+				0), 70000);
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_temp, hwmon_temp_crit,
+				0), 85000);
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_fan, hwmon_fan_min, 0),
+				0);
+	
+	/* Written limits are clamped */
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_write(&psu->dev, hwmon_temp,
+				hwmon_temp_max, 1, 200000), 0);
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_temp, hwmon_temp_max,
+				1), 150000);
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_write(&psu->dev, hwmon_fan,
+				hwmon_fan_min, 0, -1), 0);
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_fan, hwmon_fan_min, 0),
+				0);
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_write(&psu->dev, hwmon_curr,
+				hwmon_curr_input, 0, 0), -EOPNOTSUPP);
+}
+
+static void cmpsu_test_hwmon_alarms(struct kunit *test)
+{
+	struct cmpsu_test_psu *psu = test->priv;
+	
+	/* +5V below and above its tolerance, then back inside */
+	cmpsu_test_feed(test, "[V2004.5]");
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_in,
+				hwmon_in_min_alarm, 1), 1);
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_in,
+				hwmon_in_max_alarm, 1), 0);
+	cmpsu_test_feed(test, "[V2005.5]");
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_in,
+				hwmon_in_min_alarm, 1), 0);
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_in,
+				hwmon_in_max_alarm, 1), 1);
+	cmpsu_test_feed(test, "[V2005.0]");
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_in,
+				hwmon_in_max_alarm, 1), 0);
+	
+	/* temp1 above temp1_max, then temp1_max raised above it */
+	cmpsu_test_feed(test, "[T1075.0]");
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_temp,
+				hwmon_temp_max_alarm, 0), 1);
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_temp,
+				hwmon_temp_crit_alarm, 0), 0);
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_write(&psu->dev, hwmon_temp,
+				hwmon_temp_max, 0, 80000), 0);
+	cmpsu_test_feed(test, "[T1075.0]");
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_temp,
+				hwmon_temp_max_alarm, 0), 0);
+	cmpsu_test_feed(test, "[T1090.0]");
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_temp,
+				hwmon_temp_crit_alarm, 0), 1);
+	
+	/* A stopped fan is only a stall above fan_stall_load */
+	cmpsu_test_feed(test, "[R10000]");
+	cmpsu_test_feed(test, "[P20050/0040]");
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_fan, hwmon_fan_alarm,
+				0), 0);
+	cmpsu_test_feed(test, "[P20900/0800]");
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_fan, hwmon_fan_alarm,
+				0), 1);
+	cmpsu_test_feed(test, "[R10650]");
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_fan, hwmon_fan_alarm,
+				0), 0);
+	
+	/* Fanless models report R1 as 0 and never stall */
+	psu->priv.model = cmpsu_model_find(0x01A5);
+	cmpsu_test_feed(test, "[R10000]");
+	KUNIT_EXPECT_EQ(test, cmpsu_test_read(test, hwmon_fan, hwmon_fan_alarm,
+				0), 0);
+}
+
+#else
+
+static void cmpsu_test_hwmon_limits(struct kunit *test)
+{
+	kunit_skip(test, "built without CONFIG_CM_PSU_LIMITS");
+}
+
+static void cmpsu_test_hwmon_alarms(struct kunit *test)
+{
+	kunit_skip(test, "built without CONFIG_CM_PSU_LIMITS");
+}
+
+#endif /* IS_ENABLED(CONFIG_CM_PSU_LIMITS) */
+
+static void cmpsu_test_hwmon_visible(struct kunit *test)
+{
+	struct cmpsu_test_psu *psu = test->priv;
+	const struct cmpsu_data *priv = &psu->priv;
+	
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_is_visible(priv, hwmon_in,
+				hwmon_in_input, 0), 0444);
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_is_visible(priv, hwmon_in,
+				hwmon_in_min, 1), 0644);
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_is_visible(priv, hwmon_in,
+				hwmon_in_input, COUNT_VOLTAGE), 0);
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_is_visible(priv, hwmon_temp,
+				hwmon_temp_crit, 1), 0644);
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_is_visible(priv, hwmon_energy,
+				hwmon_energy_input, 0), 0444);
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_is_visible(priv, hwmon_fan,
+				hwmon_fan_input, 0), 0444);
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_is_visible(priv, hwmon_fan,
+				hwmon_fan_min, 0), 0644);
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_is_visible(priv, hwmon_fan,
+				hwmon_fan_alarm, 0), 0444);
+	
+	/* Fanless models keep fan1_input, but have no stall detection */
+	psu->priv.model = cmpsu_model_find(0x01A5);
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_is_visible(priv, hwmon_fan,
+				hwmon_fan_input, 0), 0444);
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_is_visible(priv, hwmon_fan,
+				hwmon_fan_min, 0), 0);
+	KUNIT_EXPECT_EQ(test, cmpsu_hwmon_is_visible(priv, hwmon_fan,
+				hwmon_fan_alarm, 0), 0);
+}
+
+/* A cycle of a V850 GOLD i MULTI, like cmpsu-emu sends */
+static const char * const cmpsu_test_cycle[] = {
+	"[V1230.0]", "[V2005.0]", "[V3003.3]", "[V4012.1]", "[V5012.0]",
+	"[I1001.2]", "[I2003.1]", "[I3002.0]", "[I4010.4]", "[I5010.2]",
+	"[P20250/0230]", "[T1038.5]", "[T2042.5]", "[R10650]",
+};
+
+/*
+ * Time per report of cmpsu_raw_event(), including the hooks of all features
+ * the driver was built with. Build it with different options (see README.md)
+ * to compare their cost.
+ */
+static void cmpsu_test_hwmon_timing(struct kunit *test)
+{
+	struct cmpsu_test_psu *psu = test->priv;
+	u8 data[ARRAY_SIZE(cmpsu_test_cycle)][CMPSU_EVENT_LEN] = { };
+	u64 start;
+	u64 elapsed;
+	int i;
+	
+	for (i = 0; i < ARRAY_SIZE(cmpsu_test_cycle); i++)
+		memcpy(data[i], cmpsu_test_cycle[i], strlen(cmpsu_test_cycle[i]));
+	
+	start = ktime_get_ns();
+	for (i = 0; i < CMPSU_TEST_LOOPS; i++)
+		cmpsu_raw_event(&psu->hdev, NULL,
+					data[i % ARRAY_SIZE(cmpsu_test_cycle)],
+					CMPSU_EVENT_LEN);
+	elapsed = ktime_get_ns() - start;
+	
+	KUNIT_EXPECT_EQ(test, psu->priv.seq_voltage[0],
+				DIV_ROUND_UP(CMPSU_TEST_LOOPS,
+					ARRAY_SIZE(cmpsu_test_cycle)));
+	kunit_info(test, "raw_event: %llu ns/report\n",
+				div_u64(elapsed, CMPSU_TEST_LOOPS));
+}
+
+static struct kunit_case cmpsu_test_suite_cases[] = {
+	KUNIT_CASE_PARAM(cmpsu_test_classify, cmpsu_test_cases_gen_params),
+	KUNIT_CASE_PARAM(cmpsu_test_parse_fast, cmpsu_test_cases_gen_params),
+	KUNIT_CASE_PARAM(cmpsu_test_parse, cmpsu_test_cases_gen_params),
+	KUNIT_CASE_PARAM(cmpsu_test_parse_scan, cmpsu_test_cases_gen_params),
+	KUNIT_CASE_PARAM(cmpsu_test_timing, cmpsu_test_timings_gen_params),
+	{ }
+};
+
+static struct kunit_suite cmpsu_test_suite = {
+	.name = "cm-psu",
+	.test_cases = cmpsu_test_suite_cases,
+};
+
+static struct kunit_case cmpsu_test_hwmon_cases[] = {
+	KUNIT_CASE_PARAM(cmpsu_test_hwmon_nodata, cmpsu_test_inputs_gen_params),
+	KUNIT_CASE_PARAM(cmpsu_test_hwmon_input, cmpsu_test_inputs_gen_params),
+	KUNIT_CASE(cmpsu_test_hwmon_energy),
+	KUNIT_CASE(cmpsu_test_hwmon_limits),
+	KUNIT_CASE(cmpsu_test_hwmon_alarms),
+	KUNIT_CASE(cmpsu_test_hwmon_visible),
+	KUNIT_CASE(cmpsu_test_hwmon_timing),
+	{ }
+};
+
+static struct kunit_suite cmpsu_test_hwmon_suite = {
+	.name = "cm-psu-hwmon",
+	.init = cmpsu_test_hwmon_init,
+	.exit = cmpsu_test_hwmon_exit,
+	.test_cases = cmpsu_test_hwmon_cases,
+};
+
+kunit_test_suites(&cmpsu_test_suite, &cmpsu_test_hwmon_suite);
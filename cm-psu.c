@@ -7,20 +7,53 @@
  * Copyright (C) 2020 Wilken Gottwalt <wilken.gottwalt@posteo.net>
  */
 
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
 #include <linux/errno.h>
+#include <linux/fs.h>
 #include <linux/hid.h>
 #include <linux/hwmon.h>
+#include <linux/hwmon-sysfs.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/kfifo_buf.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/platform_device.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/sysfs.h>
+#include <linux/thermal.h>
 #include <linux/types.h>
+#include <linux/uaccess.h>
+#include <linux/unaligned.h>
+#include <linux/usb.h>
+#include <linux/workqueue.h>
+#include <net/genetlink.h>
+
+#include "cm-psu.h"
+#include "cm-psu-proto.h"
 
 /*
  * Protocol information:
  * - The PSU sends HID events without having to send a request first
  * - Events contain human-readable strings
  * - All events appear to be 16 bytes long, padded with zero bytes if needed
- * - The format of each string is:
+ * - To be tolerant of other firmware, reports of any length are scanned for
+ *   records, so a leading report ID or several records per report are fine
+ * - The usual case of a single record in a 16 byte report is classified using
+ *   word-at-a-time operations on the whole report first (see
+ *   cmpsu_classify()) and converted without scanning or sscanf()
+ * - The decoder lives in cm-psu-proto.h so the userspace tools can use it
+ * - The format of each record is:
  *   [{type}{channel}{value}]
  * - Types are a single uppercase letter, channels a single digit
  * - Valid types are:
@@ -57,27 +90,374 @@
  * - The XG650/750/850 PSUs may also use the same protocol as they are
  *   supported by MasterPlus - However, those have different sets of channels/
  *   sensors additional code may be needed
+ *
+ * Event handling:
+ * - By default, events are decoded directly in the raw_event callback, which
+ *   runs in URB completion (often softirq) context
+ * - With defer_decode=1, raw_event only copies the event into a per-device
+ *   single-producer/single-consumer ring and a work item decodes the queued
+ *   events in batches. Events are dropped (and counted) if the ring is full
+ *   or if they are longer than REPORT_MAX.
+ * - debugfs shows log2 histograms of the time spent per event in raw_event
+ *   and in the decoder, so both modes can be compared on a given host
+ * - Reports written to the debugfs file inject are decoded like those from
+ *   the PSU, to measure the decoder independently of the PSU's rate. Their
+ *   length is set in inject_len.
+ * - Every channel has a sequence number ({sensor}_seq in sysfs) that is
+ *   incremented each time a value is stored, even if it didn't change. P_in
+ *   and P_out are both updated by the same event.
+ * - The ripple of the DC rails (all voltages except V_AC) is tracked using
+ *   Welford's online algorithm over windows of ripple_window samples. The
+ *   standard deviation of the last complete window is shown as in{n}_stddev.
+ * - The DC rails are also checked against in{n}_min/in{n}_max (ATX tolerance
+ *   of +-5% by default) for every sample. Leaving the range sets the alarm and
+ *   starts an excursion, which is counted (in{n}_excursions) and timed
+ *   (in{n}_excursion_ms) until the rail is back within range.
+ * - fan1_alarm is set if the fan is stopped or slower than fan1_min while
+ *   P_out is above fan_stall_load (the fan may stop at low load in hybrid
+ *   mode). Fanless models (CMPSU_MODEL_FANLESS) have neither. The
+ *   temperatures have max and crit limits with alarms.
+ * - Alarm changes are signalled to userspace using hwmon_notify_event(), which
+ *   may sleep and is therefore called from a work item.
+ * - Each temperature is registered as a thermal zone (cmpsu_temp{n}) with a
+ *   passive trip at temp{n}_max and a hot trip at temp{n}_crit. Writing the
+ *   limits moves the trips as well. The zones are not polled, new samples
+ *   update them at most once every thermal_interval ms.
+ * - With iio=1, an IIO device with a software (kfifo) buffer is registered as
+ *   well. Every decoded event pushes a timestamped scan of all channels
+ *   (missing values are 0), so every sample can be streamed at full rate.
+ * - A cycle is complete when a channel is received for the second time since
+ *   the last complete cycle. Completed cycles are published to the "cycles"
+ *   multicast group of the cm-psu generic netlink family (see cm-psu.h).
+ * - energy1_input is the energy drawn from the wall (P_in integrated over
+ *   time). Gaps of more than CMPSU_ENERGY_MAX_GAP between two power events
+ *   are not counted because the power during the gap is unknown.
+ * - With aggregate=1, a virtual "cmpsu_total" hwmon device reports the total
+ *   P_in, P_out and energy and the combined efficiency of all bound PSUs.
+ *   The totals are updated with every power event. Energy of PSUs that have
+ *   been removed is kept so the total never decreases.
+ * - All timestamps use CLOCK_MONOTONIC, which is shared by all PSUs. For
+ *   setups with several PSUs, CMPSU_CMD_GET_ALIGNED returns the values of all
+ *   of them at a common point in time, linearly interpolated between the two
+ *   most recent values of each channel. By default, that is the most recent
+ *   point in time at which every PSU has completed a cycle.
+ * - priv->lock protects the decoder's state, so readers that need a
+ *   consistent view of several values can take it
+ * - When a PSU is removed, its counters (energy, sequence numbers, cycles,
+ *   excursions) and configured limits are kept for retain_time seconds, keyed
+ *   by its product ID, USB path and serial number. If the same PSU is probed again in
+ *   that time, e.g. after a USB hiccup, they are restored so the counters
+ *   continue where they left off.
+ * - A watchdog checks every watchdog_timeout ms whether a valid event has been
+ *   received. If not, it first reopens the HID device and, if the PSU is still
+ *   silent after another timeout, resets the USB device. Reopening does
+ *   nothing while another program has the hidraw node open, so the watchdog
+ *   resets the USB device right away then. The driver stays bound across the
+ *   reset. stream_alarm is set while the PSU is silent and stream_recoveries
+ *   counts the attempts.
+ * - The rated wattage of each model is listed in cmpsu_models (cm-psu-proto.h,
+ *   shared with the tools). The time between two power events is added to
+ *   the load bucket (10% of the rated wattage each) of the P_out before it,
+ *   together with the energy that went in and out in that time, which gives
+ *   the efficiency at each load. Both are shown in the debugfs file load.
+ * - Most of the above can be left out at build time (CONFIG_CM_PSU_* in the
+ *   Makefile). A feature that is left out has no members in cmpsu_data and
+ *   its hooks in the decoder are empty stubs, so e.g. without
+ *   CONFIG_CM_PSU_STATS raw_event doesn't read the clock at all. The basic
+ *   hwmon attributes, sequence numbers, energy and the watchdog are always
+ *   built.
  */
 
 #define DRIVER_NAME "cm-psu"
 
-#define COUNT_VOLTAGE 5
-#define COUNT_CURRENT 5
-#define COUNT_POWER   2
-#define COUNT_TEMP    2
-#define COUNT_FAN     1
+/* Shared with the userspace tools, see cm-psu-proto.h */
+#define COUNT_VOLTAGE CMPSU_COUNT_VOLTAGE
+#define COUNT_CURRENT CMPSU_COUNT_CURRENT
+#define COUNT_POWER   CMPSU_COUNT_POWER
+#define COUNT_TEMP    CMPSU_COUNT_TEMP
+#define COUNT_FAN     CMPSU_COUNT_FAN
+#define COUNT_ALL     CMPSU_COUNT_ALL
+
+#define CHAN_VOLTAGE_FIRST CMPSU_CHAN_VOLTAGE_FIRST
+#define CHAN_CURRENT_FIRST CMPSU_CHAN_CURRENT_FIRST
+#define CHAN_POWER_FIRST   CMPSU_CHAN_POWER_FIRST
+#define CHAN_TEMP_FIRST    CMPSU_CHAN_TEMP_FIRST
+#define CHAN_FAN_FIRST     CMPSU_CHAN_FAN_FIRST
+
+/* Longest report that can be queued for deferred decoding */
+#define REPORT_MAX 64
+
+/* Must be a power of two */
+#define RING_LEN 64
+
+/* Bucket n counts events that took [2^n, 2^(n+1)) ns, the last one is open */
+#define HIST_LEN 24
+
+/* Timing histograms, see cmpsu_hist_names */
+#define HIST_RAW_EVENT 0
+#define HIST_DECODE    1
+#define HIST_INJECT    2
+#define HIST_COUNT     3
+
+/* 10% of the rated wattage each, the last one is >= 100% */
+#define LOAD_BUCKETS 11
+
+/* Keeps the sum of squares (in uV^2) from overflowing */
+#define RIPPLE_WINDOW_MAX 10000
+
+/* A day, keeps the expiry time in jiffies from overflowing */
+#define RETAIN_TIME_MAX (24 * 60 * 60)
+
+#define CMPSU_DEBUGFS (IS_ENABLED(CONFIG_CM_PSU_STATS) \
+                       || IS_ENABLED(CONFIG_CM_PSU_LOAD))
+
+/* The thermal zones take their trips from the temperature limits */
+#if IS_ENABLED(CONFIG_CM_PSU_THERMAL) && !IS_ENABLED(CONFIG_CM_PSU_LIMITS)
+#error "CONFIG_CM_PSU_THERMAL requires CONFIG_CM_PSU_LIMITS"
+#endif
+
+#if IS_ENABLED(CONFIG_CM_PSU_DEFER)
+static bool defer_decode;
+module_param(defer_decode, bool, 0444);
+MODULE_PARM_DESC(defer_decode,
+		"Decode events in a work item instead of the USB completion path");
+#endif
+
+#if IS_ENABLED(CONFIG_CM_PSU_LIMITS)
+static unsigned int fan_stall_load = 300;
+module_param(fan_stall_load, uint, 0644);
+MODULE_PARM_DESC(fan_stall_load,
+		"P_out in W above which a stopped fan is an alarm (default 300)");
+#endif
+
+#if IS_ENABLED(CONFIG_CM_PSU_THERMAL)
+static unsigned int thermal_interval = 1000;
+module_param(thermal_interval, uint, 0644);
+MODULE_PARM_DESC(thermal_interval,
+		"Minimum time between thermal zone updates in ms (default 1000)");
+#endif
+
+#if IS_ENABLED(CONFIG_CM_PSU_IIO)
+static bool iio;
+module_param(iio, bool, 0444);
+MODULE_PARM_DESC(iio, "Register an IIO device for buffered capture");
+#endif
+
+#if IS_ENABLED(CONFIG_CM_PSU_AGGREGATE)
+static bool aggregate;
+module_param(aggregate, bool, 0444);
+MODULE_PARM_DESC(aggregate,
+		"Register a hwmon device with the totals of all PSUs");
+#endif
+
+#if IS_ENABLED(CONFIG_CM_PSU_RETAIN)
+static unsigned int retain_time = 300;
+module_param(retain_time, uint, 0644);
+MODULE_PARM_DESC(retain_time,
+		"Seconds to keep the counters of a removed PSU (default 300, at most a day)");
+#endif
+
+static unsigned int watchdog_timeout = 5000;
+module_param(watchdog_timeout, uint, 0644);
+MODULE_PARM_DESC(watchdog_timeout,
+		"Time without events in ms before the HID link is reset, 0 to disable (default 5000)");
+
+#if IS_ENABLED(CONFIG_CM_PSU_RIPPLE)
+static unsigned int ripple_window = 60;
+module_param(ripple_window, uint, 0644);
+MODULE_PARM_DESC(ripple_window,
+		"Number of samples per rail ripple window (2-10000, default 60)");
+#endif
+
+struct cmpsu_event {
+	u8 data[REPORT_MAX];
+	int size;
+};
+
+/* Bits in cmpsu_data.notify_pending */
+#define NOTIFY_IN_MIN(ch)    (ch)
+#define NOTIFY_IN_MAX(ch)    (COUNT_VOLTAGE + (ch))
+#define NOTIFY_TEMP_MAX(ch)  (2 * COUNT_VOLTAGE + (ch))
+#define NOTIFY_TEMP_CRIT(ch) (2 * COUNT_VOLTAGE + COUNT_TEMP + (ch))
+#define NOTIFY_FAN(ch)       (2 * COUNT_VOLTAGE + 2 * COUNT_TEMP + (ch))
+
+/* Welford's online variance, values in uV */
+struct cmpsu_ripple {
+	unsigned int count;
+	s64 mean;
+	u64 m2;
+	long stddev; /* mV, -1 until the first window is complete */
+};
+
+struct cmpsu_tolerance {
+	long min; /* mV */
+	long max; /* mV */
+	bool min_alarm;
+	bool max_alarm;
+	unsigned long excursions;
+	u64 excursion_ms; /* Total of all finished excursions */
+	unsigned long excursion_start; /* jiffies */
+};
+
+struct cmpsu_load {
+	u64 time[LOAD_BUCKETS]; /* ns */
+	u64 energy_in[LOAD_BUCKETS]; /* uJ */
+	u64 energy_out[LOAD_BUCKETS]; /* uJ */
+};
+
+struct cmpsu_thermal {
+	struct cmpsu_data *priv;
+	int channel;
+	struct thermal_zone_device *tz;
+	struct thermal_trip trips[2];
+};
+
+struct cmpsu_iio_scan {
+	s32 values[COUNT_ALL];
+	aligned_s64 timestamp;
+};
+
+/* Product ID, serial number and USB path, see cmpsu_saved_key() */
+#define CMPSU_KEY_LEN 135
 
-#define EVENT_LEN 16
+/* State of a removed PSU, see retain_time */
+struct cmpsu_saved {
+	struct list_head list;
+	char key[CMPSU_KEY_LEN];
+	unsigned long expires; /* jiffies */
+	u64 energy;
+#if IS_ENABLED(CONFIG_CM_PSU_NETLINK)
+	u64 cycle;
+#endif
+	unsigned long seq_voltage[COUNT_VOLTAGE];
+	unsigned long seq_current[COUNT_CURRENT];
+	unsigned long seq_power[COUNT_POWER];
+	unsigned long seq_temp[COUNT_TEMP];
+	unsigned long seq_fan[COUNT_FAN];
+#if IS_ENABLED(CONFIG_CM_PSU_LOAD)
+	struct cmpsu_load load;
+#endif
+#if IS_ENABLED(CONFIG_CM_PSU_LIMITS)
+	struct cmpsu_tolerance tolerance[COUNT_VOLTAGE];
+	long temp_max[COUNT_TEMP];
+	long temp_crit[COUNT_TEMP];
+	long fan_min[COUNT_FAN];
+#endif
+};
 
+/*
+ * Members of optional features only exist if the feature is built (see
+ * Makefile), so a minimal build doesn't carry their state
+ */
 struct cmpsu_data {
+	struct list_head list;
 	struct hid_device *hdev;
+	const struct cmpsu_model *model; /* NULL for IDs added through new_id */
 	struct device *hwmon_dev;
+#if IS_ENABLED(CONFIG_CM_PSU_IIO)
+	struct iio_dev *iio_dev;
+	struct cmpsu_iio_scan iio_scan;
+#endif
+#if CMPSU_DEBUGFS
+	struct dentry *debugfs;
+#endif
 	long values_voltage[COUNT_VOLTAGE];
 	long values_current[COUNT_CURRENT];
 	long values_power[COUNT_POWER];
 	long values_temp[COUNT_TEMP];
 	long values_fan[COUNT_FAN];
+	unsigned long seq_voltage[COUNT_VOLTAGE];
+	unsigned long seq_current[COUNT_CURRENT];
+	unsigned long seq_power[COUNT_POWER];
+	unsigned long seq_temp[COUNT_TEMP];
+	unsigned long seq_fan[COUNT_FAN];
+	spinlock_t lock;
+	u64 timestamps[COUNT_ALL]; /* ns */
+#if IS_ENABLED(CONFIG_CM_PSU_NETLINK)
+	/* Previous value of each channel for interpolation */
+	long prev_values[COUNT_ALL];
+	u64 prev_timestamps[COUNT_ALL];
+	u64 cycle_timestamp; /* End of the last complete cycle */
+	u32 cycle_seen; /* Bit n is set once channel n was received */
+	u64 cycle;
+#endif
+	u64 energy; /* uJ */
+	u64 energy_updated; /* ns */
+#if IS_ENABLED(CONFIG_CM_PSU_LOAD)
+	unsigned int rated; /* W, 0 if unknown */
+	struct cmpsu_load load;
+#endif
+	/* Stream watchdog */
+	struct delayed_work watchdog_work;
+	unsigned long last_event; /* jiffies */
+	unsigned int watchdog_level; /* Recovery steps taken since last event */
+	bool stream_alarm;
+	unsigned long stream_recoveries;
+#if IS_ENABLED(CONFIG_CM_PSU_RIPPLE)
+	/* Index 0 (V_AC) is unused */
+	struct cmpsu_ripple ripple[COUNT_VOLTAGE];
+#endif
+#if IS_ENABLED(CONFIG_CM_PSU_LIMITS)
+	struct cmpsu_tolerance tolerance[COUNT_VOLTAGE];
+	long temp_max[COUNT_TEMP];
+	long temp_crit[COUNT_TEMP];
+	bool temp_max_alarm[COUNT_TEMP];
+	bool temp_crit_alarm[COUNT_TEMP];
+	long fan_min[COUNT_FAN];
+	bool fan_alarm[COUNT_FAN];
+	unsigned long notify_pending;
+	struct work_struct notify_work;
+#endif
+#if IS_ENABLED(CONFIG_CM_PSU_THERMAL)
+	struct cmpsu_thermal thermal[COUNT_TEMP];
+	/* Keeps the trips in sync with temp{n}_max and temp{n}_crit */
+	struct mutex thermal_lock;
+	struct delayed_work thermal_work;
+	unsigned long thermal_updated; /* jiffies */
+#endif
+#if IS_ENABLED(CONFIG_CM_PSU_DEFER)
+	/* Deferred decoding, only used if defer is set */
+	bool defer;
+	struct work_struct decode_work;
+	struct cmpsu_event ring[RING_LEN];
+	unsigned int ring_head; /* Written by raw_event */
+	unsigned int ring_tail; /* Written by decode_work */
+	unsigned long ring_dropped;
+#endif
+#if IS_ENABLED(CONFIG_CM_PSU_STATS)
+	/* Timing statistics, updated from raw_event, decode_work and inject */
+	atomic_long_t hist[HIST_COUNT][HIST_LEN];
+	atomic_long_t injected;
+	u32 inject_len; /* Length of the reports written to inject */
+#endif
+};
+
+/* All bound devices */
+static LIST_HEAD(cmpsu_devices);
+static DEFINE_MUTEX(cmpsu_devices_lock);
+
+#if IS_ENABLED(CONFIG_CM_PSU_NETLINK)
+static struct genl_family cmpsu_genl_family;
+#endif
+
+#if IS_ENABLED(CONFIG_CM_PSU_RETAIN)
+/* Removed devices, see retain_time */
+static LIST_HEAD(cmpsu_saved);
+static DEFINE_MUTEX(cmpsu_saved_lock);
+#endif
+
+#if IS_ENABLED(CONFIG_CM_PSU_AGGREGATE)
+/* Sum of all bound devices, updated from the decoder */
+static struct {
+	spinlock_t lock;
+	long power[COUNT_POWER]; /* uW */
+	u64 energy; /* uJ, includes removed devices */
+	struct platform_device *pdev;
+	struct device *hwmon_dev;
+} cmpsu_total = {
+	.lock = __SPIN_LOCK_UNLOCKED(cmpsu_total.lock),
 };
+#endif
 
 static const char* cmpsu_labels_voltage[] = {
 	"V_AC",
@@ -88,6 +468,17 @@ static const char* cmpsu_labels_voltage[] = {
 	"+12V1",
 };
 
+#if IS_ENABLED(CONFIG_CM_PSU_LIMITS)
+/* Nominal voltages of the DC rails in mV (V_AC varies by region) */
+static const long cmpsu_nominal_voltage[] = {
+	0,
+	5000,
+	3300,
+	12000,
+	12000,
+};
+#endif
+
 static const char* cmpsu_labels_current[] = {
 	"I_AC",
 	"I_+5V",
@@ -101,17 +492,213 @@ static const char* cmpsu_labels_power[] = {
 	"P_out",
 };
 
-/*long cmpsu_parse_value(u8 *data, int *idx, int fraction_scale,
-			bool expect_second);*/
+static const char* cmpsu_labels_energy[] = {
+	"E_in",
+};
+
+/* Maps an index from 0 to COUNT_ALL - 1 to the channel's type and number */
+static int cmpsu_channel_type(int index, int *channel)
+{
+	if (index >= CHAN_FAN_FIRST) {
+		*channel = index - CHAN_FAN_FIRST;
+		return CMPSU_TYPE_FAN;
+	} else if (index >= CHAN_TEMP_FIRST) {
+		*channel = index - CHAN_TEMP_FIRST;
+		return CMPSU_TYPE_TEMP;
+	} else if (index >= CHAN_POWER_FIRST) {
+		*channel = index - CHAN_POWER_FIRST;
+		return CMPSU_TYPE_POWER;
+	} else if (index >= CHAN_CURRENT_FIRST) {
+		*channel = index - CHAN_CURRENT_FIRST;
+		return CMPSU_TYPE_CURRENT;
+	}
+	
+	*channel = index - CHAN_VOLTAGE_FIRST;
+	return CMPSU_TYPE_VOLTAGE;
+}
+
+/* Only used by the IIO and netlink interfaces */
+static void __maybe_unused cmpsu_channel_read(struct cmpsu_data *priv,
+			int index, long *value, unsigned long *seq)
+{
+	int channel;
+	
+	switch (cmpsu_channel_type(index, &channel)) {
+		case CMPSU_TYPE_VOLTAGE:
+			*value = priv->values_voltage[channel];
+			*seq = priv->seq_voltage[channel];
+			break;
+		case CMPSU_TYPE_CURRENT:
+			*value = priv->values_current[channel];
+			*seq = priv->seq_current[channel];
+			break;
+		case CMPSU_TYPE_POWER:
+			*value = priv->values_power[channel];
+			*seq = priv->seq_power[channel];
+			break;
+		case CMPSU_TYPE_TEMP:
+			*value = priv->values_temp[channel];
+			*seq = priv->seq_temp[channel];
+			break;
+		default:
+			*value = priv->values_fan[channel];
+			*seq = priv->seq_fan[channel];
+			break;
+	}
+}
+
+#if IS_ENABLED(CONFIG_CM_PSU_LIMITS)
+
+#define CMPSU_IN_LIMITS   (HWMON_I_MIN | HWMON_I_MAX | HWMON_I_MIN_ALARM \
+                           | HWMON_I_MAX_ALARM)
+#define CMPSU_TEMP_LIMITS (HWMON_T_MAX | HWMON_T_CRIT | HWMON_T_MAX_ALARM \
+                           | HWMON_T_CRIT_ALARM)
+#define CMPSU_FAN_LIMITS  (HWMON_F_MIN | HWMON_F_ALARM)
+
+/* Returns -EOPNOTSUPP if attr isn't a limit or an alarm */
+static int cmpsu_limits_read(struct cmpsu_data *priv,
+			enum hwmon_sensor_types type, u32 attr, int channel, long *val)
+{
+	switch (type) {
+		case hwmon_in:
+			if (channel >= COUNT_VOLTAGE)
+				break;
+			if (attr == hwmon_in_min) {
+				*val = priv->tolerance[channel].min;
+				return 0;
+			} else if (attr == hwmon_in_max) {
+				*val = priv->tolerance[channel].max;
+				return 0;
+			} else if (attr == hwmon_in_min_alarm) {
+				*val = priv->tolerance[channel].min_alarm;
+				return 0;
+			} else if (attr == hwmon_in_max_alarm) {
+				*val = priv->tolerance[channel].max_alarm;
+				return 0;
+			}
+			break;
+		case hwmon_temp:
+			if (channel >= COUNT_TEMP)
+				break;
+			if (attr == hwmon_temp_max) {
+				*val = priv->temp_max[channel];
+				return 0;
+			} else if (attr == hwmon_temp_crit) {
+				*val = priv->temp_crit[channel];
+				return 0;
+			} else if (attr == hwmon_temp_max_alarm) {
+				*val = priv->temp_max_alarm[channel];
+				return 0;
+			} else if (attr == hwmon_temp_crit_alarm) {
+				*val = priv->temp_crit_alarm[channel];
+				return 0;
+			}
+			break;
+		case hwmon_fan:
+			if (channel >= COUNT_FAN)
+				break;
+			if (attr == hwmon_fan_min) {
+				*val = priv->fan_min[channel];
+				return 0;
+			} else if (attr == hwmon_fan_alarm) {
+				*val = priv->fan_alarm[channel];
+				return 0;
+			}
+			break;
+		default:
+			break;
+	}
+	
+	return -EOPNOTSUPP;
+}
+
+#if IS_ENABLED(CONFIG_CM_PSU_THERMAL)
+static void cmpsu_thermal_limits_changed(struct cmpsu_data *priv, int channel);
+#else
+static void cmpsu_thermal_limits_changed(struct cmpsu_data *priv, int channel)
+{
+}
+#endif
+
+static int cmpsu_hwmon_write(struct device *dev, enum hwmon_sensor_types type,
+			u32 attr, int channel, long val)
+{
+	struct cmpsu_data *priv = dev_get_drvdata(dev);
+	
+	switch (type) {
+		case hwmon_in:
+			if (channel >= COUNT_VOLTAGE)
+				break;
+			val = clamp_val(val, 0, 30000);
+			if (attr == hwmon_in_min) {
+				WRITE_ONCE(priv->tolerance[channel].min, val);
+				return 0;
+			} else if (attr == hwmon_in_max) {
+				WRITE_ONCE(priv->tolerance[channel].max, val);
+				return 0;
+			}
+			break;
+		case hwmon_temp:
+			if (channel >= COUNT_TEMP)
+				break;
+			val = clamp_val(val, 0, 150000);
+			if (attr == hwmon_temp_max) {
+				WRITE_ONCE(priv->temp_max[channel], val);
+				cmpsu_thermal_limits_changed(priv, channel);
+				return 0;
+			} else if (attr == hwmon_temp_crit) {
+				WRITE_ONCE(priv->temp_crit[channel], val);
+				cmpsu_thermal_limits_changed(priv, channel);
+				return 0;
+			}
+			break;
+		case hwmon_fan:
+			if (channel >= COUNT_FAN)
+				break;
+			if (attr == hwmon_fan_min) {
+				WRITE_ONCE(priv->fan_min[channel],
+							clamp_val(val, 0, 9999));
+				return 0;
+			}
+			break;
+		default:
+			break;
+	}
+	
+	return -EOPNOTSUPP;
+}
+
+#else
+
+#define CMPSU_IN_LIMITS   0
+#define CMPSU_TEMP_LIMITS 0
+#define CMPSU_FAN_LIMITS  0
+
+static int cmpsu_limits_read(struct cmpsu_data *priv,
+			enum hwmon_sensor_types type, u32 attr, int channel, long *val)
+{
+	return -EOPNOTSUPP;
+}
+
+#endif /* IS_ENABLED(CONFIG_CM_PSU_LIMITS) */
+
+static bool cmpsu_fanless(const struct cmpsu_data *priv)
+{
+	return priv->model && (priv->model->flags & CMPSU_MODEL_FANLESS);
+}
 
 static umode_t cmpsu_hwmon_is_visible(const void *data,
 			enum hwmon_sensor_types type, u32 attr, int channel)
 {
+	const struct cmpsu_data *priv = data;
+	
 	switch (type) {
 		case hwmon_in:
-			if (channel < COUNT_VOLTAGE)
-				return 0444;
-			break;
+			if (channel >= COUNT_VOLTAGE)
+				break;
+			if (attr == hwmon_in_min || attr == hwmon_in_max)
+				return 0644;
+			return 0444;
 		case hwmon_curr:
 			if (channel < COUNT_CURRENT)
 				return 0444;
@@ -120,14 +707,27 @@ static umode_t cmpsu_hwmon_is_visible(const void *data,
 			if (channel < COUNT_POWER)
 				return 0444;
 			break;
-		case hwmon_temp:
-			if (channel < COUNT_TEMP)
+		case hwmon_energy:
+			if (channel == 0)
 				return 0444;
 			break;
+		case hwmon_temp:
+			if (channel >= COUNT_TEMP)
+				break;
+			if (attr == hwmon_temp_max || attr == hwmon_temp_crit)
+				return 0644;
+			return 0444;
 		case hwmon_fan:
-			if (channel < COUNT_FAN)
-				return 0444;
-			break;
+			if (channel >= COUNT_FAN)
+				break;
+			/* Fanless models still send R1, but it can't stall */
+			if (attr == hwmon_fan_min || attr == hwmon_fan_alarm) {
+				if (cmpsu_fanless(priv))
+					return 0;
+				if (attr == hwmon_fan_min)
+					return 0644;
+			}
+			return 0444;
 		default:
 			break;
 	}
@@ -141,6 +741,9 @@ static int cmpsu_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
 	struct cmpsu_data *priv = dev_get_drvdata(dev);
 	int err = -EOPNOTSUPP;
 	
+	if (!cmpsu_limits_read(priv, type, attr, channel, val))
+		return 0;
+	
 	switch (type) {
 		case hwmon_in:
 			if (channel < COUNT_VOLTAGE) {
@@ -172,6 +775,12 @@ static int cmpsu_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
 				}
 			}
 			break;
+		case hwmon_energy:
+			if (channel == 0) {
+				*val = priv->energy;
+				err = 0;
+			}
+			break;
 		case hwmon_temp:
 			if (channel < COUNT_TEMP) {
 				if (priv->values_temp[channel] == -1) {
@@ -215,6 +824,10 @@ static int cmpsu_hwmon_read_string(struct device *dev,
 	           && channel < COUNT_POWER) {
 		*str = cmpsu_labels_power[channel];
 		return 0;
+	} else if (type == hwmon_energy && attr == hwmon_energy_label
+	           && channel == 0) {
+		*str = cmpsu_labels_energy[channel];
+		return 0;
 	}
 	
 	return -EOPNOTSUPP;
@@ -223,21 +836,24 @@ static int cmpsu_hwmon_read_string(struct device *dev,
 static const struct hwmon_ops cmpsu_hwmon_ops = {
 	.is_visible = cmpsu_hwmon_is_visible,
 	.read = cmpsu_hwmon_read,
+#if IS_ENABLED(CONFIG_CM_PSU_LIMITS)
+	.write = cmpsu_hwmon_write,
+#endif
 	.read_string = cmpsu_hwmon_read_string,
 };
 
 static const struct hwmon_channel_info* cmpsu_info[] = {
 	HWMON_CHANNEL_INFO(temp,
-					HWMON_T_INPUT,
-					HWMON_T_INPUT),
+					HWMON_T_INPUT | CMPSU_TEMP_LIMITS,
+					HWMON_T_INPUT | CMPSU_TEMP_LIMITS),
 	HWMON_CHANNEL_INFO(fan,
-					HWMON_F_INPUT),
+					HWMON_F_INPUT | CMPSU_FAN_LIMITS),
 	HWMON_CHANNEL_INFO(in,
 					HWMON_I_INPUT | HWMON_I_LABEL,
-					HWMON_I_INPUT | HWMON_I_LABEL,
-					HWMON_I_INPUT | HWMON_I_LABEL,
-					HWMON_I_INPUT | HWMON_I_LABEL,
-					HWMON_I_INPUT | HWMON_I_LABEL),
+					HWMON_I_INPUT | HWMON_I_LABEL | CMPSU_IN_LIMITS,
+					HWMON_I_INPUT | HWMON_I_LABEL | CMPSU_IN_LIMITS,
+					HWMON_I_INPUT | HWMON_I_LABEL | CMPSU_IN_LIMITS,
+					HWMON_I_INPUT | HWMON_I_LABEL | CMPSU_IN_LIMITS),
 	HWMON_CHANNEL_INFO(curr,
 					HWMON_C_INPUT | HWMON_C_LABEL,
 					HWMON_C_INPUT | HWMON_C_LABEL,
@@ -247,6 +863,8 @@ static const struct hwmon_channel_info* cmpsu_info[] = {
 	HWMON_CHANNEL_INFO(power,
 					HWMON_P_INPUT | HWMON_P_LABEL,
 					HWMON_P_INPUT | HWMON_P_LABEL),
+	HWMON_CHANNEL_INFO(energy,
+					HWMON_E_INPUT | HWMON_E_LABEL),
 	NULL
 };
 
@@ -255,165 +873,1992 @@ static const struct hwmon_chip_info cmpsu_chip_info = {
 	.info = cmpsu_info,
 };
 
-static int cmpsu_probe(struct hid_device *hdev, const struct hid_device_id *id)
+#define SEQ_INDEX(type, channel) (((type) << 8) | (channel))
+
+static ssize_t cmpsu_seq_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
 {
-	struct cmpsu_data *priv;
-	int ret;
-	int i;
+	struct cmpsu_data *priv = dev_get_drvdata(dev);
+	int index = to_sensor_dev_attr(attr)->index;
+	int channel = index & 0xff;
+	unsigned long seq;
 	
-	priv = devm_kzalloc(&hdev->dev, sizeof(struct cmpsu_data), GFP_KERNEL);
-	if (!priv)
-		return -ENOMEM;
+	switch (index >> 8) {
+		case hwmon_in:
+			seq = priv->seq_voltage[channel];
+			break;
+		case hwmon_curr:
+			seq = priv->seq_current[channel];
+			break;
+		case hwmon_power:
+			seq = priv->seq_power[channel];
+			break;
+		case hwmon_temp:
+			seq = priv->seq_temp[channel];
+			break;
+		case hwmon_fan:
+			seq = priv->seq_fan[channel];
+			break;
+		default:
+			return -EOPNOTSUPP;
+	}
 	
-	ret = hid_parse(hdev);
-	if (ret)
-		return ret;
+	return sysfs_emit(buf, "%lu\n", seq);
+}
+
+#if IS_ENABLED(CONFIG_CM_PSU_RIPPLE)
+static ssize_t cmpsu_stddev_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	struct cmpsu_data *priv = dev_get_drvdata(dev);
+	long stddev = priv->ripple[to_sensor_dev_attr(attr)->index].stddev;
 	
-	ret = hid_hw_start(hdev, HID_CONNECT_HIDRAW);
-	if (ret)
-		return ret;
+	if (stddev == -1)
+		return -ENODATA;
 	
-	ret = hid_hw_open(hdev);
-	if (ret)
-		return ret;
+	return sysfs_emit(buf, "%ld\n", stddev);
+}
+#endif
+
+#if IS_ENABLED(CONFIG_CM_PSU_LIMITS)
+static ssize_t cmpsu_excursions_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	struct cmpsu_data *priv = dev_get_drvdata(dev);
 	
-	priv->hdev = hdev;
-	hid_set_drvdata(hdev, priv);
-	hid_device_io_start(hdev);
+	return sysfs_emit(buf, "%lu\n",
+				priv->tolerance[to_sensor_dev_attr(attr)->index].excursions);
+}
+
+static ssize_t cmpsu_excursion_ms_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	struct cmpsu_data *priv = dev_get_drvdata(dev);
+	struct cmpsu_tolerance *tol =
+				&priv->tolerance[to_sensor_dev_attr(attr)->index];
+	u64 ms = tol->excursion_ms;
 	
-	for (i = 0; i < COUNT_VOLTAGE; i++)
-		priv->values_voltage[i] = -1;
-	for (i = 0; i < COUNT_CURRENT; i++)
-		priv->values_current[i] = -1;
-	for (i = 0; i < COUNT_POWER; i++)
-		priv->values_power[i] = -1;
-	for (i = 0; i < COUNT_TEMP; i++)
-		priv->values_temp[i] = -1;
-	for (i = 0; i < COUNT_FAN; i++)
-		priv->values_fan[i] = -1;
+	/* Include the excursion that is still ongoing */
+	if (tol->min_alarm || tol->max_alarm)
+		ms += jiffies_to_msecs(jiffies - tol->excursion_start);
 	
-	priv->hwmon_dev = hwmon_device_register_with_info(&hdev->dev, "cmpsu",
-					priv, &cmpsu_chip_info, NULL);
-	if (IS_ERR(priv->hwmon_dev)) {
-		ret = PTR_ERR(priv->hwmon_dev);
-		hid_hw_close(hdev);
-		hid_hw_stop(hdev);
-		return ret;
-	}
+	return sysfs_emit(buf, "%llu\n", ms);
+}
+#endif
+
+static ssize_t stream_alarm_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	struct cmpsu_data *priv = dev_get_drvdata(dev);
 	
-	return 0;
+	return sysfs_emit(buf, "%d\n", READ_ONCE(priv->stream_alarm));
 }
 
-static void cmpsu_remove(struct hid_device *hdev)
+static ssize_t stream_recoveries_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
 {
-	struct cmpsu_data *priv = hid_get_drvdata(hdev);
+	struct cmpsu_data *priv = dev_get_drvdata(dev);
 	
-	hwmon_device_unregister(priv->hwmon_dev);
-	hid_hw_close(hdev);
-	hid_hw_stop(hdev);
+	return sysfs_emit(buf, "%lu\n", READ_ONCE(priv->stream_recoveries));
 }
 
-static int cmpsu_raw_event(struct hid_device *hdev, struct hid_report *report,
-			u8 *data, int size)
+static DEVICE_ATTR_RO(stream_alarm);
+static DEVICE_ATTR_RO(stream_recoveries);
+static SENSOR_DEVICE_ATTR_RO(temp1_seq, cmpsu_seq, SEQ_INDEX(hwmon_temp, 0));
+static SENSOR_DEVICE_ATTR_RO(temp2_seq, cmpsu_seq, SEQ_INDEX(hwmon_temp, 1));
+static SENSOR_DEVICE_ATTR_RO(fan1_seq, cmpsu_seq, SEQ_INDEX(hwmon_fan, 0));
+static SENSOR_DEVICE_ATTR_RO(in0_seq, cmpsu_seq, SEQ_INDEX(hwmon_in, 0));
+static SENSOR_DEVICE_ATTR_RO(in1_seq, cmpsu_seq, SEQ_INDEX(hwmon_in, 1));
+static SENSOR_DEVICE_ATTR_RO(in2_seq, cmpsu_seq, SEQ_INDEX(hwmon_in, 2));
+static SENSOR_DEVICE_ATTR_RO(in3_seq, cmpsu_seq, SEQ_INDEX(hwmon_in, 3));
+static SENSOR_DEVICE_ATTR_RO(in4_seq, cmpsu_seq, SEQ_INDEX(hwmon_in, 4));
+static SENSOR_DEVICE_ATTR_RO(curr1_seq, cmpsu_seq, SEQ_INDEX(hwmon_curr, 0));
+static SENSOR_DEVICE_ATTR_RO(curr2_seq, cmpsu_seq, SEQ_INDEX(hwmon_curr, 1));
+static SENSOR_DEVICE_ATTR_RO(curr3_seq, cmpsu_seq, SEQ_INDEX(hwmon_curr, 2));
+static SENSOR_DEVICE_ATTR_RO(curr4_seq, cmpsu_seq, SEQ_INDEX(hwmon_curr, 3));
+static SENSOR_DEVICE_ATTR_RO(curr5_seq, cmpsu_seq, SEQ_INDEX(hwmon_curr, 4));
+static SENSOR_DEVICE_ATTR_RO(power1_seq, cmpsu_seq, SEQ_INDEX(hwmon_power, 0));
+static SENSOR_DEVICE_ATTR_RO(power2_seq, cmpsu_seq, SEQ_INDEX(hwmon_power, 1));
+#if IS_ENABLED(CONFIG_CM_PSU_RIPPLE)
+static SENSOR_DEVICE_ATTR_RO(in1_stddev, cmpsu_stddev, 1);
+static SENSOR_DEVICE_ATTR_RO(in2_stddev, cmpsu_stddev, 2);
+static SENSOR_DEVICE_ATTR_RO(in3_stddev, cmpsu_stddev, 3);
+static SENSOR_DEVICE_ATTR_RO(in4_stddev, cmpsu_stddev, 4);
+#endif
+#if IS_ENABLED(CONFIG_CM_PSU_LIMITS)
+static SENSOR_DEVICE_ATTR_RO(in1_excursions, cmpsu_excursions, 1);
+static SENSOR_DEVICE_ATTR_RO(in2_excursions, cmpsu_excursions, 2);
+static SENSOR_DEVICE_ATTR_RO(in3_excursions, cmpsu_excursions, 3);
+static SENSOR_DEVICE_ATTR_RO(in4_excursions, cmpsu_excursions, 4);
+static SENSOR_DEVICE_ATTR_RO(in1_excursion_ms, cmpsu_excursion_ms, 1);
+static SENSOR_DEVICE_ATTR_RO(in2_excursion_ms, cmpsu_excursion_ms, 2);
+static SENSOR_DEVICE_ATTR_RO(in3_excursion_ms, cmpsu_excursion_ms, 3);
+static SENSOR_DEVICE_ATTR_RO(in4_excursion_ms, cmpsu_excursion_ms, 4);
+#endif
+
+static struct attribute *cmpsu_attrs[] = {
+	&sensor_dev_attr_temp1_seq.dev_attr.attr,
+	&sensor_dev_attr_temp2_seq.dev_attr.attr,
+	&sensor_dev_attr_fan1_seq.dev_attr.attr,
+	&sensor_dev_attr_in0_seq.dev_attr.attr,
+	&sensor_dev_attr_in1_seq.dev_attr.attr,
+	&sensor_dev_attr_in2_seq.dev_attr.attr,
+	&sensor_dev_attr_in3_seq.dev_attr.attr,
+	&sensor_dev_attr_in4_seq.dev_attr.attr,
+	&sensor_dev_attr_curr1_seq.dev_attr.attr,
+	&sensor_dev_attr_curr2_seq.dev_attr.attr,
+	&sensor_dev_attr_curr3_seq.dev_attr.attr,
+	&sensor_dev_attr_curr4_seq.dev_attr.attr,
+	&sensor_dev_attr_curr5_seq.dev_attr.attr,
+	&sensor_dev_attr_power1_seq.dev_attr.attr,
+	&sensor_dev_attr_power2_seq.dev_attr.attr,
+#if IS_ENABLED(CONFIG_CM_PSU_RIPPLE)
+	&sensor_dev_attr_in1_stddev.dev_attr.attr,
+	&sensor_dev_attr_in2_stddev.dev_attr.attr,
+	&sensor_dev_attr_in3_stddev.dev_attr.attr,
+	&sensor_dev_attr_in4_stddev.dev_attr.attr,
+#endif
+#if IS_ENABLED(CONFIG_CM_PSU_LIMITS)
+	&sensor_dev_attr_in1_excursions.dev_attr.attr,
+	&sensor_dev_attr_in2_excursions.dev_attr.attr,
+	&sensor_dev_attr_in3_excursions.dev_attr.attr,
+	&sensor_dev_attr_in4_excursions.dev_attr.attr,
+	&sensor_dev_attr_in1_excursion_ms.dev_attr.attr,
+	&sensor_dev_attr_in2_excursion_ms.dev_attr.attr,
+	&sensor_dev_attr_in3_excursion_ms.dev_attr.attr,
+	&sensor_dev_attr_in4_excursion_ms.dev_attr.attr,
+#endif
+	&dev_attr_stream_alarm.attr,
+	&dev_attr_stream_recoveries.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(cmpsu);
+
+#if IS_ENABLED(CONFIG_CM_PSU_AGGREGATE)
+
+static umode_t cmpsu_total_is_visible(const void *data,
+			enum hwmon_sensor_types type, u32 attr, int channel)
 {
-	struct cmpsu_data *priv = hid_get_drvdata(hdev);
-	char type;
-	unsigned int channel;
-	unsigned int value1;
-	unsigned int value2;
+	if (type == hwmon_power || type == hwmon_energy)
+		return 0444;
 	
-	if (size != EVENT_LEN)
-		return 0;
+	return 0;
+}
+
+static int cmpsu_total_read(struct device *dev, enum hwmon_sensor_types type,
+			u32 attr, int channel, long *val)
+{
+	unsigned long flags;
 	
-	/* Make sure the data is null-terminated */
-	if (data[size - 1] != 0)
-		return 0;
-	/* Enforce a minimum length
-	 * (square brackets + data type + channel index + value) */
-	if (size < 5)
-		return 0;
+	spin_lock_irqsave(&cmpsu_total.lock, flags);
+	if (type == hwmon_power)
+		*val = cmpsu_total.power[channel];
+	else
+		*val = cmpsu_total.energy;
+	spin_unlock_irqrestore(&cmpsu_total.lock, flags);
 	
-	/* Pick the correct format string depending on the packet type */
-	switch (data[1]) {
-		/* Voltage, current, temperature: Single value with one decimal */
-		case 'V':
-		case 'I':
-		case 'T':
-			if (sscanf(data, "[%c%1u%03u.%1u]",
-						&type, &channel, &value1, &value2) != 4)
-				return 0;
-			break;
-		/* Fan RPM: Single value, no decimal */
-		case 'R':
-			if (sscanf(data, "[%c%1u%04u]",
-						&type, &channel, &value1) != 3)
-				return 0;
-			break;
-		/* Power: Two values, no decimal */
-		case 'P':
-			/* Ignore packet P1 */
-			if (data[2] != '2')
-				return 0;
-			if (sscanf(data, "[%c%1u%04u/%04u]",
-						&type, &channel, &value1, &value2) != 4)
-				return 0;
-			break;
+	return 0;
+}
+
+static int cmpsu_total_read_string(struct device *dev,
+			enum hwmon_sensor_types type, u32 attr,
+			int channel, const char **str)
+{
+	if (type == hwmon_power)
+		*str = cmpsu_labels_power[channel];
+	else
+		*str = cmpsu_labels_energy[channel];
+	
+	return 0;
+}
+
+static const struct hwmon_ops cmpsu_total_hwmon_ops = {
+	.is_visible = cmpsu_total_is_visible,
+	.read = cmpsu_total_read,
+	.read_string = cmpsu_total_read_string,
+};
+
+static const struct hwmon_channel_info* cmpsu_total_info[] = {
+	HWMON_CHANNEL_INFO(power,
+					HWMON_P_INPUT | HWMON_P_LABEL,
+					HWMON_P_INPUT | HWMON_P_LABEL),
+	HWMON_CHANNEL_INFO(energy,
+					HWMON_E_INPUT | HWMON_E_LABEL),
+	NULL
+};
+
+static const struct hwmon_chip_info cmpsu_total_chip_info = {
+	.ops = &cmpsu_total_hwmon_ops,
+	.info = cmpsu_total_info,
+};
+
+/* P_out / P_in in thousandths of a percent */
+static ssize_t efficiency_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	unsigned long flags;
+	long p_in;
+	long p_out;
+	
+	spin_lock_irqsave(&cmpsu_total.lock, flags);
+	p_in = cmpsu_total.power[0];
+	p_out = cmpsu_total.power[1];
+	spin_unlock_irqrestore(&cmpsu_total.lock, flags);
+	
+	if (p_in <= 0)
+		return -ENODATA;
+	
+	return sysfs_emit(buf, "%llu\n", div64_u64((u64)p_out * 100000, p_in));
+}
+static DEVICE_ATTR_RO(efficiency);
+
+static struct attribute *cmpsu_total_attrs[] = {
+	&dev_attr_efficiency.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(cmpsu_total);
+
+static void cmpsu_total_update(long delta_in, long delta_out, u64 energy)
+{
+	unsigned long flags;
+	
+	spin_lock_irqsave(&cmpsu_total.lock, flags);
+	cmpsu_total.power[0] += delta_in;
+	cmpsu_total.power[1] += delta_out;
+	cmpsu_total.energy += energy;
+	spin_unlock_irqrestore(&cmpsu_total.lock, flags);
+}
+
+static int cmpsu_total_init(void)
+{
+	if (!aggregate)
+		return 0;
+	
+	cmpsu_total.pdev = platform_device_register_simple("cmpsu_total",
+					PLATFORM_DEVID_NONE, NULL, 0);
+	if (IS_ERR(cmpsu_total.pdev))
+		return PTR_ERR(cmpsu_total.pdev);
+	
+	cmpsu_total.hwmon_dev = hwmon_device_register_with_info(
+					&cmpsu_total.pdev->dev, "cmpsu_total", NULL,
+					&cmpsu_total_chip_info, cmpsu_total_groups);
+	if (IS_ERR(cmpsu_total.hwmon_dev)) {
+		platform_device_unregister(cmpsu_total.pdev);
+		return PTR_ERR(cmpsu_total.hwmon_dev);
+	}
+	
+	return 0;
+}
+
+static void cmpsu_total_remove(void)
+{
+	if (!aggregate)
+		return;
+	
+	hwmon_device_unregister(cmpsu_total.hwmon_dev);
+	platform_device_unregister(cmpsu_total.pdev);
+}
+
+#else
+
+static void cmpsu_total_update(long delta_in, long delta_out, u64 energy)
+{
+}
+
+static int cmpsu_total_init(void)
+{
+	return 0;
+}
+
+static void cmpsu_total_remove(void)
+{
+}
+
+#endif /* IS_ENABLED(CONFIG_CM_PSU_AGGREGATE) */
+
+#if IS_ENABLED(CONFIG_CM_PSU_IIO) && IS_REACHABLE(CONFIG_IIO_KFIFO_BUF)
+
+#define CMPSU_IIO_CHAN(_type, _channel, _first) { \
+	.type = _type, \
+	.indexed = 1, \
+	.channel = _channel, \
+	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW), \
+	.info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE), \
+	.scan_index = (_first) + (_channel), \
+	.scan_type = { \
+		.sign = 's', \
+		.realbits = 32, \
+		.storagebits = 32, \
+		.endianness = IIO_CPU, \
+	}, \
+}
+
+static const struct iio_chan_spec cmpsu_iio_channels[] = {
+	CMPSU_IIO_CHAN(IIO_VOLTAGE, 0, CHAN_VOLTAGE_FIRST),
+	CMPSU_IIO_CHAN(IIO_VOLTAGE, 1, CHAN_VOLTAGE_FIRST),
+	CMPSU_IIO_CHAN(IIO_VOLTAGE, 2, CHAN_VOLTAGE_FIRST),
+	CMPSU_IIO_CHAN(IIO_VOLTAGE, 3, CHAN_VOLTAGE_FIRST),
+	CMPSU_IIO_CHAN(IIO_VOLTAGE, 4, CHAN_VOLTAGE_FIRST),
+	CMPSU_IIO_CHAN(IIO_CURRENT, 0, CHAN_CURRENT_FIRST),
+	CMPSU_IIO_CHAN(IIO_CURRENT, 1, CHAN_CURRENT_FIRST),
+	CMPSU_IIO_CHAN(IIO_CURRENT, 2, CHAN_CURRENT_FIRST),
+	CMPSU_IIO_CHAN(IIO_CURRENT, 3, CHAN_CURRENT_FIRST),
+	CMPSU_IIO_CHAN(IIO_CURRENT, 4, CHAN_CURRENT_FIRST),
+	CMPSU_IIO_CHAN(IIO_POWER, 0, CHAN_POWER_FIRST),
+	CMPSU_IIO_CHAN(IIO_POWER, 1, CHAN_POWER_FIRST),
+	CMPSU_IIO_CHAN(IIO_TEMP, 0, CHAN_TEMP_FIRST),
+	CMPSU_IIO_CHAN(IIO_TEMP, 1, CHAN_TEMP_FIRST),
+	CMPSU_IIO_CHAN(IIO_ANGL_VEL, 0, CHAN_FAN_FIRST),
+	IIO_CHAN_SOFT_TIMESTAMP(COUNT_ALL),
+};
+
+/* Always push full scans and let the IIO core pick the enabled channels */
+static const unsigned long cmpsu_iio_scan_masks[] = {
+	BIT(COUNT_ALL) - 1,
+	0
+};
+
+/* Raw values are in the driver's units, except power (mW instead of uW) */
+static s32 cmpsu_iio_value(struct cmpsu_data *priv, int index)
+{
+	unsigned long seq;
+	long value;
+	
+	cmpsu_channel_read(priv, index, &value, &seq);
+	if (value == -1)
+		return 0;
+	if (index >= CHAN_POWER_FIRST && index < CHAN_TEMP_FIRST)
+		return value / 1000;
+	return value;
+}
+
+static int cmpsu_iio_read_raw(struct iio_dev *indio_dev,
+			struct iio_chan_spec const *chan, int *val, int *val2,
+			long mask)
+{
+	struct cmpsu_data *priv = *(struct cmpsu_data **)iio_priv(indio_dev);
+	
+	switch (mask) {
+		case IIO_CHAN_INFO_RAW:
+			*val = cmpsu_iio_value(priv, chan->scan_index);
+			return IIO_VAL_INT;
+		case IIO_CHAN_INFO_SCALE:
+			/* RPM to rad/s */
+			if (chan->type == IIO_ANGL_VEL) {
+				*val = 0;
+				*val2 = 104719755;
+				return IIO_VAL_INT_PLUS_NANO;
+			}
+			*val = 1;
+			return IIO_VAL_INT;
+		default:
+			return -EINVAL;
+	}
+}
+
+/*
+ * Same as the hwmon labels. The temperatures and the fan have none there, so
+ * they are named after their hwmon attributes.
+ */
+static int cmpsu_iio_read_label(struct iio_dev *indio_dev,
+			struct iio_chan_spec const *chan, char *label)
+{
+	switch (chan->type) {
+		case IIO_VOLTAGE:
+			return sysfs_emit(label, "%s\n",
+						cmpsu_labels_voltage[chan->channel]);
+		case IIO_CURRENT:
+			return sysfs_emit(label, "%s\n",
+						cmpsu_labels_current[chan->channel]);
+		case IIO_POWER:
+			return sysfs_emit(label, "%s\n",
+						cmpsu_labels_power[chan->channel]);
+		case IIO_TEMP:
+			return sysfs_emit(label, "temp%d\n", chan->channel + 1);
+		case IIO_ANGL_VEL:
+			return sysfs_emit(label, "fan%d\n", chan->channel + 1);
 		default:
-			return 0;
+			return -EINVAL;
+	}
+}
+
+static const struct iio_info cmpsu_iio_info = {
+	.read_raw = cmpsu_iio_read_raw,
+	.read_label = cmpsu_iio_read_label,
+};
+
+static void cmpsu_iio_push(struct cmpsu_data *priv)
+{
+	struct iio_dev *indio_dev = READ_ONCE(priv->iio_dev);
+	int i;
+	
+	if (!indio_dev || !iio_buffer_enabled(indio_dev))
+		return;
+	
+	for (i = 0; i < COUNT_ALL; i++)
+		priv->iio_scan.values[i] = cmpsu_iio_value(priv, i);
+	iio_push_to_buffers_with_timestamp(indio_dev, &priv->iio_scan,
+				iio_get_time_ns(indio_dev));
+}
+
+static int cmpsu_iio_init(struct cmpsu_data *priv)
+{
+	struct iio_dev *indio_dev;
+	int ret;
+	
+	if (!iio)
+		return 0;
+	
+	indio_dev = devm_iio_device_alloc(&priv->hdev->dev, sizeof(priv));
+	if (!indio_dev)
+		return -ENOMEM;
+	
+	*(struct cmpsu_data **)iio_priv(indio_dev) = priv;
+	indio_dev->name = "cmpsu";
+	indio_dev->info = &cmpsu_iio_info;
+	indio_dev->modes = INDIO_DIRECT_MODE;
+	indio_dev->channels = cmpsu_iio_channels;
+	indio_dev->num_channels = ARRAY_SIZE(cmpsu_iio_channels);
+	indio_dev->available_scan_masks = cmpsu_iio_scan_masks;
+	
+	ret = devm_iio_kfifo_buffer_setup(&priv->hdev->dev, indio_dev, NULL);
+	if (ret)
+		return ret;
+	
+	ret = iio_device_register(indio_dev);
+	if (ret)
+		return ret;
+	
+	WRITE_ONCE(priv->iio_dev, indio_dev);
+	return 0;
+}
+
+static void cmpsu_iio_remove(struct cmpsu_data *priv)
+{
+	if (priv->iio_dev)
+		iio_device_unregister(priv->iio_dev);
+}
+
+#else
+
+static void cmpsu_iio_push(struct cmpsu_data *priv)
+{
+}
+
+static int cmpsu_iio_init(struct cmpsu_data *priv)
+{
+#if IS_ENABLED(CONFIG_CM_PSU_IIO)
+	if (iio)
+		hid_warn(priv->hdev, "IIO support is not available\n");
+#endif
+	return 0;
+}
+
+static void cmpsu_iio_remove(struct cmpsu_data *priv)
+{
+}
+
+#endif /* IS_ENABLED(CONFIG_CM_PSU_IIO) && IS_REACHABLE(CONFIG_IIO_KFIFO_BUF) */
+
+#if IS_ENABLED(CONFIG_CM_PSU_NETLINK)
+
+/*
+ * Value of a channel at a given time, interpolated between the two most
+ * recent values if possible. Called with priv->lock held.
+ */
+static long cmpsu_channel_at(struct cmpsu_data *priv, int index, u64 at)
+{
+	u64 ts = priv->timestamps[index];
+	u64 prev_ts = priv->prev_timestamps[index];
+	long prev = priv->prev_values[index];
+	unsigned long seq;
+	long value;
+	
+	cmpsu_channel_read(priv, index, &value, &seq);
+	if (value == -1 || prev == -1 || at >= ts)
+		return value;
+	if (at <= prev_ts)
+		return prev;
+	
+	/* In us to avoid overflows with power values (uW) */
+	return prev + div64_s64((s64)(value - prev) * div_u64(at - prev_ts, 1000),
+				max_t(s64, div_u64(ts - prev_ts, 1000), 1));
+}
+
+/* Puts the channel's value at time "at", or its most recent value if 0 */
+static int cmpsu_nl_put_channel(struct sk_buff *skb, struct cmpsu_data *priv,
+			int index, u64 at)
+{
+	struct nlattr *nest;
+	unsigned long seq;
+	long value;
+	int channel;
+	int type;
+	
+	cmpsu_channel_read(priv, index, &value, &seq);
+	if (value == -1)
+		return 0;
+	if (at)
+		value = cmpsu_channel_at(priv, index, at);
+	type = cmpsu_channel_type(index, &channel);
+	
+	nest = nla_nest_start(skb, CMPSU_ATTR_CHANNEL);
+	if (!nest)
+		return -EMSGSIZE;
+	
+	if (nla_put_u8(skb, CMPSU_CHANNEL_ATTR_TYPE, type)
+	    || nla_put_u8(skb, CMPSU_CHANNEL_ATTR_INDEX, channel)
+	    || nla_put_s64(skb, CMPSU_CHANNEL_ATTR_VALUE, value,
+	                   CMPSU_CHANNEL_ATTR_PAD)
+	    || nla_put_u64_64bit(skb, CMPSU_CHANNEL_ATTR_SEQ, seq,
+	                         CMPSU_CHANNEL_ATTR_PAD)
+	    || nla_put_u64_64bit(skb, CMPSU_CHANNEL_ATTR_TIMESTAMP,
+	                         at ? at : priv->timestamps[index],
+	                         CMPSU_CHANNEL_ATTR_PAD)) {
+		nla_nest_cancel(skb, nest);
+		return -EMSGSIZE;
+	}
+	
+	nla_nest_end(skb, nest);
+	return 0;
+}
+
+/* Called with priv->lock held */
+static int cmpsu_nl_put_device(struct sk_buff *skb, struct cmpsu_data *priv,
+			u64 at)
+{
+	struct hid_device *hdev = priv->hdev;
+	int i;
+	
+	if (nla_put_string(skb, CMPSU_ATTR_DEVICE, dev_name(&hdev->dev))
+	    || nla_put_u32(skb, CMPSU_ATTR_PRODUCT, hdev->product)
+	    || (hdev->uniq[0]
+	        && nla_put_string(skb, CMPSU_ATTR_SERIAL, hdev->uniq))
+	    || nla_put_u64_64bit(skb, CMPSU_ATTR_CYCLE, priv->cycle,
+	                         CMPSU_ATTR_PAD)
+	    || nla_put_u64_64bit(skb, CMPSU_ATTR_TIMESTAMP,
+	                         at ? at : ktime_get_ns(), CMPSU_ATTR_PAD)
+	    || nla_put_u64_64bit(skb, CMPSU_ATTR_ENERGY, priv->energy,
+	                         CMPSU_ATTR_PAD))
+		return -EMSGSIZE;
+	
+	for (i = 0; i < COUNT_ALL; i++) {
+		if (cmpsu_nl_put_channel(skb, priv, i, at))
+			return -EMSGSIZE;
+	}
+	
+	return 0;
+}
+
+/* Called with priv->lock held */
+static int cmpsu_nl_fill(struct sk_buff *skb, struct cmpsu_data *priv,
+			u8 cmd, u32 portid, u32 seq, int flags)
+{
+	void *hdr;
+	
+	hdr = genlmsg_put(skb, portid, seq, &cmpsu_genl_family, flags, cmd);
+	if (!hdr)
+		return -EMSGSIZE;
+	
+	if (cmpsu_nl_put_device(skb, priv, 0)) {
+		genlmsg_cancel(skb, hdr);
+		return -EMSGSIZE;
+	}
+	
+	genlmsg_end(skb, hdr);
+	return 0;
+}
+
+/* Called from the decoder, possibly in atomic context */
+static void cmpsu_nl_publish(struct cmpsu_data *priv)
+{
+	struct sk_buff *skb;
+	
+	if (!genl_has_listeners(&cmpsu_genl_family, &init_net, 0))
+		return;
+	
+	skb = genlmsg_new(NLMSG_GOODSIZE, GFP_ATOMIC);
+	if (!skb)
+		return;
+	
+	if (cmpsu_nl_fill(skb, priv, CMPSU_CMD_CYCLE, 0, 0, 0)) {
+		nlmsg_free(skb);
+		return;
+	}
+	
+	genlmsg_multicast(&cmpsu_genl_family, skb, 0, 0, GFP_ATOMIC);
+}
+
+static int cmpsu_nl_get_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct cmpsu_data *priv;
+	unsigned long flags;
+	int idx = 0;
+	int ret;
+	
+	mutex_lock(&cmpsu_devices_lock);
+	list_for_each_entry(priv, &cmpsu_devices, list) {
+		if (idx < cb->args[0]) {
+			idx++;
+			continue;
+		}
+		spin_lock_irqsave(&priv->lock, flags);
+		ret = cmpsu_nl_fill(skb, priv, CMPSU_CMD_GET,
+					NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+					NLM_F_MULTI);
+		spin_unlock_irqrestore(&priv->lock, flags);
+		if (ret)
+			break;
+		idx++;
+	}
+	mutex_unlock(&cmpsu_devices_lock);
+	
+	cb->args[0] = idx;
+	return skb->len;
+}
+
+static int cmpsu_nl_get_aligned(struct sk_buff *skb, struct genl_info *info)
+{
+	struct cmpsu_data *priv;
+	struct sk_buff *msg;
+	struct nlattr *nest;
+	unsigned long flags;
+	size_t size = NLMSG_GOODSIZE;
+	void *hdr;
+	u64 at = U64_MAX;
+	int ret = 0;
+	
+	mutex_lock(&cmpsu_devices_lock);
+	
+	if (info->attrs[CMPSU_ATTR_TIMESTAMP]) {
+		at = nla_get_u64(info->attrs[CMPSU_ATTR_TIMESTAMP]);
+	} else {
+		list_for_each_entry(priv, &cmpsu_devices, list)
+			at = min(at, READ_ONCE(priv->cycle_timestamp));
+	}
+	if (!at || at == U64_MAX) {
+		ret = -ENODATA;
+		goto out;
+	}
+	
+	list_for_each_entry(priv, &cmpsu_devices, list)
+		size += 1024;
+	msg = genlmsg_new(size, GFP_KERNEL);
+	if (!msg) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	
+	hdr = genlmsg_put(msg, info->snd_portid, info->snd_seq,
+				&cmpsu_genl_family, 0, CMPSU_CMD_GET_ALIGNED);
+	if (!hdr)
+		goto err_size;
+	if (nla_put_u64_64bit(msg, CMPSU_ATTR_TIMESTAMP, at, CMPSU_ATTR_PAD))
+		goto err_size;
+	
+	list_for_each_entry(priv, &cmpsu_devices, list) {
+		nest = nla_nest_start(msg, CMPSU_ATTR_PSU);
+		if (!nest)
+			goto err_size;
+		spin_lock_irqsave(&priv->lock, flags);
+		ret = cmpsu_nl_put_device(msg, priv, at);
+		spin_unlock_irqrestore(&priv->lock, flags);
+		if (ret)
+			goto err_size;
+		nla_nest_end(msg, nest);
+	}
+	
+	genlmsg_end(msg, hdr);
+	mutex_unlock(&cmpsu_devices_lock);
+	return genlmsg_reply(msg, info);
+	
+err_size:
+	nlmsg_free(msg);
+	ret = -EMSGSIZE;
+out:
+	mutex_unlock(&cmpsu_devices_lock);
+	return ret;
+}
+
+static const struct nla_policy cmpsu_genl_policy[CMPSU_ATTR_MAX + 1] = {
+	[CMPSU_ATTR_TIMESTAMP] = { .type = NLA_U64 },
+};
+
+static const struct genl_small_ops cmpsu_genl_ops[] = {
+	{
+		.cmd = CMPSU_CMD_GET,
+		.dumpit = cmpsu_nl_get_dump,
+	},
+	{
+		.cmd = CMPSU_CMD_GET_ALIGNED,
+		.doit = cmpsu_nl_get_aligned,
+	},
+};
+
+static const struct genl_multicast_group cmpsu_genl_mcgrps[] = {
+	{ .name = CMPSU_GENL_MCGRP_CYCLES },
+};
+
+static struct genl_family cmpsu_genl_family = {
+	.name = CMPSU_GENL_NAME,
+	.version = CMPSU_GENL_VERSION,
+	.maxattr = CMPSU_ATTR_MAX,
+	.policy = cmpsu_genl_policy,
+	.module = THIS_MODULE,
+	.small_ops = cmpsu_genl_ops,
+	.n_small_ops = ARRAY_SIZE(cmpsu_genl_ops),
+	.resv_start_op = CMPSU_CMD_GET_ALIGNED + 1,
+	.mcgrps = cmpsu_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(cmpsu_genl_mcgrps),
+};
+
+static void cmpsu_cycle_check(struct cmpsu_data *priv, int index)
+{
+	if (priv->cycle_seen & BIT(index)) {
+		priv->cycle++;
+		priv->cycle_seen = 0;
+		WRITE_ONCE(priv->cycle_timestamp, ktime_get_ns());
+		cmpsu_nl_publish(priv);
+	}
+	
+	priv->cycle_seen |= BIT(index);
+}
+
+/* Drops a partial cycle, called with priv->lock held */
+static void cmpsu_cycle_reset(struct cmpsu_data *priv)
+{
+	priv->cycle_seen = 0;
+}
+
+/* Keeps the previous value of a channel before it is overwritten */
+static void cmpsu_channel_prev(struct cmpsu_data *priv, int index)
+{
+	unsigned long seq;
+	
+	cmpsu_channel_read(priv, index, &priv->prev_values[index], &seq);
+	priv->prev_timestamps[index] = priv->timestamps[index];
+}
+
+static void cmpsu_nl_setup(struct cmpsu_data *priv)
+{
+	int i;
+	
+	for (i = 0; i < COUNT_ALL; i++)
+		priv->prev_values[i] = -1;
+}
+
+static int cmpsu_nl_init(void)
+{
+	return genl_register_family(&cmpsu_genl_family);
+}
+
+static void cmpsu_nl_remove(void)
+{
+	genl_unregister_family(&cmpsu_genl_family);
+}
+
+#else
+
+static void cmpsu_cycle_check(struct cmpsu_data *priv, int index)
+{
+}
+
+static void cmpsu_cycle_reset(struct cmpsu_data *priv)
+{
+}
+
+static void cmpsu_channel_prev(struct cmpsu_data *priv, int index)
+{
+}
+
+static void cmpsu_nl_setup(struct cmpsu_data *priv)
+{
+}
+
+static int cmpsu_nl_init(void)
+{
+	return 0;
+}
+
+static void cmpsu_nl_remove(void)
+{
+}
+
+#endif /* IS_ENABLED(CONFIG_CM_PSU_NETLINK) */
+
+#if IS_ENABLED(CONFIG_CM_PSU_STATS)
+
+static u64 cmpsu_hist_start(void)
+{
+	return ktime_get_ns();
+}
+
+static void cmpsu_hist_add(struct cmpsu_data *priv, int hist, u64 start)
+{
+	u64 delta = ktime_get_ns() - start;
+	
+	atomic_long_inc(&priv->hist[hist][min_t(unsigned int,
+				delta ? ilog2(delta) : 0, HIST_LEN - 1)]);
+}
+
+#else
+
+/* Without the histograms, the clock isn't read at all */
+static u64 cmpsu_hist_start(void)
+{
+	return 0;
+}
+
+static void cmpsu_hist_add(struct cmpsu_data *priv, int hist, u64 start)
+{
+}
+
+#endif /* IS_ENABLED(CONFIG_CM_PSU_STATS) */
+
+#if IS_ENABLED(CONFIG_CM_PSU_RIPPLE)
+
+static void cmpsu_ripple_add(struct cmpsu_data *priv, int channel)
+{
+	struct cmpsu_ripple *ripple = &priv->ripple[channel];
+	unsigned int window = clamp_t(unsigned int, READ_ONCE(ripple_window),
+				2, RIPPLE_WINDOW_MAX);
+	s64 x = (s64)priv->values_voltage[channel] * 1000;
+	s64 delta = x - ripple->mean;
+	
+	ripple->count++;
+	ripple->mean += div_s64(delta, ripple->count);
+	ripple->m2 += delta * (x - ripple->mean);
+	
+	if (ripple->count >= window) {
+		ripple->stddev = DIV_ROUND_CLOSEST(int_sqrt64(div_u64(ripple->m2,
+					ripple->count - 1)), 1000);
+		ripple->count = 0;
+		ripple->mean = 0;
+		ripple->m2 = 0;
+	}
+}
+
+static void cmpsu_ripple_setup(struct cmpsu_data *priv)
+{
+	int i;
+	
+	for (i = 0; i < COUNT_VOLTAGE; i++)
+		priv->ripple[i].stddev = -1;
+}
+
+#else
+
+static void cmpsu_ripple_add(struct cmpsu_data *priv, int channel)
+{
+}
+
+static void cmpsu_ripple_setup(struct cmpsu_data *priv)
+{
+}
+
+#endif /* IS_ENABLED(CONFIG_CM_PSU_RIPPLE) */
+
+#if IS_ENABLED(CONFIG_CM_PSU_LIMITS)
+
+/* Flags a changed alarm to be signalled by notify_work */
+static void cmpsu_alarm_update(struct cmpsu_data *priv, bool *alarm,
+			bool value, int notify_bit)
+{
+	if (*alarm == value)
+		return;
+	
+	*alarm = value;
+	set_bit(notify_bit, &priv->notify_pending);
+	schedule_work(&priv->notify_work);
+}
+
+static void cmpsu_tolerance_check(struct cmpsu_data *priv, int channel)
+{
+	struct cmpsu_tolerance *tol = &priv->tolerance[channel];
+	long value = priv->values_voltage[channel];
+	bool was_out = tol->min_alarm || tol->max_alarm;
+	bool is_out;
+	
+	cmpsu_alarm_update(priv, &tol->min_alarm, value < READ_ONCE(tol->min),
+				NOTIFY_IN_MIN(channel));
+	cmpsu_alarm_update(priv, &tol->max_alarm, value > READ_ONCE(tol->max),
+				NOTIFY_IN_MAX(channel));
+	is_out = tol->min_alarm || tol->max_alarm;
+	
+	if (is_out && !was_out) {
+		tol->excursions++;
+		tol->excursion_start = jiffies;
+	} else if (!is_out && was_out) {
+		tol->excursion_ms += jiffies_to_msecs(jiffies
+					- tol->excursion_start);
+	}
+}
+
+static void cmpsu_temp_check(struct cmpsu_data *priv, int channel)
+{
+	long value = priv->values_temp[channel];
+	
+	cmpsu_alarm_update(priv, &priv->temp_max_alarm[channel],
+				value > READ_ONCE(priv->temp_max[channel]),
+				NOTIFY_TEMP_MAX(channel));
+	cmpsu_alarm_update(priv, &priv->temp_crit_alarm[channel],
+				value > READ_ONCE(priv->temp_crit[channel]),
+				NOTIFY_TEMP_CRIT(channel));
+}
+
+static void cmpsu_fan_check(struct cmpsu_data *priv)
+{
+	long rpm = priv->values_fan[0];
+	long load = priv->values_power[1];
+	bool stalled;
+	
+	if (cmpsu_fanless(priv))
+		return;
+	
+	/* Both values are needed to tell a stall from a stopped fan */
+	if (rpm == -1 || load == -1)
+		return;
+	
+	/* fan_stall_load in uW doesn't fit into a 32 bit long */
+	stalled = (rpm == 0 || rpm < READ_ONCE(priv->fan_min[0]))
+				&& (u64)load > READ_ONCE(fan_stall_load) * 1000000ULL;
+	cmpsu_alarm_update(priv, &priv->fan_alarm[0], stalled, NOTIFY_FAN(0));
+}
+
+static void cmpsu_notify_work(struct work_struct *work)
+{
+	struct cmpsu_data *priv = container_of(work, struct cmpsu_data,
+					notify_work);
+	int i;
+	
+	/* Alarms stay pending until the hwmon device is registered */
+	if (IS_ERR_OR_NULL(READ_ONCE(priv->hwmon_dev)))
+		return;
+	
+	for (i = 0; i < COUNT_VOLTAGE; i++) {
+		if (test_and_clear_bit(NOTIFY_IN_MIN(i), &priv->notify_pending))
+			hwmon_notify_event(priv->hwmon_dev, hwmon_in,
+						hwmon_in_min_alarm, i);
+		if (test_and_clear_bit(NOTIFY_IN_MAX(i), &priv->notify_pending))
+			hwmon_notify_event(priv->hwmon_dev, hwmon_in,
+						hwmon_in_max_alarm, i);
+	}
+	for (i = 0; i < COUNT_TEMP; i++) {
+		if (test_and_clear_bit(NOTIFY_TEMP_MAX(i), &priv->notify_pending))
+			hwmon_notify_event(priv->hwmon_dev, hwmon_temp,
+						hwmon_temp_max_alarm, i);
+		if (test_and_clear_bit(NOTIFY_TEMP_CRIT(i), &priv->notify_pending))
+			hwmon_notify_event(priv->hwmon_dev, hwmon_temp,
+						hwmon_temp_crit_alarm, i);
+	}
+	for (i = 0; i < COUNT_FAN; i++) {
+		if (test_and_clear_bit(NOTIFY_FAN(i), &priv->notify_pending))
+			hwmon_notify_event(priv->hwmon_dev, hwmon_fan,
+						hwmon_fan_alarm, i);
+	}
+}
+
+/* Called before IO is started */
+static void cmpsu_limits_setup(struct cmpsu_data *priv)
+{
+	int i;
+	
+	for (i = 0; i < COUNT_VOLTAGE; i++) {
+		/* ATX allows +-5% on all DC rails */
+		priv->tolerance[i].min = cmpsu_nominal_voltage[i] * 95 / 100;
+		priv->tolerance[i].max = cmpsu_nominal_voltage[i] * 105 / 100;
+	}
+	for (i = 0; i < COUNT_TEMP; i++) {
+		priv->temp_max[i] = 70000;
+		priv->temp_crit[i] = 85000;
+	}
+	INIT_WORK(&priv->notify_work, cmpsu_notify_work);
+}
+
+/* Called once the hwmon device is registered */
+static void cmpsu_limits_init(struct cmpsu_data *priv)
+{
+	/* Signal alarms raised before the hwmon device existed */
+	if (READ_ONCE(priv->notify_pending))
+		schedule_work(&priv->notify_work);
+}
+
+static void cmpsu_limits_remove(struct cmpsu_data *priv)
+{
+	cancel_work_sync(&priv->notify_work);
+}
+
+#else
+
+static void cmpsu_tolerance_check(struct cmpsu_data *priv, int channel)
+{
+}
+
+static void cmpsu_temp_check(struct cmpsu_data *priv, int channel)
+{
+}
+
+static void cmpsu_fan_check(struct cmpsu_data *priv)
+{
+}
+
+static void cmpsu_limits_setup(struct cmpsu_data *priv)
+{
+}
+
+static void cmpsu_limits_init(struct cmpsu_data *priv)
+{
+}
+
+static void cmpsu_limits_remove(struct cmpsu_data *priv)
+{
+}
+
+#endif /* IS_ENABLED(CONFIG_CM_PSU_LIMITS) */
+
+#if IS_ENABLED(CONFIG_CM_PSU_THERMAL)
+
+static void cmpsu_thermal_schedule(struct cmpsu_data *priv)
+{
+	unsigned long next = priv->thermal_updated
+				+ msecs_to_jiffies(READ_ONCE(thermal_interval));
+	
+	/* Does nothing if an update is already pending */
+	queue_delayed_work(system_wq, &priv->thermal_work,
+				time_after(next, jiffies) ? next - jiffies : 0);
+}
+
+static void cmpsu_thermal_work(struct work_struct *work)
+{
+	struct cmpsu_data *priv = container_of(to_delayed_work(work),
+					struct cmpsu_data, thermal_work);
+	struct thermal_zone_device *tz;
+	int i;
+	
+	priv->thermal_updated = jiffies;
+	for (i = 0; i < COUNT_TEMP; i++) {
+		/* Only set while the zone is registered and enabled */
+		tz = READ_ONCE(priv->thermal[i].tz);
+		if (tz)
+			thermal_zone_device_update(tz, THERMAL_EVENT_TEMP_SAMPLE);
+	}
+}
+
+static int cmpsu_thermal_get_temp(struct thermal_zone_device *tz, int *temp)
+{
+	struct cmpsu_thermal *thermal = thermal_zone_device_priv(tz);
+	long value = thermal->priv->values_temp[thermal->channel];
+	
+	if (value == -1)
+		return -EAGAIN;
+	
+	*temp = value;
+	return 0;
+}
+
+static const struct thermal_zone_device_ops cmpsu_thermal_ops = {
+	.get_temp = cmpsu_thermal_get_temp,
+};
+
+/* Called with the zone locked for each of its trips */
+static int cmpsu_thermal_set_trip(struct thermal_trip *trip, void *data)
+{
+	struct cmpsu_thermal *thermal = data;
+	struct cmpsu_data *priv = thermal->priv;
+	int temp;
+	
+	if (trip->type == THERMAL_TRIP_HOT)
+		temp = READ_ONCE(priv->temp_crit[thermal->channel]);
+	else
+		temp = READ_ONCE(priv->temp_max[thermal->channel]);
+	thermal_zone_set_trip_temp(thermal->tz, trip, temp);
+	
+	return 0;
+}
+
+/*
+ * Called after temp{n}_max or temp{n}_crit was written. The trips are taken
+ * from the current limits, so the last of several writers leaves them in
+ * sync even if the writes race.
+ */
+static void cmpsu_thermal_limits_changed(struct cmpsu_data *priv, int channel)
+{
+	struct cmpsu_thermal *thermal = &priv->thermal[channel];
+	
+	mutex_lock(&priv->thermal_lock);
+	if (thermal->tz) {
+		thermal_zone_for_each_trip(thermal->tz, cmpsu_thermal_set_trip,
+					thermal);
+		thermal_zone_device_update(thermal->tz, THERMAL_TRIP_CHANGED);
+	}
+	mutex_unlock(&priv->thermal_lock);
+}
+
+/* The temperatures are already reported by our own hwmon device */
+static const struct thermal_zone_params cmpsu_thermal_params = {
+	.no_hwmon = true,
+};
+
+/*
+ * Called after IO is started, so the work item may already be running. Each
+ * zone is only published in thermal->tz once it is fully set up. The limits
+ * are read and the zones published under thermal_lock, so a limit written in
+ * the meantime still reaches the trips.
+ */
+static void cmpsu_thermal_init(struct cmpsu_data *priv)
+{
+	struct thermal_zone_device *tz;
+	struct cmpsu_thermal *thermal;
+	char name[20];
+	int ret;
+	int i;
+	
+	mutex_lock(&priv->thermal_lock);
+	for (i = 0; i < COUNT_TEMP; i++) {
+		thermal = &priv->thermal[i];
+		thermal->priv = priv;
+		thermal->channel = i;
+		thermal->trips[0].type = THERMAL_TRIP_PASSIVE;
+		thermal->trips[0].temperature = priv->temp_max[i];
+		thermal->trips[1].type = THERMAL_TRIP_HOT;
+		thermal->trips[1].temperature = priv->temp_crit[i];
+		
+		scnprintf(name, sizeof(name), "cmpsu_temp%d", i + 1);
+		tz = thermal_zone_device_register_with_trips(name,
+					thermal->trips, ARRAY_SIZE(thermal->trips),
+					thermal, &cmpsu_thermal_ops,
+					&cmpsu_thermal_params, 1000, 0);
+		if (IS_ERR(tz)) {
+			/* Not fatal, the hwmon device works without it */
+			hid_warn(priv->hdev, "failed to register thermal zone %s: %ld\n",
+						name, PTR_ERR(tz));
+			continue;
+		}
+		
+		ret = thermal_zone_device_enable(tz);
+		if (ret) {
+			thermal_zone_device_unregister(tz);
+			continue;
+		}
+		WRITE_ONCE(thermal->tz, tz);
+	}
+	mutex_unlock(&priv->thermal_lock);
+}
+
+static void cmpsu_thermal_remove(struct cmpsu_data *priv)
+{
+	struct thermal_zone_device *tz[COUNT_TEMP];
+	int i;
+	
+	/* Events may still schedule the work item, which then skips the zones */
+	mutex_lock(&priv->thermal_lock);
+	for (i = 0; i < COUNT_TEMP; i++) {
+		tz[i] = priv->thermal[i].tz;
+		WRITE_ONCE(priv->thermal[i].tz, NULL);
+	}
+	mutex_unlock(&priv->thermal_lock);
+	cancel_delayed_work_sync(&priv->thermal_work);
+	for (i = 0; i < COUNT_TEMP; i++) {
+		if (tz[i])
+			thermal_zone_device_unregister(tz[i]);
+	}
+}
+
+/* Called before IO is started */
+static void cmpsu_thermal_setup(struct cmpsu_data *priv)
+{
+	mutex_init(&priv->thermal_lock);
+	INIT_DELAYED_WORK(&priv->thermal_work, cmpsu_thermal_work);
+}
+
+#else
+
+static void cmpsu_thermal_schedule(struct cmpsu_data *priv)
+{
+}
+
+static void cmpsu_thermal_init(struct cmpsu_data *priv)
+{
+}
+
+static void cmpsu_thermal_remove(struct cmpsu_data *priv)
+{
+}
+
+static void cmpsu_thermal_setup(struct cmpsu_data *priv)
+{
+}
+
+#endif /* IS_ENABLED(CONFIG_CM_PSU_THERMAL) */
+
+#if IS_ENABLED(CONFIG_CM_PSU_LOAD)
+
+/* Adds the time since the last power event to the load before it */
+static void cmpsu_load_add(struct cmpsu_data *priv, long p_out, u64 elapsed,
+			u64 energy_in)
+{
+	unsigned int bucket;
+	
+	if (!priv->rated)
+		return;
+	
+	/* uW / (W * 10^5) = tenths of the rated wattage */
+	bucket = min_t(u64, div_u64(p_out, priv->rated * 100000),
+				LOAD_BUCKETS - 1);
+	priv->load.time[bucket] += elapsed;
+	priv->load.energy_in[bucket] += energy_in;
+	priv->load.energy_out[bucket] += div_u64((u64)p_out
+				* div_u64(elapsed, 1000), 1000000);
+}
+
+static void cmpsu_load_setup(struct cmpsu_data *priv, unsigned int rated)
+{
+	priv->rated = rated;
+}
+
+#else
+
+static void cmpsu_load_add(struct cmpsu_data *priv, long p_out, u64 elapsed,
+			u64 energy_in)
+{
+}
+
+static void cmpsu_load_setup(struct cmpsu_data *priv, unsigned int rated)
+{
+}
+
+#endif /* IS_ENABLED(CONFIG_CM_PSU_LOAD) */
+
+static void cmpsu_power_update(struct cmpsu_data *priv, long p_in, long p_out)
+{
+	u64 now = priv->timestamps[CHAN_POWER_FIRST];
+	long old_in = max(priv->values_power[0], 0L);
+	long old_out = max(priv->values_power[1], 0L);
+	u64 energy;
+	
+	if (cmpsu_energy_step(priv->values_power[0], now - priv->energy_updated,
+				&energy))
+		cmpsu_load_add(priv, old_out, now - priv->energy_updated, energy);
+	priv->energy += energy;
+	priv->energy_updated = now;
+	
+	priv->values_power[0] = p_in;
+	priv->values_power[1] = p_out;
+	cmpsu_total_update(p_in - old_in, p_out - old_out, energy);
+}
+
+/* Called before a new value of the channel is stored */
+static void cmpsu_channel_stamp(struct cmpsu_data *priv, int index, u64 now)
+{
+	cmpsu_channel_prev(priv, index);
+	priv->timestamps[index] = now;
+}
+
+/* Stores a decoded record, called with priv->lock held */
+static void cmpsu_store(void *ctx, const struct cmpsu_record *record)
+{
+	struct cmpsu_data *priv = ctx;
+	unsigned int channel = record->channel;
+	char type = record->type;
+	s64 values[2];
+	int index;
+	
+	index = cmpsu_record_convert(record, values);
+	if (index < 0)
+		return;
+	WRITE_ONCE(priv->last_event, jiffies);
+	cmpsu_cycle_check(priv, index);
+	cmpsu_channel_stamp(priv, index, ktime_get_ns());
+	/* P2 contains P_in and P_out */
+	if (type == 'P')
+		cmpsu_channel_stamp(priv, index + 1, priv->timestamps[index]);
+	
+	switch (type) {
+		case 'V':
+			priv->values_voltage[channel] = values[0];
+			priv->seq_voltage[channel]++;
+			if (channel > 0) {
+				cmpsu_ripple_add(priv, channel);
+				cmpsu_tolerance_check(priv, channel);
+			}
+			break;
+		case 'I':
+			priv->values_current[channel] = values[0];
+			priv->seq_current[channel]++;
+			break;
+		case 'T':
+			priv->values_temp[channel] = values[0];
+			priv->seq_temp[channel]++;
+			cmpsu_temp_check(priv, channel);
+			cmpsu_thermal_schedule(priv);
+			break;
+		case 'R':
+			priv->values_fan[channel] = values[0];
+			priv->seq_fan[channel]++;
+			cmpsu_fan_check(priv);
+			break;
+		case 'P':
+			cmpsu_power_update(priv, values[0], values[1]);
+			priv->seq_power[0]++;
+			priv->seq_power[1]++;
+			cmpsu_fan_check(priv);
+			break;
+	}
+	
+	cmpsu_iio_push(priv);
+}
+
+/* Decodes all records in a report */
+static void cmpsu_decode(struct cmpsu_data *priv, const u8 *data, int size)
+{
+	unsigned long flags;
+	
+	spin_lock_irqsave(&priv->lock, flags);
+	cmpsu_parse(data, size, cmpsu_store, priv);
+	spin_unlock_irqrestore(&priv->lock, flags);
+}
+
+#if IS_ENABLED(CONFIG_CM_PSU_DEFER)
+
+static void cmpsu_decode_work(struct work_struct *work)
+{
+	struct cmpsu_data *priv = container_of(work, struct cmpsu_data,
+					decode_work);
+	unsigned int head = smp_load_acquire(&priv->ring_head);
+	unsigned int tail = priv->ring_tail;
+	struct cmpsu_event *event;
+	u64 start;
+	
+	while (tail != head) {
+		start = cmpsu_hist_start();
+		event = &priv->ring[tail & (RING_LEN - 1)];
+		cmpsu_decode(priv, event->data, event->size);
+		cmpsu_hist_add(priv, HIST_DECODE, start);
+		/* Hand the slot back to raw_event */
+		smp_store_release(&priv->ring_tail, ++tail);
+		
+		if (tail == head)
+			head = smp_load_acquire(&priv->ring_head);
+	}
+}
+
+/* Queues the event for decode_work, returns false if decoding isn't deferred */
+static bool cmpsu_defer_event(struct cmpsu_data *priv, const u8 *data,
+			int size)
+{
+	struct cmpsu_event *event;
+	unsigned int head;
+	
+	if (!priv->defer)
+		return false;
+	
+	head = priv->ring_head;
+	if (size > REPORT_MAX
+	    || head - smp_load_acquire(&priv->ring_tail) >= RING_LEN) {
+		priv->ring_dropped++;
+	} else {
+		event = &priv->ring[head & (RING_LEN - 1)];
+		memcpy(event->data, data, size);
+		event->size = size;
+		/* Publish the slot to decode_work */
+		smp_store_release(&priv->ring_head, head + 1);
+		queue_work(system_highpri_wq, &priv->decode_work);
 	}
 	
-	if (channel < 0)
-		return 0;
-	/* Index from the device starts at 1 */
-	channel -= 1;
+	return true;
+}
+
+/* Called before IO is started */
+static void cmpsu_defer_setup(struct cmpsu_data *priv)
+{
+	priv->defer = defer_decode;
+	INIT_WORK(&priv->decode_work, cmpsu_decode_work);
+}
+
+static void cmpsu_defer_remove(struct cmpsu_data *priv)
+{
+	cancel_work_sync(&priv->decode_work);
+}
+
+#else
+
+static bool cmpsu_defer_event(struct cmpsu_data *priv, const u8 *data,
+			int size)
+{
+	return false;
+}
+
+static void cmpsu_defer_setup(struct cmpsu_data *priv)
+{
+}
+
+static void cmpsu_defer_remove(struct cmpsu_data *priv)
+{
+}
+
+#endif /* IS_ENABLED(CONFIG_CM_PSU_DEFER) */
+
+static void cmpsu_stream_alarm(struct cmpsu_data *priv, bool alarm)
+{
+	if (priv->stream_alarm == alarm)
+		return;
 	
-	switch (type) {
-		case 'V':
-			if (channel >= COUNT_VOLTAGE)
-				return 0;
-			priv->values_voltage[channel] = (value1 * 1000) + (value2 * 100);
-			break;
-		case 'I':
-			if (channel >= COUNT_CURRENT)
-				return 0;
-			priv->values_current[channel] = (value1 * 1000) + (value2 * 100);
-			break;
-		case 'T':
-			if (channel >= COUNT_TEMP)
-				return 0;
-			priv->values_temp[channel] = (value1 * 1000) + (value2 * 100);
-			break;
-		case 'R':
-			if (channel >= COUNT_FAN)
-				return 0;
-			priv->values_fan[channel] = value1;
+	WRITE_ONCE(priv->stream_alarm, alarm);
+	sysfs_notify(&priv->hwmon_dev->kobj, NULL, "stream_alarm");
+}
+
+/*
+ * Called after a recovery step. Events may have been lost, so a partial
+ * cycle is dropped, and the device gets a full timeout from now.
+ */
+static void cmpsu_stream_restart(struct cmpsu_data *priv)
+{
+	unsigned long flags;
+	
+	spin_lock_irqsave(&priv->lock, flags);
+	cmpsu_cycle_reset(priv);
+	spin_unlock_irqrestore(&priv->lock, flags);
+	WRITE_ONCE(priv->last_event, jiffies);
+}
+
+static void cmpsu_watchdog_work(struct work_struct *work)
+{
+	struct cmpsu_data *priv = container_of(to_delayed_work(work),
+					struct cmpsu_data, watchdog_work);
+	struct hid_device *hdev = priv->hdev;
+	unsigned int timeout = READ_ONCE(watchdog_timeout);
+	unsigned long last_event = READ_ONCE(priv->last_event);
+	bool in_use;
+	
+	if (!timeout) {
+		/* Disabled, check again later in case it gets enabled */
+		timeout = 5000;
+		goto out;
+	}
+	if (time_before(jiffies, last_event + msecs_to_jiffies(timeout))) {
+		priv->watchdog_level = 0;
+		cmpsu_stream_alarm(priv, false);
+		goto out;
+	}
+	
+	cmpsu_stream_alarm(priv, true);
+	/*
+	 * hid_hw_close() only stops the input if nobody else (e.g. hidraw) has
+	 * the device open, so reopening it would do nothing in that case
+	 */
+	in_use = READ_ONCE(hdev->ll_open_count) > 1;
+	if (priv->watchdog_level == 0 && !in_use) {
+		hid_warn(hdev, "no events for %u ms, reopening device\n", timeout);
+		hid_hw_close(hdev);
+		if (hid_hw_open(hdev))
+			hid_err(hdev, "failed to reopen device\n");
+	} else if (priv->watchdog_level < 2 && hid_is_usb(hdev)) {
+		if (priv->watchdog_level == 0)
+			hid_warn(hdev, "no events for %u ms and device is in use, resetting USB device\n",
+						timeout);
+		else
+			hid_warn(hdev, "still no events, resetting USB device\n");
+		/*
+		 * usbhid handles the reset in pre_reset/post_reset, so the HID
+		 * device and this driver stay bound and keep their state
+		 */
+		usb_queue_reset_device(to_usb_interface(hdev->dev.parent));
+		priv->watchdog_level = 1;
+	} else {
+		/* Nothing left to try until the PSU sends events again */
+		goto out;
+	}
+	priv->watchdog_level++;
+	WRITE_ONCE(priv->stream_recoveries, priv->stream_recoveries + 1);
+	cmpsu_stream_restart(priv);
+	
+out:
+	schedule_delayed_work(&priv->watchdog_work, msecs_to_jiffies(timeout));
+}
+
+static int cmpsu_raw_event(struct hid_device *hdev, struct hid_report *report,
+			u8 *data, int size)
+{
+	struct cmpsu_data *priv = hid_get_drvdata(hdev);
+	u64 start = cmpsu_hist_start();
+	
+	if (!cmpsu_defer_event(priv, data, size)) {
+		cmpsu_decode(priv, data, size);
+		cmpsu_hist_add(priv, HIST_DECODE, start);
+	}
+	cmpsu_hist_add(priv, HIST_RAW_EVENT, start);
+	
+	return 0;
+}
+
+#if CMPSU_DEBUGFS
+
+#if IS_ENABLED(CONFIG_CM_PSU_STATS)
+
+static const char *cmpsu_hist_names[HIST_COUNT] = {
+	[HIST_RAW_EVENT] = "raw_event",
+	[HIST_DECODE] = "decode",
+	[HIST_INJECT] = "inject",
+};
+
+static void cmpsu_debugfs_hist(struct seq_file *seqf, struct cmpsu_data *priv,
+			int index)
+{
+	long count;
+	int i;
+	
+	seq_printf(seqf, "%s:\n", cmpsu_hist_names[index]);
+	for (i = 0; i < HIST_LEN; i++) {
+		count = atomic_long_read(&priv->hist[index][i]);
+		if (!count)
+			continue;
+		if (i == HIST_LEN - 1)
+			seq_printf(seqf, "  >= %llu ns: %ld\n", 1ULL << i, count);
+		else
+			seq_printf(seqf, "  %llu - %llu ns: %ld\n", 1ULL << i,
+						(1ULL << (i + 1)) - 1, count);
+	}
+}
+
+static int cmpsu_debugfs_timing_show(struct seq_file *seqf, void *unused)
+{
+	struct cmpsu_data *priv = seqf->private;
+	long injected = atomic_long_read(&priv->injected);
+	
+#if IS_ENABLED(CONFIG_CM_PSU_DEFER)
+	seq_printf(seqf, "mode: %s\n", priv->defer ? "deferred" : "direct");
+	seq_printf(seqf, "dropped: %lu\n", priv->ring_dropped);
+#else
+	seq_puts(seqf, "mode: direct\n");
+#endif
+	cmpsu_debugfs_hist(seqf, priv, HIST_RAW_EVENT);
+	cmpsu_debugfs_hist(seqf, priv, HIST_DECODE);
+	if (injected) {
+		seq_printf(seqf, "injected: %ld\n", injected);
+		cmpsu_debugfs_hist(seqf, priv, HIST_INJECT);
+	}
+	
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cmpsu_debugfs_timing);
+
+/*
+ * Data written to the inject file is split into reports of inject_len bytes
+ * (CMPSU_EVENT_LEN by default, at most REPORT_MAX) and decoded as if it came
+ * from the PSU. This always calls the decoder directly, as the ring used with
+ * defer_decode only has room for a single producer.
+ */
+static ssize_t cmpsu_debugfs_inject_write(struct file *file,
+			const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct cmpsu_data *priv = file->private_data;
+	size_t report_len = clamp_t(u32, READ_ONCE(priv->inject_len), 1,
+				REPORT_MAX);
+	/* Whole reports only, so none is split across two copies */
+	size_t chunk = rounddown(PAGE_SIZE, report_len);
+	size_t done = 0;
+	size_t len;
+	size_t i;
+	u64 start;
+	u8 *data;
+	
+	data = kmalloc(chunk, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+	
+	while (done < count) {
+		len = min_t(size_t, count - done, chunk);
+		if (copy_from_user(data, buf + done, len))
 			break;
-		case 'P':
-			if (channel != 1)
-				return 0;
-			priv->values_power[0] = value1 * 1000000;
-			priv->values_power[1] = value2 * 1000000;
+		
+		for (i = 0; i < len; i += report_len) {
+			start = cmpsu_hist_start();
+			cmpsu_decode(priv, data + i, min_t(size_t, len - i, report_len));
+			cmpsu_hist_add(priv, HIST_INJECT, start);
+		}
+		atomic_long_add(DIV_ROUND_UP(len, report_len), &priv->injected);
+		done += len;
+		cond_resched();
+	}
+	
+	kfree(data);
+	return done ? done : -EFAULT;
+}
+
+static const struct file_operations cmpsu_debugfs_inject_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = cmpsu_debugfs_inject_write,
+	.llseek = noop_llseek,
+};
+
+#endif /* IS_ENABLED(CONFIG_CM_PSU_STATS) */
+
+#if IS_ENABLED(CONFIG_CM_PSU_LOAD)
+
+/*
+ * One line per load bucket with the time spent in it, the energy that went in
+ * and out and the efficiency (in thousandths of a percent, like the
+ * aggregate's efficiency attribute)
+ */
+static int cmpsu_debugfs_load_show(struct seq_file *seqf, void *unused)
+{
+	struct cmpsu_data *priv = seqf->private;
+	struct cmpsu_load load;
+	unsigned long flags;
+	int i;
+	
+	spin_lock_irqsave(&priv->lock, flags);
+	load = priv->load;
+	spin_unlock_irqrestore(&priv->lock, flags);
+	
+	seq_printf(seqf, "rated: %u W\n", priv->rated);
+	seq_puts(seqf, "load time_ms energy_in_uj energy_out_uj efficiency\n");
+	for (i = 0; i < LOAD_BUCKETS; i++) {
+		if (i == LOAD_BUCKETS - 1)
+			seq_printf(seqf, ">=%d%%", i * 10);
+		else
+			seq_printf(seqf, "%d-%d%%", i * 10, (i + 1) * 10);
+		seq_printf(seqf, " %llu %llu %llu ",
+					div_u64(load.time[i], NSEC_PER_MSEC),
+					load.energy_in[i], load.energy_out[i]);
+		/* energy_out * 100000 overflows u64 after 51 kWh in a bucket */
+		if (load.energy_in[i])
+			seq_printf(seqf, "%llu\n", mul_u64_u64_div_u64(
+						load.energy_out[i], 100000,
+						load.energy_in[i]));
+		else
+			seq_puts(seqf, "-\n");
+	}
+	
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cmpsu_debugfs_load);
+
+#endif /* IS_ENABLED(CONFIG_CM_PSU_LOAD) */
+
+static void cmpsu_debugfs_init(struct cmpsu_data *priv)
+{
+	char name[32];
+	
+	scnprintf(name, sizeof(name), "%s-%s", DRIVER_NAME,
+				dev_name(&priv->hdev->dev));
+	
+	priv->debugfs = debugfs_create_dir(name, NULL);
+#if IS_ENABLED(CONFIG_CM_PSU_STATS)
+	debugfs_create_file("timing", 0444, priv->debugfs, priv,
+				&cmpsu_debugfs_timing_fops);
+	debugfs_create_file("inject", 0200, priv->debugfs, priv,
+				&cmpsu_debugfs_inject_fops);
+	priv->inject_len = CMPSU_EVENT_LEN;
+	debugfs_create_u32("inject_len", 0644, priv->debugfs, &priv->inject_len);
+#endif
+#if IS_ENABLED(CONFIG_CM_PSU_LOAD)
+	if (priv->rated)
+		debugfs_create_file("load", 0444, priv->debugfs, priv,
+					&cmpsu_debugfs_load_fops);
+#endif
+}
+
+static void cmpsu_debugfs_remove(struct cmpsu_data *priv)
+{
+	debugfs_remove_recursive(priv->debugfs);
+}
+
+#else
+
+static void cmpsu_debugfs_init(struct cmpsu_data *priv)
+{
+}
+
+static void cmpsu_debugfs_remove(struct cmpsu_data *priv)
+{
+}
+
+#endif /* CMPSU_DEBUGFS */
+
+#if IS_ENABLED(CONFIG_CM_PSU_RETAIN)
+
+/*
+ * Product ID, serial number and USB path. Identical units may report the same
+ * serial number, so it can't be used alone. Without a serial number, another
+ * model plugged into the same port doesn't get the counters, but another unit
+ * of the same model can't be told apart.
+ */
+static void cmpsu_saved_key(struct hid_device *hdev, char *key)
+{
+	if (hdev->uniq[0])
+		snprintf(key, CMPSU_KEY_LEN, "%04x:%s@%s", hdev->product,
+					hdev->uniq, hdev->phys);
+	else
+		snprintf(key, CMPSU_KEY_LEN, "%04x@%s", hdev->product,
+					hdev->phys);
+}
+
+/* Called with cmpsu_saved_lock held */
+static void cmpsu_saved_expire(void)
+{
+	struct cmpsu_saved *saved, *tmp;
+	
+	list_for_each_entry_safe(saved, tmp, &cmpsu_saved, list) {
+		if (time_after(jiffies, saved->expires)) {
+			list_del(&saved->list);
+			kfree(saved);
+		}
+	}
+}
+
+static void cmpsu_saved_store(struct cmpsu_data *priv)
+{
+	struct cmpsu_saved *saved;
+	int __maybe_unused i;
+	
+	if (!priv->hdev->phys[0] || !retain_time)
+		return;
+	
+	saved = kzalloc(sizeof(*saved), GFP_KERNEL);
+	if (!saved)
+		return;
+	
+	cmpsu_saved_key(priv->hdev, saved->key);
+	saved->expires = jiffies + min_t(unsigned int, retain_time,
+					RETAIN_TIME_MAX) * HZ;
+	saved->energy = priv->energy;
+	memcpy(saved->seq_voltage, priv->seq_voltage, sizeof(saved->seq_voltage));
+	memcpy(saved->seq_current, priv->seq_current, sizeof(saved->seq_current));
+	memcpy(saved->seq_power, priv->seq_power, sizeof(saved->seq_power));
+	memcpy(saved->seq_temp, priv->seq_temp, sizeof(saved->seq_temp));
+	memcpy(saved->seq_fan, priv->seq_fan, sizeof(saved->seq_fan));
+#if IS_ENABLED(CONFIG_CM_PSU_NETLINK)
+	saved->cycle = priv->cycle;
+#endif
+#if IS_ENABLED(CONFIG_CM_PSU_LOAD)
+	saved->load = priv->load;
+#endif
+#if IS_ENABLED(CONFIG_CM_PSU_LIMITS)
+	memcpy(saved->temp_max, priv->temp_max, sizeof(saved->temp_max));
+	memcpy(saved->temp_crit, priv->temp_crit, sizeof(saved->temp_crit));
+	memcpy(saved->fan_min, priv->fan_min, sizeof(saved->fan_min));
+	
+	for (i = 0; i < COUNT_VOLTAGE; i++) {
+		saved->tolerance[i] = priv->tolerance[i];
+		/* Close an ongoing excursion, the rail's state is unknown now */
+		if (priv->tolerance[i].min_alarm || priv->tolerance[i].max_alarm)
+			saved->tolerance[i].excursion_ms += jiffies_to_msecs(jiffies
+						- priv->tolerance[i].excursion_start);
+		saved->tolerance[i].min_alarm = false;
+		saved->tolerance[i].max_alarm = false;
+	}
+#endif
+	
+	mutex_lock(&cmpsu_saved_lock);
+	cmpsu_saved_expire();
+	list_add_tail(&saved->list, &cmpsu_saved);
+	mutex_unlock(&cmpsu_saved_lock);
+}
+
+/*
+ * Called right before IO is started, so the decoder can't run concurrently.
+ * If probe fails after this, cmpsu_saved_store() puts the state back.
+ */
+static void cmpsu_saved_restore(struct cmpsu_data *priv)
+{
+	char key[CMPSU_KEY_LEN];
+	struct cmpsu_saved *saved;
+	bool found = false;
+	
+	if (!priv->hdev->phys[0])
+		return;
+	cmpsu_saved_key(priv->hdev, key);
+	
+	mutex_lock(&cmpsu_saved_lock);
+	cmpsu_saved_expire();
+	list_for_each_entry(saved, &cmpsu_saved, list) {
+		if (!strcmp(saved->key, key)) {
+			list_del(&saved->list);
+			found = true;
 			break;
+		}
+	}
+	mutex_unlock(&cmpsu_saved_lock);
+	
+	if (!found)
+		return;
+	
+	priv->energy = saved->energy;
+	memcpy(priv->seq_voltage, saved->seq_voltage, sizeof(saved->seq_voltage));
+	memcpy(priv->seq_current, saved->seq_current, sizeof(saved->seq_current));
+	memcpy(priv->seq_power, saved->seq_power, sizeof(saved->seq_power));
+	memcpy(priv->seq_temp, saved->seq_temp, sizeof(saved->seq_temp));
+	memcpy(priv->seq_fan, saved->seq_fan, sizeof(saved->seq_fan));
+#if IS_ENABLED(CONFIG_CM_PSU_NETLINK)
+	priv->cycle = saved->cycle;
+#endif
+#if IS_ENABLED(CONFIG_CM_PSU_LOAD)
+	priv->load = saved->load;
+#endif
+#if IS_ENABLED(CONFIG_CM_PSU_LIMITS)
+	memcpy(priv->tolerance, saved->tolerance, sizeof(saved->tolerance));
+	memcpy(priv->temp_max, saved->temp_max, sizeof(saved->temp_max));
+	memcpy(priv->temp_crit, saved->temp_crit, sizeof(saved->temp_crit));
+	memcpy(priv->fan_min, saved->fan_min, sizeof(saved->fan_min));
+#endif
+	kfree(saved);
+	
+	hid_info(priv->hdev, "restored counters of %s\n", key);
+}
+
+static void cmpsu_saved_free(void)
+{
+	struct cmpsu_saved *saved, *tmp;
+	
+	list_for_each_entry_safe(saved, tmp, &cmpsu_saved, list) {
+		list_del(&saved->list);
+		kfree(saved);
+	}
+}
+
+#else
+
+static void cmpsu_saved_store(struct cmpsu_data *priv)
+{
+}
+
+static void cmpsu_saved_restore(struct cmpsu_data *priv)
+{
+}
+
+static void cmpsu_saved_free(void)
+{
+}
+
+#endif /* IS_ENABLED(CONFIG_CM_PSU_RETAIN) */
+
+/* Sets up everything used by raw_event before starting IO */
+static void cmpsu_setup(struct cmpsu_data *priv,
+			const struct cmpsu_model *model)
+{
+	int i;
+	
+	spin_lock_init(&priv->lock);
+	for (i = 0; i < COUNT_VOLTAGE; i++)
+		priv->values_voltage[i] = -1;
+	for (i = 0; i < COUNT_CURRENT; i++)
+		priv->values_current[i] = -1;
+	for (i = 0; i < COUNT_POWER; i++)
+		priv->values_power[i] = -1;
+	for (i = 0; i < COUNT_TEMP; i++)
+		priv->values_temp[i] = -1;
+	for (i = 0; i < COUNT_FAN; i++)
+		priv->values_fan[i] = -1;
+	cmpsu_nl_setup(priv);
+	cmpsu_ripple_setup(priv);
+	cmpsu_limits_setup(priv);
+	cmpsu_thermal_setup(priv);
+	INIT_DELAYED_WORK(&priv->watchdog_work, cmpsu_watchdog_work);
+	priv->model = model;
+	cmpsu_load_setup(priv, model ? model->rated : 0);
+}
+
+static int cmpsu_probe(struct hid_device *hdev, const struct hid_device_id *id)
+{
+	struct cmpsu_data *priv;
+	int ret;
+	
+	priv = devm_kzalloc(&hdev->dev, sizeof(struct cmpsu_data), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+	
+	cmpsu_setup(priv, cmpsu_model_find(hdev->product));
+	priv->hdev = hdev;
+	
+	ret = hid_parse(hdev);
+	if (ret)
+		return ret;
+	
+	ret = hid_hw_start(hdev, HID_CONNECT_HIDRAW);
+	if (ret)
+		return ret;
+	
+	ret = hid_hw_open(hdev);
+	if (ret) {
+		hid_hw_stop(hdev);
+		return ret;
+	}
+	
+	cmpsu_defer_setup(priv);
+	hid_set_drvdata(hdev, priv);
+	cmpsu_saved_restore(priv);
+	hid_device_io_start(hdev);
+	
+	priv->hwmon_dev = hwmon_device_register_with_info(&hdev->dev, "cmpsu",
+					priv, &cmpsu_chip_info, cmpsu_groups);
+	if (IS_ERR(priv->hwmon_dev)) {
+		ret = PTR_ERR(priv->hwmon_dev);
+		hid_hw_close(hdev);
+		cmpsu_defer_remove(priv);
+		cmpsu_limits_remove(priv);
+		/* No zones are registered yet, this only cancels thermal_work */
+		cmpsu_thermal_remove(priv);
+		/* Same as in cmpsu_remove(), keeps the restored counters */
+		cmpsu_total_update(-max(priv->values_power[0], 0L),
+					-max(priv->values_power[1], 0L), 0);
+		cmpsu_saved_store(priv);
+		hid_hw_stop(hdev);
+		return ret;
 	}
 	
+	mutex_lock(&cmpsu_devices_lock);
+	list_add_tail(&priv->list, &cmpsu_devices);
+	mutex_unlock(&cmpsu_devices_lock);
+	
+	priv->last_event = jiffies;
+	schedule_delayed_work(&priv->watchdog_work,
+				msecs_to_jiffies(watchdog_timeout ? : 5000));
+	
+	cmpsu_limits_init(priv);
+	cmpsu_thermal_init(priv);
+	
+	ret = cmpsu_iio_init(priv);
+	if (ret)
+		hid_warn(hdev, "failed to register IIO device: %d\n", ret);
+	
+	cmpsu_debugfs_init(priv);
+	
 	return 0;
 }
 
-/* Pulled from MasterPlus' DeviceList.cfg (may contain unreleased models) */
+static void cmpsu_remove(struct hid_device *hdev)
+{
+	struct cmpsu_data *priv = hid_get_drvdata(hdev);
+	
+	mutex_lock(&cmpsu_devices_lock);
+	list_del(&priv->list);
+	mutex_unlock(&cmpsu_devices_lock);
+	
+	cmpsu_debugfs_remove(priv);
+	/* The watchdog may reopen the device */
+	cancel_delayed_work_sync(&priv->watchdog_work);
+	hid_hw_close(hdev);
+	cmpsu_defer_remove(priv);
+	/* decode_work may have queued notify_work */
+	cmpsu_limits_remove(priv);
+	/* No more events at this point, take this PSU out of the totals */
+	cmpsu_total_update(-max(priv->values_power[0], 0L),
+				-max(priv->values_power[1], 0L), 0);
+	cmpsu_saved_store(priv);
+	cmpsu_iio_remove(priv);
+	cmpsu_thermal_remove(priv);
+	hwmon_device_unregister(priv->hwmon_dev);
+	hid_hw_stop(hdev);
+}
+
+#define CMPSU_HID_ENTRY(product, rated, flags, name) \
+	{ HID_USB_DEVICE(CMPSU_VENDOR, product) },
+
+/* Same models as cmpsu_models in cm-psu-proto.h */
 static const struct hid_device_id cmpsu_idtable[] = {
-	{ HID_USB_DEVICE(0x2516, 0x0030) }, /* MasterWatt 1200 */
-	{ HID_USB_DEVICE(0x2516, 0x018D) }, /* V550 GOLD i MULTI */
-	{ HID_USB_DEVICE(0x2516, 0x018F) }, /* V650 GOLD i MULTI */
-	{ HID_USB_DEVICE(0x2516, 0x0191) }, /* V750 GOLD i MULTI */
-	{ HID_USB_DEVICE(0x2516, 0x0193) }, /* V850 GOLD i MULTI */
-	{ HID_USB_DEVICE(0x2516, 0x0195) }, /* V550 GOLD i 12VO */
-	{ HID_USB_DEVICE(0x2516, 0x0197) }, /* V650 GOLD i 12VO */
-	{ HID_USB_DEVICE(0x2516, 0x0199) }, /* V750 GOLD i 12VO */
-	{ HID_USB_DEVICE(0x2516, 0x019B) }, /* V850 GOLD i 12VO */
-	{ HID_USB_DEVICE(0x2516, 0x019D) }, /* V650 PLATINUM i 12VO */
-	{ HID_USB_DEVICE(0x2516, 0x019F) }, /* V750 PLATINUM i 12VO */
-	{ HID_USB_DEVICE(0x2516, 0x01A1) }, /* V850 PLATINUM i 12VO */
-	{ HID_USB_DEVICE(0x2516, 0x01A5) }, /* FANLESS 1300 */
+	CMPSU_MODELS(CMPSU_HID_ENTRY)
 	{ }
 };
 MODULE_DEVICE_TABLE(hid, cmpsu_idtable);
@@ -425,8 +2870,48 @@ static struct hid_driver cmpsu_driver = {
 	.remove = cmpsu_remove,
 	.raw_event = cmpsu_raw_event,
 };
-module_hid_driver(cmpsu_driver);
+
+static int __init cmpsu_init(void)
+{
+	int ret;
+	
+	ret = cmpsu_nl_init();
+	if (ret)
+		return ret;
+	
+	ret = cmpsu_total_init();
+	if (ret)
+		goto err_genl;
+	
+	ret = hid_register_driver(&cmpsu_driver);
+	if (ret)
+		goto err_total;
+	
+	return 0;
+	
+err_total:
+	cmpsu_total_remove();
+err_genl:
+	cmpsu_nl_remove();
+	return ret;
+}
+
+static void __exit cmpsu_exit(void)
+{
+	hid_unregister_driver(&cmpsu_driver);
+	cmpsu_saved_free();
+	cmpsu_total_remove();
+	cmpsu_nl_remove();
+}
+
+module_init(cmpsu_init);
+module_exit(cmpsu_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jannis Mast <jannis@ctrl-c.xyz>");
 MODULE_DESCRIPTION("Driver for Cooler Master power supplies with HID interface");
+
+/* The tests need the driver's internals, so they are built into it */
+#if IS_ENABLED(CONFIG_CM_PSU_KUNIT_TEST)
+#include "cm-psu-test.c"
+#endif
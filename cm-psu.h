@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+/*
+ * cm-psu.h - Userspace interface of the cm-psu driver
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#ifndef _CM_PSU_H
+#define _CM_PSU_H
+
+/*
+ * Generic netlink interface:
+ * - CMPSU_CMD_GET (dump): Returns the current values of every bound PSU, one
+ *   message per device
+ * - CMPSU_CMD_CYCLE: Sent to the "cycles" multicast group each time a PSU
+ *   completes a cycle, which is when a channel is received for the second
+ *   time since the last cycle
+ * - Both messages use the same attributes. There is one CMPSU_ATTR_CHANNEL
+ *   for each channel that has a value, CMPSU_ATTR_ENERGY is the same counter
+ *   as energy1_input.
+ * - CMPSU_CMD_GET_ALIGNED (do): Returns the values of all PSUs at a common
+ *   CMPSU_ATTR_TIMESTAMP, interpolated between the two most recent values of
+ *   each channel. The timestamp can be given in the request, otherwise the
+ *   end of the oldest of the PSUs' last complete cycles is used. Each PSU is
+ *   a nested CMPSU_ATTR_PSU with the same attributes as above.
+ */
+
+#define CMPSU_GENL_NAME "cm-psu"
+#define CMPSU_GENL_VERSION 1
+#define CMPSU_GENL_MCGRP_CYCLES "cycles"
+
+enum cmpsu_cmd {
+	CMPSU_CMD_UNSPEC,
+	CMPSU_CMD_GET,
+	CMPSU_CMD_CYCLE,
+	CMPSU_CMD_GET_ALIGNED,
+
+	__CMPSU_CMD_MAX,
+};
+#define CMPSU_CMD_MAX (__CMPSU_CMD_MAX - 1)
+
+enum cmpsu_attr {
+	CMPSU_ATTR_UNSPEC,
+	CMPSU_ATTR_PAD,
+	CMPSU_ATTR_DEVICE,    /* string, name of the HID device */
+	CMPSU_ATTR_PRODUCT,   /* u32, USB product ID */
+	CMPSU_ATTR_SERIAL,    /* string, only if reported by the PSU */
+	CMPSU_ATTR_CYCLE,     /* u64, number of completed cycles */
+	CMPSU_ATTR_TIMESTAMP, /* u64, CLOCK_MONOTONIC in ns */
+	CMPSU_ATTR_CHANNEL,   /* nested, CMPSU_CHANNEL_ATTR_* */
+	CMPSU_ATTR_PSU,       /* nested, CMPSU_ATTR_* */
+	CMPSU_ATTR_ENERGY,    /* u64, uJ, same as energy1_input */
+
+	__CMPSU_ATTR_MAX,
+};
+#define CMPSU_ATTR_MAX (__CMPSU_ATTR_MAX - 1)
+
+enum cmpsu_channel_attr {
+	CMPSU_CHANNEL_ATTR_UNSPEC,
+	CMPSU_CHANNEL_ATTR_PAD,
+	CMPSU_CHANNEL_ATTR_TYPE,      /* u8, enum cmpsu_channel_type */
+	CMPSU_CHANNEL_ATTR_INDEX,     /* u8, starting at 0 for every type */
+	CMPSU_CHANNEL_ATTR_VALUE,     /* s64, unit depends on the type */
+	CMPSU_CHANNEL_ATTR_SEQ,       /* u64, number of values received */
+	CMPSU_CHANNEL_ATTR_TIMESTAMP, /* u64, CLOCK_MONOTONIC in ns */
+
+	__CMPSU_CHANNEL_ATTR_MAX,
+};
+#define CMPSU_CHANNEL_ATTR_MAX (__CMPSU_CHANNEL_ATTR_MAX - 1)
+
+/* Same order and units as the hwmon attributes */
+enum cmpsu_channel_type {
+	CMPSU_TYPE_VOLTAGE, /* mV: V_AC, +5V, +3.3V, +12V2, +12V1 */
+	CMPSU_TYPE_CURRENT, /* mA: I_AC, I_+5V, I_+3.3V, I_+12V2, I_+12V1 */
+	CMPSU_TYPE_POWER,   /* uW: P_in, P_out */
+	CMPSU_TYPE_TEMP,    /* millidegree Celsius */
+	CMPSU_TYPE_FAN,     /* RPM */
+};
+
+#endif /* _CM_PSU_H */
@@ -0,0 +1,372 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-or-later
+#
+# check-exporter.py - Checks the output of cmpsu-exporter
+# Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+#
+# Runs cmpsu-exporter on directories in the format of cmpsu-hidraw, fetches
+# /metrics with curl and checks it against the OpenMetrics text format (also
+# with the parser of prometheus_client, if it is installed). The emulator
+# needs /dev/uhid and the driver, so the PSUs are files here.
+#
+# Then checks that the batches sent with -u keep the PSU index of a device
+# while another one disappears and comes back, and that a PSU replacing
+# another one while all slots are taken gets the freed slot.
+#
+# Usage: check-exporter.py [path to cmpsu-exporter]
+
+import math
+import os
+import re
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+TYPES = {
+	"counter": ("_total", "_created"),
+	"gauge": ("",),
+	"info": ("_info",),
+	"stateset": ("",),
+	"unknown": ("",),
+	"histogram": ("_bucket", "_count", "_sum", "_created"),
+	"gaugehistogram": ("_bucket", "_gcount", "_gsum"),
+	"summary": ("", "_count", "_sum", "_created"),
+}
+
+NAME = r"[a-zA-Z_:][a-zA-Z0-9_:]*"
+LABEL = r'([a-zA-Z_][a-zA-Z0-9_]*)="((?:[^"\\\n]|\\[\\"n])*)"'
+SAMPLE = re.compile(r"(%s)(?:\{((?:%s)(?:,%s)*)?\})? (\S+)(?: (\S+))?$"
+			% (NAME, LABEL, LABEL))
+VALUE = re.compile(r"[+-]?(?:\d+\.?\d*(?:[eE][+-]?\d+)?|\.\d+(?:[eE][+-]?\d+)?"
+			r"|Inf|NaN)$")
+
+# Two PSUs in the format of cmpsu-hidraw, values in hwmon units
+PSUS = {
+	"psu0": {
+		"product": "0x018f",
+		"in0_input": 230000, "in3_input": 12010, "in4_input": 12020,
+		"curr1_input": 1200, "curr4_input": 8000,
+		"power1_input": 250000000, "power2_input": 230000000,
+		"temp1_input": 38500, "fan1_input": 650,
+		"energy1_input": 123456789,
+	},
+	# Fanless and without an energy counter
+	"psu1": {
+		"product": "0x01a5",
+		"in0_input": 229000, "power1_input": 100000000,
+		"temp1_input": 41000,
+	},
+}
+
+
+def fail(what):
+	raise SystemExit("FAIL: " + what)
+
+
+def parse_labels(text):
+	labels = {}
+	for name, value in re.findall(LABEL, text or ""):
+		if name in labels:
+			return None
+		labels[name] = value
+	return labels
+
+
+def validate(text):
+	"""Returns {family: (type, {sample: [(labels, value)]})}"""
+	families = {}
+	family = None
+	seen_samples = False
+
+	if not text.endswith("# EOF\n"):
+		fail("output doesn't end with # EOF")
+	lines = text[:-len("# EOF\n")].split("\n")
+	if lines.pop() != "":
+		fail("output doesn't end with a newline before # EOF")
+
+	for line in lines:
+		if line.startswith("#"):
+			parts = line.split(" ", 3)
+			if len(parts) < 4 or parts[1] not in ("TYPE", "UNIT", "HELP"):
+				fail("invalid metadata: " + line)
+			kind, name, arg = parts[1:]
+			if not re.fullmatch(NAME, name):
+				fail("invalid family name: " + line)
+			if name != family:
+				if name in families:
+					fail("family %s is repeated or interleaved" % name)
+				families[name] = ["unknown", {}, set()]
+				family = name
+				seen_samples = False
+			meta = families[name]
+			if kind in meta[2]:
+				fail("%s of %s is repeated" % (kind, name))
+			if seen_samples:
+				fail("%s of %s after its samples" % (kind, name))
+			meta[2].add(kind)
+			if kind == "TYPE":
+				if arg not in TYPES:
+					fail("unknown type: " + line)
+				meta[0] = arg
+			elif kind == "UNIT":
+				if not name.endswith("_" + arg):
+					fail("family name doesn't end with its unit: " + line)
+			elif re.search(r'\\[^\\n"]', arg):
+				fail("invalid escape in HELP: " + line)
+			continue
+
+		match = SAMPLE.match(line)
+		if not match:
+			fail("invalid sample: %r" % line)
+		name, labels, value = match.group(1), match.group(2), match.group(7)
+		labels = parse_labels(labels)
+		if labels is None:
+			fail("label repeated: " + line)
+		if not VALUE.match(value):
+			fail("invalid value: " + line)
+		if family is None or not any(name == family + suffix
+					for suffix in TYPES[families[family][0]]):
+			fail("sample %s doesn't belong to family %s" % (name, family))
+		value = float(value)
+		ftype = families[family][0]
+		if ftype == "counter" and (value < 0 or math.isnan(value)):
+			fail("negative counter: " + line)
+		if ftype == "info" and value != 1:
+			fail("info value isn't 1: " + line)
+		samples = families[family][1].setdefault(name, [])
+		if labels in (l for l, v in samples):
+			fail("duplicate sample: " + line)
+		samples.append((labels, value))
+		seen_samples = True
+
+	return {name: (meta[0], meta[1]) for name, meta in families.items()}
+
+
+def validate_prometheus(text):
+	try:
+		from prometheus_client.openmetrics.parser import \
+			text_string_to_metric_families
+	except ImportError:
+		print("prometheus_client not installed, skipping its parser")
+		return
+	try:
+		list(text_string_to_metric_families(text))
+	except Exception as e:
+		fail("prometheus_client: %s" % e)
+
+
+def self_test():
+	"""Makes sure the validator rejects what it should"""
+	good = "# TYPE a_volts gauge\n# UNIT a_volts volts\na_volts{x=\"1\"} 1\n"
+	bad = [
+		good,  # No # EOF
+		good.replace("a_volts{", "b_volts{") + "# EOF\n",
+		good.replace("volts\n", "watts\n", 1) + "# EOF\n",
+		good + "a_volts{x=\"1\"} 2\n# EOF\n",
+		good + "# TYPE c counter\nc 1\n# TYPE a_volts gauge\n# EOF\n",
+		"# TYPE c counter\nc 1\n# EOF\n",
+		good.replace("1\n", "one\n") + "# EOF\n",
+		good.replace("\"1\"", "\"a\"b\"") + "# EOF\n",
+	]
+	validate(good + "# EOF\n")
+	for text in bad:
+		try:
+			validate(text)
+		except SystemExit:
+			continue
+		fail("validator accepted %r" % text)
+
+
+def free_port(kind):
+	sock = socket.socket(socket.AF_INET, kind)
+	sock.bind(("127.0.0.1", 0))
+	port = sock.getsockname()[1]
+	sock.close()
+	return port
+
+
+def scrape(port):
+	for i in range(50):
+		result = subprocess.run(["curl", "-sf", "-D", "-",
+					"http://[::1]:%d/metrics" % port],
+					capture_output=True)
+		if result.returncode == 0:
+			headers, _, body = result.stdout.partition(b"\r\n\r\n")
+			return headers.decode(), body.decode()
+		time.sleep(0.1)
+	fail("exporter didn't answer")
+
+
+def check_metrics(exporter, top):
+	port = free_port(socket.SOCK_STREAM)
+	proc = subprocess.Popen([exporter, "-l", "-p", str(port),
+				"-d", os.path.join(top, "psu0"),
+				"-d", os.path.join(top, "psu1")])
+	try:
+		headers, text = scrape(port)
+	finally:
+		proc.terminate()
+		proc.wait()
+
+	if "application/openmetrics-text; version=1.0.0" not in headers:
+		fail("wrong Content-Type")
+	families = validate(text)
+	validate_prometheus(text)
+
+	def value(family, sample, **labels):
+		for l, v in families[family][1].get(sample, []):
+			if l == labels:
+				return v
+		fail("missing %s%s" % (sample, labels))
+
+	if value("cmpsu_voltage_volts", "cmpsu_voltage_volts", psu="psu0",
+				sensor="V_AC") != 230:
+		fail("wrong V_AC")
+	if value("cmpsu_power_watts", "cmpsu_power_watts", psu="psu1",
+				sensor="P_in") != 100:
+		fail("wrong P_in")
+	if value("cmpsu_energy_joules", "cmpsu_energy_joules_total",
+				psu="psu0") != 123.456789:
+		fail("wrong energy")
+	if families["cmpsu_psu"][1]["cmpsu_psu_info"][1][0]["model"] \
+				!= "FANLESS 1300":
+		fail("wrong model")
+	for l, v in families["cmpsu_fan_rpm"][1]["cmpsu_fan_rpm"]:
+		if l["psu"] == "psu1":
+			fail("fan of a fanless PSU")
+	print("metrics: %d families, %d lines" % (len(families),
+				text.count("\n")))
+
+
+def receive(sock, until, product=None):
+	"""Returns (psu index, product, seq, count) of the packets until then"""
+	packets = []
+	while time.monotonic() < until:
+		sock.settimeout(max(until - time.monotonic(), 0.01))
+		try:
+			data = sock.recv(2048)
+		except socket.timeout:
+			break
+		if data[:4] != b"CMPW":
+			fail("packet without magic")
+		seq, pid = struct.unpack_from("<IH", data, 16)
+		packets.append((data[5], pid, seq, data[6]))
+		if pid == product:
+			break
+	return packets
+
+
+def check_push(exporter, top):
+	sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+	sock.bind(("127.0.0.1", 0))
+	port = free_port(socket.SOCK_STREAM)
+	proc = subprocess.Popen([exporter, "-l", "-p", str(port),
+				"-u", "127.0.0.1:%d" % sock.getsockname()[1],
+				"-i", "200", "-b", "2",
+				"-d", os.path.join(top, "psu0"),
+				"-d", os.path.join(top, "psu1")])
+	gone = os.path.join(top, "gone")
+	try:
+		# Right after a batch, so psu0 has one cycle waiting at the removal
+		before = receive(sock, time.monotonic() + 2, 0x018f)
+		time.sleep(0.3)
+		os.rename(os.path.join(top, "psu0"), gone)
+		during = receive(sock, time.monotonic() + 1)
+		os.rename(gone, os.path.join(top, "psu0"))
+		after = receive(sock, time.monotonic() + 1)
+	finally:
+		proc.terminate()
+		proc.wait()
+		sock.close()
+
+	index = {}
+	for psu, product, seq, count in before + during + after:
+		if index.setdefault(product, psu) != psu:
+			fail("product 0x%04x moved from PSU %d to %d"
+						% (product, index[product], psu))
+	if len(index) != 2 or len(set(index.values())) != 2:
+		fail("expected two PSUs with their own index: %s" % index)
+
+	# The partial batch of the removed PSU is sent before its slot is freed
+	removed = [p for p in during if p[1] == 0x018f]
+	if [p[3] for p in removed] != [1]:
+		fail("expected one partial batch of the removed PSU: %s" % removed)
+	if not any(p[1] == 0x01a5 for p in during):
+		fail("no batches of the remaining PSU")
+	# Coming back, it starts a new series
+	back = [p for p in after if p[1] == 0x018f]
+	if not back or back[0][2] != 0:
+		fail("returning PSU doesn't restart at sequence number 0")
+	print("push: %d packets, indices %s" % (len(before + during + after),
+				{"0x%04x" % k: v for k, v in index.items()}))
+
+
+def check_push_full(exporter, top):
+	"""All 16 slots taken, one PSU goes away as another one appears"""
+	sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+	sock.bind(("127.0.0.1", 0))
+	full = os.path.join(top, "full")
+	os.mkdir(full)
+	for n in range(16):
+		os.mkdir(os.path.join(full, "psu%d" % n))
+		with open(os.path.join(full, "psu%d" % n, "product"), "w") as f:
+			f.write("0x%04x\n" % (0x100 + n))
+		with open(os.path.join(full, "psu%d" % n, "in0_input"), "w") as f:
+			f.write("230000\n")
+	args = []
+	for n in range(17):
+		args += ["-d", os.path.join(full, "psu%d" % n)]
+	port = free_port(socket.SOCK_STREAM)
+	proc = subprocess.Popen([exporter, "-l", "-p", str(port),
+				"-u", "127.0.0.1:%d" % sock.getsockname()[1],
+				"-i", "50", "-b", "2"] + args)
+	try:
+		before = receive(sock, time.monotonic() + 0.5)
+		# psu5 is gone and psu16 appears in the same collection
+		with open(os.path.join(full, "psu5", "product"), "w") as f:
+			f.write("0x0200\n")
+		os.rename(os.path.join(full, "psu5"), os.path.join(full, "psu16"))
+		after = receive(sock, time.monotonic() + 0.5)
+		running = proc.poll() is None
+	finally:
+		proc.terminate()
+		proc.wait()
+		sock.close()
+
+	if not running:
+		fail("exporter exited with %d with all slots taken" % proc.returncode)
+	index = {p[1]: p[0] for p in before}
+	if len(index) != 16:
+		fail("expected 16 PSUs before: %s" % sorted(index))
+	new = {p[0] for p in after if p[1] == 0x0200}
+	if new != {index[0x105]}:
+		fail("new PSU didn't get the freed slot %d: %s" % (index[0x105], new))
+	for psu, product, seq, count in after:
+		if product not in (0x105, 0x200) and index[product] != psu:
+			fail("product 0x%04x moved from PSU %d to %d"
+						% (product, index[product], psu))
+	print("push at capacity: new PSU got slot %d" % index[0x105])
+
+
+def main():
+	exporter = os.path.abspath(sys.argv[1] if len(sys.argv) > 1
+				else os.path.join(os.path.dirname(__file__),
+				"cmpsu-exporter"))
+	self_test()
+	with tempfile.TemporaryDirectory() as top:
+		for name, files in PSUS.items():
+			os.mkdir(os.path.join(top, name))
+			for file, value in files.items():
+				with open(os.path.join(top, name, file), "w") as f:
+					f.write("%s\n" % value)
+		check_metrics(exporter, top)
+		check_push(exporter, top)
+		check_push_full(exporter, top)
+	print("OK")
+
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,314 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cmpsu-bench.c - Measures concurrent reads of the driver's hwmon attributes
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Every thread opens all *_input, *_label etc. attributes of the PSU's hwmon
+ * device once and re-reads them with pread() in a loop, like a monitoring
+ * agent would. The latency of each read goes into a histogram with 8 buckets
+ * per power of two, so no memory is allocated while measuring.
+ *
+ * Run cmpsu-emu (e.g. with -r 0) at the same time to see how the readers
+ * contend with the decoder.
+ */
+
+#define MAX_ATTRS 128
+#define HIST_SUB 8
+#define HIST_LEN (64 * HIST_SUB)
+
+struct worker {
+	pthread_t thread;
+	int fds[MAX_ATTRS];
+	unsigned long long reads;
+	unsigned long long errors;
+	uint64_t max;
+	unsigned long long hist[HIST_LEN];
+};
+
+static char attr_paths[MAX_ATTRS][300];
+static int attr_count;
+static volatile int running;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Log-linear bucket: power of two plus 3 bits below the top bit */
+static int hist_bucket(uint64_t ns)
+{
+	int log;
+	
+	if (ns < HIST_SUB)
+		return ns;
+	log = 63 - __builtin_clzll(ns);
+	return (log - 2) * HIST_SUB + ((ns >> (log - 3)) & (HIST_SUB - 1));
+}
+
+/* Lower bound of a bucket */
+static uint64_t hist_value(int bucket)
+{
+	int log = bucket / HIST_SUB + 2;
+	
+	if (bucket < HIST_SUB)
+		return bucket;
+	return (1ULL << log) + ((uint64_t) (bucket % HIST_SUB) << (log - 3));
+}
+
+static int find_hwmon(char *path, size_t size)
+{
+	struct dirent *entry;
+	char name[32];
+	char buf[300];
+	DIR *dir;
+	FILE *file;
+	int found = 0;
+	
+	dir = opendir("/sys/class/hwmon");
+	if (!dir)
+		return -1;
+	while (!found && (entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(buf, sizeof(buf), "/sys/class/hwmon/%s/name", entry->d_name);
+		file = fopen(buf, "r");
+		if (!file)
+			continue;
+		if (fgets(name, sizeof(name), file) && !strcmp(name, "cmpsu\n")) {
+			snprintf(path, size, "/sys/class/hwmon/%s", entry->d_name);
+			found = 1;
+		}
+		fclose(file);
+	}
+	closedir(dir);
+	
+	return found ? 0 : -1;
+}
+
+static int is_attr(const char *name)
+{
+	static const char * const suffixes[] = {
+		"_input", "_label", "_min", "_max", "_crit", "_alarm", "_seq",
+		"_stddev", "_excursions", "_excursion_ms",
+	};
+	size_t len = strlen(name);
+	size_t i;
+	
+	for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+		size_t suffix = strlen(suffixes[i]);
+	
+		if (len > suffix && !strcmp(name + len - suffix, suffixes[i]))
+			return 1;
+	}
+	
+	return 0;
+}
+
+static int find_attrs(const char *hwmon)
+{
+	struct dirent *entry;
+	DIR *dir;
+	
+	dir = opendir(hwmon);
+	if (!dir)
+		return -1;
+	while (attr_count < MAX_ATTRS && (entry = readdir(dir))) {
+		if (!is_attr(entry->d_name))
+			continue;
+		snprintf(attr_paths[attr_count], sizeof(attr_paths[0]), "%s/%s",
+					hwmon, entry->d_name);
+		attr_count++;
+	}
+	closedir(dir);
+	
+	return attr_count ? 0 : -1;
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *worker = arg;
+	char buf[64];
+	uint64_t start;
+	uint64_t delta;
+	int i;
+	
+	while (running) {
+		for (i = 0; i < attr_count && running; i++) {
+			start = now_ns();
+			if (pread(worker->fds[i], buf, sizeof(buf), 0) < 0) {
+				/* Values that aren't available yet return ENODATA */
+				worker->errors++;
+			}
+			delta = now_ns() - start;
+			worker->hist[hist_bucket(delta)]++;
+			if (delta > worker->max)
+				worker->max = delta;
+			worker->reads++;
+		}
+	}
+	
+	return NULL;
+}
+
+static uint64_t percentile(const unsigned long long *hist,
+			unsigned long long total, double p)
+{
+	unsigned long long target = total * p;
+	unsigned long long sum = 0;
+	int i;
+	
+	for (i = 0; i < HIST_LEN; i++) {
+		sum += hist[i];
+		if (sum > target)
+			return hist_value(i);
+	}
+	
+	return hist_value(HIST_LEN - 1);
+}
+
+static int run(int threads, double duration)
+{
+	static unsigned long long hist[HIST_LEN];
+	struct worker *workers;
+	unsigned long long reads = 0;
+	unsigned long long errors = 0;
+	uint64_t max = 0;
+	uint64_t start;
+	double elapsed;
+	int ret = 0;
+	int i;
+	int j;
+	
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers)
+		return -1;
+	for (i = 0; i < threads; i++) {
+		for (j = 0; j < attr_count; j++) {
+			workers[i].fds[j] = open(attr_paths[j], O_RDONLY | O_CLOEXEC);
+			if (workers[i].fds[j] < 0) {
+				perror(attr_paths[j]);
+				ret = -1;
+			}
+		}
+	}
+	if (ret)
+		goto out;
+	
+	running = 1;
+	start = now_ns();
+	for (i = 0; i < threads; i++)
+		pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+	usleep(duration * 1e6);
+	running = 0;
+	for (i = 0; i < threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	elapsed = (now_ns() - start) / 1e9;
+	
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i < threads; i++) {
+		for (j = 0; j < HIST_LEN; j++)
+			hist[j] += workers[i].hist[j];
+		reads += workers[i].reads;
+		errors += workers[i].errors;
+		if (workers[i].max > max)
+			max = workers[i].max;
+	}
+	
+	printf("%7d %12.0f %9llu %9llu %9llu %9llu %9llu %8llu\n", threads,
+				reads / elapsed,
+				(unsigned long long) percentile(hist, reads, 0.5),
+				(unsigned long long) percentile(hist, reads, 0.9),
+				(unsigned long long) percentile(hist, reads, 0.99),
+				(unsigned long long) percentile(hist, reads, 0.999),
+				(unsigned long long) max, errors);
+	
+out:
+	for (i = 0; i < threads; i++) {
+		for (j = 0; j < attr_count; j++) {
+			if (workers[i].fds[j] >= 0)
+				close(workers[i].fds[j]);
+		}
+	}
+	free(workers);
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -d DIR        hwmon directory (default: first cmpsu device)\n"
+		"  -n THREADS    Maximum number of threads (default: 8)\n"
+		"  -t SECONDS    Duration of each step (default: 5)\n"
+		"Runs with 1, 2, 4, ... threads up to the maximum.\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	char hwmon[300] = "";
+	double duration = 5;
+	int threads = 8;
+	int opt;
+	int n;
+	
+	while ((opt = getopt(argc, argv, "d:n:t:h")) != -1) {
+		switch (opt) {
+			case 'd':
+				snprintf(hwmon, sizeof(hwmon), "%s", optarg);
+				break;
+			case 'n':
+				threads = atoi(optarg);
+				break;
+			case 't':
+				duration = atof(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (threads < 1 || duration <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	
+	if (!hwmon[0] && find_hwmon(hwmon, sizeof(hwmon))) {
+		fprintf(stderr, "no cmpsu hwmon device found\n");
+		return 1;
+	}
+	if (find_attrs(hwmon)) {
+		fprintf(stderr, "%s: no attributes found\n", hwmon);
+		return 1;
+	}
+	fprintf(stderr, "reading %d attributes of %s\n", attr_count, hwmon);
+	
+	printf("threads      reads/s   p50(ns)   p90(ns)   p99(ns) p99.9(ns)"
+				"   max(ns)   errors\n");
+	for (n = 1; ; n *= 2) {
+		if (n > threads)
+			n = threads;
+		if (run(n, duration))
+			return 1;
+		if (n == threads)
+			break;
+	}
+	
+	return 0;
+}
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cmpsu-capture.c - Capture files of raw PSU reports
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <string.h>
+
+#include "cmpsu-capture.h"
+
+int cmpsu_capture_write_header(FILE *file, uint16_t product)
+{
+	struct cmpsu_capture_header header = {
+		.version = htole16(CMPSU_CAPTURE_VERSION),
+		.product = htole16(product),
+	};
+	
+	memcpy(header.magic, CMPSU_CAPTURE_MAGIC, sizeof(header.magic));
+	if (fwrite(&header, sizeof(header), 1, file) != 1)
+		return -1;
+	
+	return 0;
+}
+
+/* Length of the reports in version 1 files */
+#define CAPTURE_V1_LEN 16
+
+int cmpsu_capture_read_header(FILE *file, uint16_t *product, int *version)
+{
+	struct cmpsu_capture_header header;
+	
+	if (fread(&header, sizeof(header), 1, file) != 1) {
+		if (!ferror(file))
+			errno = EINVAL;
+		return -1;
+	}
+	*version = le16toh(header.version);
+	if (memcmp(header.magic, CMPSU_CAPTURE_MAGIC, sizeof(header.magic))
+	    || *version < 1 || *version > CMPSU_CAPTURE_VERSION) {
+		errno = EINVAL;
+		return -1;
+	}
+	
+	*product = le16toh(header.product);
+	return 0;
+}
+
+int cmpsu_capture_write(FILE *file, uint64_t timestamp, const void *data,
+			size_t size)
+{
+	uint64_t le_timestamp = htole64(timestamp);
+	uint16_t le_size;
+	
+	if (size > CMPSU_CAPTURE_MAX)
+		size = CMPSU_CAPTURE_MAX;
+	le_size = htole16(size);
+	if (fwrite(&le_timestamp, sizeof(le_timestamp), 1, file) != 1
+	    || fwrite(&le_size, sizeof(le_size), 1, file) != 1
+	    || fwrite(data, 1, size, file) != size)
+		return -1;
+	
+	return 0;
+}
+
+int cmpsu_capture_read(FILE *file, int version,
+			struct cmpsu_capture_record *record)
+{
+	uint16_t size = CAPTURE_V1_LEN;
+	
+	if (fread(&record->timestamp, sizeof(record->timestamp), 1, file) != 1)
+		goto out;
+	if (version > 1) {
+		if (fread(&size, sizeof(size), 1, file) != 1)
+			goto out;
+		size = le16toh(size);
+		if (size > CMPSU_CAPTURE_MAX) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	if (fread(record->data, 1, size, file) != size)
+		goto out;
+	
+	record->timestamp = le64toh(record->timestamp);
+	record->size = size;
+	return 1;
+	
+out:
+	if (ferror(file))
+		return -1;
+	/* A truncated last record is ignored */
+	return 0;
+}
@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * cmpsu-capture.h - Capture files of raw PSU reports
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#ifndef _CMPSU_CAPTURE_H
+#define _CMPSU_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "libcmpsu.h"
+
+/*
+ * Capture file format, all values are little endian:
+ * - Header (16 bytes): magic "CMPSUCAP", u16 version (2), u16 USB product ID,
+ *   u32 reserved (0)
+ * - Any number of records: u64 CLOCK_MONOTONIC timestamp in ns, u16 length
+ *   of the report, followed by the report as received from the PSU (at most
+ *   CMPSU_CAPTURE_MAX bytes, longer reports are cut off)
+ *
+ * Version 1 files are read as well. Their records have no length field and
+ * always contain 16 bytes (reports were padded with zero bytes or cut off).
+ */
+
+#define CMPSU_CAPTURE_MAGIC "CMPSUCAP"
+#define CMPSU_CAPTURE_VERSION 2
+
+/* Same as REPORT_MAX in the driver */
+#define CMPSU_CAPTURE_MAX 64
+
+struct cmpsu_capture_header {
+	char magic[8];
+	uint16_t version;
+	uint16_t product;
+	uint32_t reserved;
+};
+
+struct cmpsu_capture_record {
+	uint64_t timestamp;
+	uint16_t size;
+	uint8_t data[CMPSU_CAPTURE_MAX];
+};
+
+/*
+ * Return 0 or -1 with errno set, EINVAL for files in an unknown format. The
+ * version of the file is needed to read its records.
+ */
+int cmpsu_capture_write_header(FILE *file, uint16_t product);
+int cmpsu_capture_read_header(FILE *file, uint16_t *product, int *version);
+
+int cmpsu_capture_write(FILE *file, uint64_t timestamp, const void *data,
+			size_t size);
+
+/* Returns 1 if a record was read, 0 at the end of the file or -1 */
+int cmpsu_capture_read(FILE *file, int version,
+			struct cmpsu_capture_record *record);
+
+#endif /* _CMPSU_CAPTURE_H */
@@ -0,0 +1,469 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cmpsu-collector.c - Receives PSU readings from many hosts
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#define _GNU_SOURCE /* recvmmsg() */
+
+#include <errno.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmpsu-wire.h"
+
+/*
+ * Every thread has its own socket on the same port (SO_REUSEPORT). A BPF
+ * program picks the socket by the host ID in the packet, so all packets of a
+ * host end up in the same thread and the threads don't share any state.
+ *
+ * Each PSU gets a ring buffer with the last cycles (-H). Memory is only
+ * allocated when a new PSU shows up, never per packet. Lost cycles are
+ * counted by their sequence numbers, cycles that arrive after a later one
+ * are counted as late and dropped, the history only grows forward.
+ */
+
+#define MAX_THREADS 64
+#define RECV_BATCH 64
+
+#define STAT_ADD(x, n) __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+#define STAT_GET(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+struct series {
+	uint64_t host; /* 0 for unused entries */
+	uint8_t psu;
+	uint16_t product;
+	uint32_t next_seq;
+	unsigned long long cycles;
+	unsigned long long lost;
+	int head; /* Next entry to write */
+	int len;
+	uint64_t *timestamps;
+	int32_t (*values)[CMPSU_COUNT_ALL]; /* -1 if missing */
+	uint64_t energy;
+	int64_t power[2]; /* Latest P_in and P_out */
+};
+
+struct shard {
+	pthread_t thread;
+	int fd;
+	struct series *table; /* Open addressing, size is a power of two */
+	unsigned int size;
+	unsigned int used;
+	
+	/* Also read by the main thread */
+	unsigned long long packets;
+	unsigned long long bytes;
+	unsigned long long cycles;
+	unsigned long long lost;
+	unsigned long long late;
+	unsigned long long invalid;
+	int64_t power[2]; /* Sum of the latest values of all PSUs */
+};
+
+static struct shard shards[MAX_THREADS];
+static int shard_count;
+static int history = 120;
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static uint64_t hash(uint64_t host, uint8_t psu)
+{
+	uint64_t x = host ^ ((uint64_t) psu << 56);
+	
+	/* splitmix64 finalizer */
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static struct series *table_slot(struct series *table, unsigned int size,
+			uint64_t host, uint8_t psu)
+{
+	unsigned int i = hash(host, psu) & (size - 1);
+	
+	while (table[i].host && (table[i].host != host || table[i].psu != psu))
+		i = (i + 1) & (size - 1);
+	
+	return &table[i];
+}
+
+static int table_grow(struct shard *shard)
+{
+	unsigned int size = shard->size ? shard->size * 2 : 1024;
+	struct series *table;
+	unsigned int i;
+	
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return -1;
+	for (i = 0; i < shard->size; i++) {
+		if (shard->table[i].host)
+			*table_slot(table, size, shard->table[i].host,
+						shard->table[i].psu) = shard->table[i];
+	}
+	free(shard->table);
+	shard->table = table;
+	shard->size = size;
+	
+	return 0;
+}
+
+static struct series *series_get(struct shard *shard,
+			const struct cmpsu_wire_header *hdr)
+{
+	struct series *series;
+	
+	/* Host 0 marks unused entries */
+	if (!hdr->host)
+		return NULL;
+	
+	if (shard->size) {
+		series = table_slot(shard->table, shard->size, hdr->host, hdr->psu);
+		if (series->host)
+			return series;
+	}
+	
+	if ((shard->used + 1) * 2 > shard->size && table_grow(shard))
+		return NULL;
+	series = table_slot(shard->table, shard->size, hdr->host, hdr->psu);
+	series->timestamps = calloc(history, sizeof(*series->timestamps));
+	series->values = calloc(history, sizeof(*series->values));
+	if (!series->timestamps || !series->values) {
+		free(series->timestamps);
+		free(series->values);
+		series->timestamps = NULL;
+		series->values = NULL;
+		return NULL;
+	}
+	series->host = hdr->host;
+	series->psu = hdr->psu;
+	series->product = hdr->product;
+	series->power[0] = series->power[1] = 0;
+	STAT_ADD(shard->used, 1);
+	
+	return series;
+}
+
+static void series_append(struct shard *shard, struct series *series,
+			const struct cmpsu_wire_cycle *cycle)
+{
+	int64_t value;
+	int i;
+	
+	series->timestamps[series->head] = cycle->timestamp;
+	for (i = 0; i < CMPSU_COUNT_ALL; i++) {
+		value = cycle->values[i];
+		series->values[series->head][i] = value > INT32_MAX ? INT32_MAX
+					: value < 0 ? -1 : value;
+	}
+	series->head = (series->head + 1) % history;
+	if (series->len < history)
+		series->len++;
+	series->energy = cycle->energy;
+	
+	/* P_in and P_out are the first power channels */
+	for (i = 0; i < 2; i++) {
+		value = cycle->values[CMPSU_COUNT_VOLTAGE + CMPSU_COUNT_CURRENT + i];
+		if (value < 0)
+			continue;
+		STAT_ADD(shard->power[i], value - series->power[i]);
+		series->power[i] = value;
+	}
+}
+
+static void ingest(struct shard *shard, const uint8_t *buf, int len)
+{
+	struct cmpsu_wire_cycle cycles[CMPSU_WIRE_CYCLES];
+	struct cmpsu_wire_header hdr;
+	struct series *series;
+	int32_t gap;
+	int count;
+	int i;
+	
+	STAT_ADD(shard->packets, 1);
+	STAT_ADD(shard->bytes, len);
+	count = cmpsu_wire_decode(buf, len, &hdr, cycles, CMPSU_WIRE_CYCLES);
+	if (count < 0 || !(series = series_get(shard, &hdr))) {
+		STAT_ADD(shard->invalid, 1);
+		return;
+	}
+	
+	/* The sender was restarted */
+	if (hdr.seq == 0)
+		series->next_seq = 0;
+	
+	for (i = 0; i < count; i++) {
+		gap = hdr.seq + i - series->next_seq;
+		if (gap < 0) {
+			STAT_ADD(shard->late, 1);
+			continue;
+		}
+		if (gap > 0) {
+			series->lost += gap;
+			STAT_ADD(shard->lost, gap);
+		}
+		series_append(shard, series, &cycles[i]);
+		series->next_seq = hdr.seq + i + 1;
+		series->cycles++;
+		STAT_ADD(shard->cycles, 1);
+	}
+}
+
+static void *shard_run(void *arg)
+{
+	static __thread uint8_t bufs[RECV_BATCH][CMPSU_WIRE_MAX + 1];
+	struct mmsghdr msgs[RECV_BATCH];
+	struct iovec iovs[RECV_BATCH];
+	struct shard *shard = arg;
+	int n;
+	int i;
+	
+	for (i = 0; i < RECV_BATCH; i++) {
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = sizeof(bufs[i]);
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	
+	while (!stop) {
+		n = recvmmsg(shard->fd, msgs, RECV_BATCH, 0, NULL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			perror("recvmmsg");
+			break;
+		}
+		for (i = 0; i < n; i++)
+			ingest(shard, bufs[i], msgs[i].msg_len);
+	}
+	
+	return NULL;
+}
+
+/* Sends each packet to the socket given by its host ID modulo the count */
+static int attach_filter(int fd, int count)
+{
+	struct sock_filter code[] = {
+		/* Low 32 bits of the host ID, loaded big endian */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 8),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+	
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+				sizeof(prog));
+}
+
+static int open_socket(int port)
+{
+	struct sockaddr_in6 addr = {
+		.sin6_family = AF_INET6,
+		.sin6_port = htons(port),
+		.sin6_addr = IN6ADDR_ANY_INIT,
+	};
+	struct timeval timeout = { .tv_usec = 200000 };
+	int size = 8 << 20;
+	int one = 1;
+	int fd;
+	
+	fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	/* So the threads notice when to stop */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+/* Writes the stored history of all PSUs as CSV */
+static int dump(const char *path)
+{
+	const struct series *series;
+	FILE *file;
+	int32_t value;
+	unsigned int j;
+	int entry;
+	int s;
+	int i;
+	int k;
+	
+	file = fopen(path, "w");
+	if (!file)
+		return -1;
+	
+	fprintf(file, "host,psu,product,timestamp_ms");
+	for (k = 0; k < CMPSU_COUNT_ALL; k++)
+		fprintf(file, ",%s", cmpsu_state_name(k));
+	fprintf(file, "\n");
+	
+	for (s = 0; s < shard_count; s++) {
+		for (j = 0; j < shards[s].size; j++) {
+			series = &shards[s].table[j];
+			if (!series->host)
+				continue;
+			for (i = 0; i < series->len; i++) {
+				entry = (series->head - series->len + i + history) % history;
+				fprintf(file, "%llu,%u,0x%04x,%llu",
+							(unsigned long long) series->host,
+							series->psu, series->product,
+							(unsigned long long)
+							(series->timestamps[entry] / 1000000));
+				for (k = 0; k < CMPSU_COUNT_ALL; k++) {
+					value = series->values[entry][k];
+					if (value >= 0)
+						fprintf(file, ",%d", value);
+					else
+						fprintf(file, ",");
+				}
+				fprintf(file, "\n");
+			}
+		}
+	}
+	
+	return fclose(file);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"Receives PSU readings sent by cmpsu-exporter -u or cmpsu-sender\n"
+		"  -p PORT       UDP port (default: %d)\n"
+		"  -t THREADS    Number of receiving threads (default: number of\n"
+		"                CPUs)\n"
+		"  -H CYCLES     Cycles kept per PSU (default: 120)\n"
+		"  -s SECONDS    Interval of the statistics (default: 5)\n"
+		"  -o FILE       Write the stored cycles as CSV on exit\n",
+		name, CMPSU_WIRE_PORT);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long last[4] = { 0 };
+	unsigned long long total[6];
+	const char *output = NULL;
+	struct timespec ts;
+	int64_t power[2];
+	unsigned int psus;
+	double interval = 5;
+	int port = CMPSU_WIRE_PORT;
+	int ret = 0;
+	int opt;
+	int i;
+	
+	shard_count = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "p:t:H:s:o:h")) != -1) {
+		switch (opt) {
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 't':
+				shard_count = atoi(optarg);
+				break;
+			case 'H':
+				history = atoi(optarg);
+				break;
+			case 's':
+				interval = atof(optarg);
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (shard_count > MAX_THREADS)
+		shard_count = MAX_THREADS;
+	if (shard_count < 1 || history < 1 || interval <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	
+	for (i = 0; i < shard_count; i++) {
+		shards[i].fd = open_socket(port);
+		if (shards[i].fd < 0) {
+			perror("failed to open socket");
+			return 1;
+		}
+	}
+	if (shard_count > 1 && attach_filter(shards[0].fd, shard_count))
+		perror("SO_ATTACH_REUSEPORT_CBPF, hosts may be split across "
+					"threads");
+	
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	for (i = 0; i < shard_count; i++)
+		pthread_create(&shards[i].thread, NULL, shard_run, &shards[i]);
+	fprintf(stderr, "listening on port %d with %d threads\n", port,
+				shard_count);
+	
+	printf("    psus  packets/s     kB/s  cycles/s       lost       late"
+				"    invalid    P_in(W)   P_out(W)\n");
+	while (!stop) {
+		ts.tv_sec = interval;
+		ts.tv_nsec = (interval - ts.tv_sec) * 1e9;
+		while (nanosleep(&ts, &ts) && !stop)
+			;
+		if (stop)
+			break;
+	
+		memset(total, 0, sizeof(total));
+		power[0] = power[1] = 0;
+		psus = 0;
+		for (i = 0; i < shard_count; i++) {
+			total[0] += STAT_GET(shards[i].packets);
+			total[1] += STAT_GET(shards[i].bytes);
+			total[2] += STAT_GET(shards[i].cycles);
+			total[3] += STAT_GET(shards[i].lost);
+			total[4] += STAT_GET(shards[i].late);
+			total[5] += STAT_GET(shards[i].invalid);
+			power[0] += STAT_GET(shards[i].power[0]);
+			power[1] += STAT_GET(shards[i].power[1]);
+			psus += STAT_GET(shards[i].used);
+		}
+		printf("%8u %10.0f %8.1f %9.0f %10llu %10llu %10llu %10.0f %10.0f\n",
+					psus, (total[0] - last[0]) / interval,
+					(total[1] - last[1]) / interval / 1000,
+					(total[2] - last[2]) / interval, total[3], total[4],
+					total[5], power[0] / 1e6, power[1] / 1e6);
+		fflush(stdout);
+		memcpy(last, total, sizeof(last));
+	}
+	
+	for (i = 0; i < shard_count; i++)
+		pthread_join(shards[i].thread, NULL);
+	if (output && dump(output)) {
+		perror(output);
+		ret = 1;
+	}
+	
+	return ret;
+}
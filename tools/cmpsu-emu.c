@@ -0,0 +1,402 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cmpsu-emu.c - Emulates a Cooler Master PSU using uhid
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmpsu-uhid.h"
+
+/*
+ * The emulated PSU sends the same records as a V850 Gold i multi, one record
+ * per 16 byte report, in this order:
+ * V1-V5 (V_AC, +5V, +3.3V, +12V2, +12V1), I1-I5, P2 (P_in/P_out), T1, T2, R1
+ *
+ * The load (P_out) follows the selected waveform, everything else is derived
+ * from it with a simple model of a ~90% efficient PSU with a hybrid fan.
+ *
+ * Faults (-f, can be given several times):
+ * - drop:N     Drop N% of the reports
+ * - corrupt:N  Replace N% of the reports with garbage
+ * - split:N    Split N% of the records across two reports, which the driver
+ *              drops as it doesn't reassemble records
+ * - sag:N      Let the 12V rails sag by N% at full load
+ * - fanstop    Report a stopped fan regardless of load
+ * - stall:N    Stop sending after N seconds until the device is reopened,
+ *              like a PSU whose USB interface hangs. uhid devices aren't USB
+ *              devices (hid_is_usb() is false), so this only tests the
+ *              driver's first recovery step, not the USB reset. It can't
+ *              resume while hidraw is open as well, since the driver skips
+ *              the reopen then and uhid only reports the last close.
+ */
+
+#define RECORDS_PER_CYCLE 14
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+enum waveform {
+	WAVE_STEADY,
+	WAVE_RAMP,
+	WAVE_STEP,
+	WAVE_NOISE,
+};
+
+static const char * const waveform_names[] = {
+	[WAVE_STEADY] = "steady",
+	[WAVE_RAMP] = "ramp",
+	[WAVE_STEP] = "step",
+	[WAVE_NOISE] = "noise",
+};
+
+struct emu {
+	const struct cmpsu_model *model;
+	enum waveform waveform;
+	double load;   /* W */
+	double peak;   /* W, for ramp and step */
+	double period; /* s, for ramp and step */
+	double rate;   /* reports per second, 0 for as fast as possible */
+	double duration;
+	int drop;
+	int corrupt;
+	int split;
+	double sag;
+	int fanstop;
+	double stall;
+	uint64_t seed;
+	int verbose;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+	uint64_t x = *state;
+	
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+/* Uniformly distributed in [0, 1) */
+static double uniform(uint64_t *state)
+{
+	return (xorshift(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int chance(uint64_t *state, int percent)
+{
+	return percent && (int) (xorshift(state) % 100) < percent;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double waveform_load(const struct emu *emu, double t, uint64_t *rng)
+{
+	double phase = emu->period > 0 ? fmod(t, emu->period) / emu->period : 0;
+	
+	switch (emu->waveform) {
+		case WAVE_STEADY:
+			return emu->load;
+		case WAVE_RAMP:
+			return emu->load + (emu->peak - emu->load) * phase;
+		case WAVE_STEP:
+			return phase < 0.5 ? emu->load : emu->peak;
+		case WAVE_NOISE:
+			/* Random load around the base value, up to peak */
+			return emu->load + (emu->peak - emu->load) * uniform(rng);
+	}
+	
+	return emu->load;
+}
+
+/* Formats record n (0 to RECORDS_PER_CYCLE - 1) of a cycle at load p_out */
+static int format_record(const struct emu *emu, char *buf, size_t size, int n,
+			double p_out, uint64_t *rng)
+{
+	double rated = emu->model->rated;
+	double frac = p_out / rated;
+	double p_in = p_out / (0.87 + 0.06 * (frac < 0.5 ? frac * 2 : 1));
+	double v_ac = 230.0 + (uniform(rng) - 0.5) * 4;
+	double v12 = 12.1 - 0.2 * frac - emu->sag / 100 * 12.1 * frac;
+	double volts[5] = { v_ac, 5.05, 3.32, v12, v12 };
+	/* Most of the load is on the 12V rails */
+	double amps[5] = {
+		p_in / v_ac, 2 + 6 * frac, 1 + 4 * frac,
+		p_out * 0.45 / v12, p_out * 0.45 / v12
+	};
+	double temp = 30 + 35 * frac;
+	unsigned int fan = 0;
+	
+	/* Hybrid mode: The fan only starts above 30% load */
+	if (frac > 0.3 && !emu->fanstop)
+		fan = 500 + 1200 * (frac - 0.3);
+	
+	if (n < 5)
+		return snprintf(buf, size, "[V%d%05.1f]", n + 1,
+					volts[n] + (uniform(rng) - 0.5) * 0.02);
+	if (n < 10)
+		return snprintf(buf, size, "[I%d%05.1f]", n - 4, amps[n - 5]);
+	switch (n) {
+		case 10:
+			return snprintf(buf, size, "[P2%04u/%04u]",
+						(unsigned int) (p_in + 0.5),
+						(unsigned int) (p_out + 0.5));
+		case 11:
+			return snprintf(buf, size, "[T1%05.1f]", temp);
+		case 12:
+			return snprintf(buf, size, "[T2%05.1f]", temp + 4);
+		default:
+			return snprintf(buf, size, "[R1%04u]", fan);
+	}
+}
+
+static int send_report(struct cmpsu_uhid *dev, const char *data, size_t len)
+{
+	uint8_t report[CMPSU_EVENT_LEN] = { 0 };
+	
+	memcpy(report, data, len < sizeof(report) ? len : sizeof(report));
+	return cmpsu_uhid_send(dev, report, sizeof(report));
+}
+
+static int emu_run(struct emu *emu, struct cmpsu_uhid *dev)
+{
+	uint64_t rng = emu->seed;
+	unsigned long long sent = 0;
+	double start = now();
+	double next = start;
+	double stats = start;
+	double t;
+	char record[32];
+	unsigned long closes;
+	int stalled = 0;
+	int n = 0;
+	int len;
+	int i;
+	
+	while (!stop) {
+		t = now() - start;
+		if (emu->duration > 0 && t >= emu->duration)
+			break;
+	
+		if (cmpsu_uhid_poll(dev) < 0)
+			return -1;
+		if (emu->stall > 0 && !stalled && t >= emu->stall) {
+			fprintf(stderr, "stalling until the device is reopened\n");
+			stalled = 1;
+			/*
+			 * The close and the open usually arrive in the same poll,
+			 * so dev->open alone doesn't show that anything happened
+			 */
+			closes = dev->closes;
+			while (!stop && (dev->closes == closes || !dev->open)) {
+				if (cmpsu_uhid_poll(dev) < 0)
+					return -1;
+				usleep(10000);
+			}
+			fprintf(stderr, "reopened, resuming\n");
+			emu->stall = 0;
+			next = now();
+		}
+	
+		len = format_record(emu, record, sizeof(record), n,
+					waveform_load(emu, t, &rng), &rng);
+		n = (n + 1) % RECORDS_PER_CYCLE;
+	
+		if (chance(&rng, emu->drop)) {
+			/* Nothing */
+		} else if (chance(&rng, emu->corrupt)) {
+			for (i = 0; i < CMPSU_EVENT_LEN; i++)
+				record[i] = xorshift(&rng);
+			if (send_report(dev, record, CMPSU_EVENT_LEN))
+				return -1;
+		} else if (chance(&rng, emu->split) && len > 2) {
+			if (send_report(dev, record, len / 2)
+			    || send_report(dev, record + len / 2, len - len / 2))
+				return -1;
+		} else if (send_report(dev, record, len)) {
+			return -1;
+		}
+		sent++;
+	
+		if (emu->verbose && now() - stats >= 1) {
+			fprintf(stderr, "%llu reports, %.0f/s\n", sent,
+						sent / (now() - start));
+			stats = now();
+		}
+	
+		if (emu->rate > 0) {
+			struct timespec ts;
+	
+			next += 1 / emu->rate;
+			ts.tv_sec = next;
+			ts.tv_nsec = (next - ts.tv_sec) * 1e9;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+						== EINTR && !stop)
+				;
+		}
+	}
+	
+	t = now() - start;
+	fprintf(stderr, "sent %llu reports in %.2f s (%.0f/s)\n", sent, t,
+				t > 0 ? sent / t : 0);
+	return 0;
+}
+
+static int parse_fault(struct emu *emu, const char *arg)
+{
+	const char *value = strchr(arg, ':');
+	size_t len = value ? (size_t) (value - arg) : strlen(arg);
+	int percent = value ? atoi(value + 1) : 0;
+	
+	if (!strncmp(arg, "fanstop", len) && len == 7)
+		emu->fanstop = 1;
+	else if (!value)
+		return -1;
+	else if (!strncmp(arg, "drop", len) && len == 4)
+		emu->drop = percent;
+	else if (!strncmp(arg, "corrupt", len) && len == 7)
+		emu->corrupt = percent;
+	else if (!strncmp(arg, "split", len) && len == 5)
+		emu->split = percent;
+	else if (!strncmp(arg, "sag", len) && len == 3)
+		emu->sag = atof(value + 1);
+	else if (!strncmp(arg, "stall", len) && len == 5)
+		emu->stall = atof(value + 1);
+	else
+		return -1;
+	
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -p PID        USB product ID (default: 0x0193, V850 GOLD i MULTI)\n"
+		"  -r RATE       Reports per second, 0 for no limit (default: 14)\n"
+		"  -d SECONDS    Stop after this time (default: run until killed)\n"
+		"  -w WAVEFORM   steady, ramp, step or noise (default: steady)\n"
+		"  -l WATTS      Load, or minimum load of the waveform (default: 150)\n"
+		"  -L WATTS      Maximum load of the waveform (default: rated power)\n"
+		"  -T SECONDS    Period of ramp and step (default: 60)\n"
+		"  -f FAULT      drop:N, corrupt:N, split:N, sag:N, fanstop, stall:N\n"
+		"  -s SEED       Seed for noise and faults (default: 1)\n"
+		"  -v            Print the rate every second\n"
+		"stall:N stops sending after N seconds until the driver reopens the\n"
+		"device. uhid devices aren't USB devices, so the driver's USB reset\n"
+		"can't be tested, and nothing happens while hidraw is also open.\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	struct emu emu = {
+		.waveform = WAVE_STEADY,
+		.load = 150,
+		.period = 60,
+		.rate = RECORDS_PER_CYCLE,
+		.seed = 1,
+	};
+	struct cmpsu_uhid dev;
+	unsigned int product = 0x0193;
+	int ret;
+	int opt;
+	int i;
+	
+	while ((opt = getopt(argc, argv, "p:r:d:w:l:L:T:f:s:vh")) != -1) {
+		switch (opt) {
+			case 'p':
+				product = strtoul(optarg, NULL, 0);
+				break;
+			case 'r':
+				emu.rate = atof(optarg);
+				break;
+			case 'd':
+				emu.duration = atof(optarg);
+				break;
+			case 'w':
+				for (i = 0; i < (int) ARRAY_SIZE(waveform_names); i++) {
+					if (!strcmp(optarg, waveform_names[i]))
+						break;
+				}
+				if (i == (int) ARRAY_SIZE(waveform_names)) {
+					fprintf(stderr, "unknown waveform: %s\n", optarg);
+					return 1;
+				}
+				emu.waveform = i;
+				break;
+			case 'l':
+				emu.load = atof(optarg);
+				break;
+			case 'L':
+				emu.peak = atof(optarg);
+				break;
+			case 'T':
+				emu.period = atof(optarg);
+				break;
+			case 'f':
+				if (parse_fault(&emu, optarg)) {
+					fprintf(stderr, "unknown fault: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 's':
+				emu.seed = strtoull(optarg, NULL, 0) ? : 1;
+				break;
+			case 'v':
+				emu.verbose = 1;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	
+	emu.model = cmpsu_model_find(product);
+	if (!emu.model) {
+		fprintf(stderr, "unsupported product ID: 0x%04x\n", product);
+		return 1;
+	}
+	if (!emu.peak)
+		emu.peak = emu.model->rated;
+	
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	
+	if (cmpsu_uhid_create(&dev, product)) {
+		perror("failed to create uhid device");
+		return 1;
+	}
+	fprintf(stderr, "emulating %s (%04x:%04x)\n", emu.model->name,
+				CMPSU_VENDOR, product);
+	
+	ret = emu_run(&emu, &dev);
+	if (ret)
+		perror("failed to send report");
+	cmpsu_uhid_destroy(&dev);
+	
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,935 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cmpsu-exporter.c - Serves PSU readings in the OpenMetrics text format
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmpsu-wire.h"
+
+/*
+ * Each scrape collects the readings of all PSUs with a single CMPSU_CMD_GET
+ * dump from the driver's netlink family. If the family isn't available (old
+ * driver or cmpsu-hidraw instead of the driver), the hwmon attributes are read
+ * from sysfs instead, or from the directories given with -d.
+ *
+ * The response is built in a static buffer, nothing is allocated per scrape
+ * on the netlink path.
+ *
+ * With -u, the readings are also collected every interval and sent to
+ * cmpsu-collector in batches (see cmpsu-wire.h). Each PSU gets a slot by its
+ * device name and keeps it (the psu field on the wire) while other PSUs come
+ * and go. When a PSU disappears, its partial batch is sent and the slot is
+ * freed. A reused slot starts again at sequence number 0, which the collector
+ * takes as a restart of the series.
+ */
+
+#define MAX_PSUS 16
+/* Directories that don't exist are skipped, e.g. PSUs that aren't plugged in */
+#define MAX_DIRS 64
+#define OUT_LEN 65536
+#define NL_LEN 32768
+
+struct snapshot {
+	char device[64];
+	uint16_t product;
+	int has_cycle;
+	uint64_t cycle;
+	int has_energy;
+	uint64_t energy; /* uJ */
+	int present[CMPSU_COUNT_ALL];
+	int64_t values[CMPSU_COUNT_ALL];
+	uint64_t seq[CMPSU_COUNT_ALL];
+};
+
+static const int first_channel[] = {
+	[CMPSU_TYPE_VOLTAGE] = 0,
+	[CMPSU_TYPE_CURRENT] = CMPSU_COUNT_VOLTAGE,
+	[CMPSU_TYPE_POWER] = CMPSU_COUNT_VOLTAGE + CMPSU_COUNT_CURRENT,
+	[CMPSU_TYPE_TEMP] = CMPSU_COUNT_VOLTAGE + CMPSU_COUNT_CURRENT
+	                    + CMPSU_COUNT_POWER,
+	[CMPSU_TYPE_FAN] = CMPSU_COUNT_VOLTAGE + CMPSU_COUNT_CURRENT
+	                   + CMPSU_COUNT_POWER + CMPSU_COUNT_TEMP,
+};
+
+/* One family per channel type, in the order of enum cmpsu_channel_type */
+static const struct family {
+	const char *header;
+	const char *name;
+	double scale;
+} families[] = {
+	{
+		"# TYPE cmpsu_voltage_volts gauge\n"
+		"# UNIT cmpsu_voltage_volts volts\n"
+		"# HELP cmpsu_voltage_volts Voltage of the AC input and DC rails.\n",
+		"cmpsu_voltage_volts", 1e3,
+	},
+	{
+		"# TYPE cmpsu_current_amperes gauge\n"
+		"# UNIT cmpsu_current_amperes amperes\n"
+		"# HELP cmpsu_current_amperes Current of the AC input and DC rails.\n",
+		"cmpsu_current_amperes", 1e3,
+	},
+	{
+		"# TYPE cmpsu_power_watts gauge\n"
+		"# UNIT cmpsu_power_watts watts\n"
+		"# HELP cmpsu_power_watts Input and output power.\n",
+		"cmpsu_power_watts", 1e6,
+	},
+	{
+		"# TYPE cmpsu_temperature_celsius gauge\n"
+		"# UNIT cmpsu_temperature_celsius celsius\n"
+		"# HELP cmpsu_temperature_celsius Internal temperatures.\n",
+		"cmpsu_temperature_celsius", 1e3,
+	},
+	{
+		"# TYPE cmpsu_fan_rpm gauge\n"
+		"# UNIT cmpsu_fan_rpm rpm\n"
+		"# HELP cmpsu_fan_rpm Fan speed.\n",
+		"cmpsu_fan_rpm", 1,
+	},
+};
+
+static struct snapshot psus[MAX_PSUS];
+static int psu_count;
+static char out[OUT_LEN];
+static int out_len;
+static uint8_t nl_buf[NL_LEN] __attribute__((aligned(NLMSG_ALIGNTO)));
+static int nl_fd = -1;
+static uint16_t nl_family;
+static uint32_t nl_seq;
+static const char *dirs[MAX_DIRS];
+static int dir_count;
+static int push_fd = -1;
+static uint64_t push_host;
+static int push_batch = 5;
+
+struct push_slot {
+	char device[64]; /* Empty if the slot is free */
+	int seen;
+	uint16_t product;
+	int fill;
+	uint32_t seq;
+	struct cmpsu_wire_cycle cycles[CMPSU_WIRE_CYCLES];
+};
+
+static struct push_slot push_slots[MAX_PSUS];
+
+static void out_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void out_printf(const char *fmt, ...)
+{
+	va_list args;
+	int len;
+	
+	va_start(args, fmt);
+	len = vsnprintf(out + out_len, sizeof(out) - out_len, fmt, args);
+	va_end(args);
+	if (len > 0)
+		out_len = out_len + len < OUT_LEN ? out_len + len : OUT_LEN - 1;
+}
+
+static void out_puts(const char *str)
+{
+	size_t len = strlen(str);
+	
+	if (len >= sizeof(out) - out_len)
+		len = sizeof(out) - out_len - 1;
+	memcpy(out + out_len, str, len);
+	out_len += len;
+	out[out_len] = 0;
+}
+
+/* Sensor label, the label from hwmon if there is one, otherwise the name */
+static const char *sensor(int index)
+{
+	return cmpsu_state_label(index) ? cmpsu_state_label(index)
+				: cmpsu_state_name(index);
+}
+
+static void format_metrics(void)
+{
+	const struct cmpsu_model *model;
+	const struct snapshot *psu;
+	int type;
+	int first;
+	int last;
+	int i;
+	int n;
+	
+	out_len = 0;
+	out_puts("# TYPE cmpsu_psu info\n"
+		 "# HELP cmpsu_psu Model of the PSU.\n");
+	for (n = 0; n < psu_count; n++) {
+		psu = &psus[n];
+		model = cmpsu_model_find(psu->product);
+		out_printf("cmpsu_psu_info{psu=\"%s\",product=\"0x%04x\","
+					"model=\"%s\"} 1\n", psu->device, psu->product,
+					model ? model->name : "unknown");
+	}
+	
+	for (type = 0; type < (int) (sizeof(families) / sizeof(families[0]));
+				type++) {
+		first = first_channel[type];
+		last = type == CMPSU_TYPE_FAN ? CMPSU_COUNT_ALL
+					: first_channel[type + 1];
+		out_puts(families[type].header);
+		for (n = 0; n < psu_count; n++) {
+			psu = &psus[n];
+			for (i = first; i < last; i++) {
+				if (!psu->present[i] || psu->values[i] < 0)
+					continue;
+				out_printf("%s{psu=\"%s\",sensor=\"%s\"} %g\n",
+							families[type].name, psu->device, sensor(i),
+							psu->values[i] / families[type].scale);
+			}
+		}
+	}
+	
+	out_puts("# TYPE cmpsu_energy_joules counter\n"
+		 "# UNIT cmpsu_energy_joules joules\n"
+		 "# HELP cmpsu_energy_joules Energy drawn from the wall since the "
+		 "driver was loaded.\n");
+	for (n = 0; n < psu_count; n++) {
+		if (psus[n].has_energy)
+			out_printf("cmpsu_energy_joules_total{psu=\"%s\"} %.6f\n",
+						psus[n].device, psus[n].energy / 1e6);
+	}
+	
+	out_puts("# TYPE cmpsu_samples counter\n"
+		 "# HELP cmpsu_samples Number of values received per sensor.\n");
+	for (n = 0; n < psu_count; n++) {
+		psu = &psus[n];
+		for (i = 0; i < CMPSU_COUNT_ALL; i++) {
+			if (psu->present[i])
+				out_printf("cmpsu_samples_total{psu=\"%s\",sensor=\"%s\"} "
+							"%llu\n", psu->device, sensor(i),
+							(unsigned long long) psu->seq[i]);
+		}
+	}
+	
+	out_puts("# TYPE cmpsu_cycles counter\n"
+		 "# HELP cmpsu_cycles Number of complete update cycles.\n");
+	for (n = 0; n < psu_count; n++) {
+		if (psus[n].has_cycle)
+			out_printf("cmpsu_cycles_total{psu=\"%s\"} %llu\n",
+						psus[n].device,
+						(unsigned long long) psus[n].cycle);
+	}
+	
+	out_puts("# EOF\n");
+}
+
+static int nl_send(uint16_t type, uint16_t flags, uint8_t cmd,
+			const void *attrs, int attrs_len)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct genlmsghdr genl;
+		uint8_t attrs[64];
+	} req = {
+		.nlh = {
+			.nlmsg_type = type,
+			.nlmsg_flags = NLM_F_REQUEST | flags,
+			.nlmsg_seq = ++nl_seq,
+		},
+		.genl = {
+			.cmd = cmd,
+			.version = type == GENL_ID_CTRL ? 1 : CMPSU_GENL_VERSION,
+		},
+	};
+	
+	memcpy(req.attrs, attrs, attrs_len);
+	req.nlh.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + attrs_len);
+	if (send(nl_fd, &req, req.nlh.nlmsg_len, 0) < 0)
+		return -1;
+	
+	return 0;
+}
+
+/* Calls fn for every attribute in a stream of attributes */
+static void nl_attrs(const uint8_t *data, int len,
+			void (*fn)(void *ctx, const struct nlattr *attr), void *ctx)
+{
+	const struct nlattr *attr;
+	
+	while (len >= NLA_HDRLEN) {
+		attr = (const struct nlattr *) data;
+		if (attr->nla_len < NLA_HDRLEN || attr->nla_len > len)
+			break;
+		fn(ctx, attr);
+		data += NLA_ALIGN(attr->nla_len);
+		len -= NLA_ALIGN(attr->nla_len);
+	}
+}
+
+#define NLA_DATA(attr) ((const uint8_t *) (attr) + NLA_HDRLEN)
+#define NLA_PAYLOAD(attr) ((attr)->nla_len - NLA_HDRLEN)
+
+static uint64_t nla_u64(const struct nlattr *attr)
+{
+	uint64_t value = 0;
+	
+	if (NLA_PAYLOAD(attr) == sizeof(value))
+		memcpy(&value, NLA_DATA(attr), sizeof(value));
+	return value;
+}
+
+static uint32_t nla_u32(const struct nlattr *attr)
+{
+	uint32_t value = 0;
+	
+	if (NLA_PAYLOAD(attr) == sizeof(value))
+		memcpy(&value, NLA_DATA(attr), sizeof(value));
+	return value;
+}
+
+struct channel {
+	int type;
+	int index;
+	int64_t value;
+	uint64_t seq;
+};
+
+static void nl_channel_attr(void *ctx, const struct nlattr *attr)
+{
+	struct channel *channel = ctx;
+	
+	switch (attr->nla_type) {
+		case CMPSU_CHANNEL_ATTR_TYPE:
+			channel->type = *NLA_DATA(attr);
+			break;
+		case CMPSU_CHANNEL_ATTR_INDEX:
+			channel->index = *NLA_DATA(attr);
+			break;
+		case CMPSU_CHANNEL_ATTR_VALUE:
+			channel->value = nla_u64(attr);
+			break;
+		case CMPSU_CHANNEL_ATTR_SEQ:
+			channel->seq = nla_u64(attr);
+			break;
+	}
+}
+
+static void nl_psu_attr(void *ctx, const struct nlattr *attr)
+{
+	struct snapshot *psu = ctx;
+	struct channel channel = { .type = -1 };
+	int len = NLA_PAYLOAD(attr);
+	int last;
+	int i;
+	
+	switch (attr->nla_type & NLA_TYPE_MASK) {
+		case CMPSU_ATTR_DEVICE:
+			if (len > (int) sizeof(psu->device))
+				len = sizeof(psu->device);
+			memcpy(psu->device, NLA_DATA(attr), len);
+			psu->device[len - 1] = 0;
+			break;
+		case CMPSU_ATTR_PRODUCT:
+			psu->product = nla_u32(attr);
+			break;
+		case CMPSU_ATTR_CYCLE:
+			psu->cycle = nla_u64(attr);
+			psu->has_cycle = 1;
+			break;
+		case CMPSU_ATTR_ENERGY:
+			psu->energy = nla_u64(attr);
+			psu->has_energy = 1;
+			break;
+		case CMPSU_ATTR_CHANNEL:
+			nl_attrs(NLA_DATA(attr), len, nl_channel_attr, &channel);
+			if (channel.type < 0 || channel.type > CMPSU_TYPE_FAN)
+				break;
+			i = first_channel[channel.type] + channel.index;
+			last = channel.type == CMPSU_TYPE_FAN ? CMPSU_COUNT_ALL
+						: first_channel[channel.type + 1];
+			if (i >= last)
+				break;
+			psu->present[i] = 1;
+			psu->values[i] = channel.value;
+			psu->seq[i] = channel.seq;
+			break;
+	}
+}
+
+static void nl_family_attr(void *ctx, const struct nlattr *attr)
+{
+	if (attr->nla_type == CTRL_ATTR_FAMILY_ID)
+		nl_family = *(const uint16_t *) NLA_DATA(attr);
+}
+
+/*
+ * Receives the replies to the last request, calling fn with the attributes
+ * of each message. Returns 0 once the request is done, -1 on errors.
+ */
+static int nl_recv(void (*fn)(void *ctx, const struct nlattr *attr),
+			int dump)
+{
+	const struct nlmsghdr *nlh;
+	struct snapshot *psu;
+	ssize_t len;
+	
+	for (;;) {
+		len = recv(nl_fd, nl_buf, sizeof(nl_buf), 0);
+		if (len < 0)
+			return -1;
+	
+		for (nlh = (const struct nlmsghdr *) nl_buf; NLMSG_OK(nlh, len);
+					nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_seq != nl_seq)
+				continue;
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				return 0;
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				const struct nlmsgerr *err = NLMSG_DATA(nlh);
+	
+				if (!err->error)
+					return 0;
+				errno = -err->error;
+				return -1;
+			}
+	
+			if (dump) {
+				if (psu_count == MAX_PSUS)
+					continue;
+				psu = &psus[psu_count++];
+				memset(psu, 0, sizeof(*psu));
+			} else {
+				psu = NULL;
+			}
+			nl_attrs((const uint8_t *) NLMSG_DATA(nlh) + GENL_HDRLEN,
+						nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN),
+						fn, psu);
+			if (!dump)
+				return 0;
+		}
+	}
+}
+
+static int nl_init(void)
+{
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+	struct timeval timeout = { .tv_sec = 2 };
+	struct {
+		struct nlattr attr;
+		char name[sizeof(CMPSU_GENL_NAME)];
+	} __attribute__((packed)) name = {
+		.attr = {
+			.nla_len = NLA_HDRLEN + sizeof(CMPSU_GENL_NAME),
+			.nla_type = CTRL_ATTR_FAMILY_NAME,
+		},
+		.name = CMPSU_GENL_NAME,
+	};
+	
+	if (nl_fd < 0) {
+		nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+		if (nl_fd < 0)
+			return -1;
+		setsockopt(nl_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		if (bind(nl_fd, (struct sockaddr *) &addr, sizeof(addr))) {
+			close(nl_fd);
+			nl_fd = -1;
+			return -1;
+		}
+	}
+	
+	nl_family = 0;
+	if (nl_send(GENL_ID_CTRL, 0, CTRL_CMD_GETFAMILY, &name,
+				NLA_ALIGN(sizeof(name)))
+	    || nl_recv(nl_family_attr, 0) || !nl_family)
+		return -1;
+	
+	return 0;
+}
+
+static int collect_netlink(void)
+{
+	/* The family is looked up again if the driver was reloaded */
+	if (!nl_family && nl_init())
+		return -1;
+	
+	psu_count = 0;
+	if (nl_send(nl_family, NLM_F_DUMP, CMPSU_CMD_GET, NULL, 0)
+	    || nl_recv(nl_psu_attr, 1)) {
+		nl_family = 0;
+		return -1;
+	}
+	
+	return 0;
+}
+
+static int read_value(int dirfd, const char *file, long long *value)
+{
+	char buf[32];
+	ssize_t len;
+	int fd;
+	
+	fd = openat(dirfd, file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = 0;
+	/* cmpsu-hidraw writes the product ID in hex */
+	*value = strtoll(buf, NULL, 0);
+	
+	return 0;
+}
+
+static void collect_dir(const char *path, const char *device)
+{
+	struct snapshot *psu;
+	long long value;
+	char file[32];
+	int dirfd;
+	int i;
+	
+	if (psu_count == MAX_PSUS)
+		return;
+	dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0)
+		return;
+	
+	psu = &psus[psu_count++];
+	memset(psu, 0, sizeof(*psu));
+	snprintf(psu->device, sizeof(psu->device), "%s", device);
+	if (!read_value(dirfd, "product", &value))
+		psu->product = value;
+	for (i = 0; i < CMPSU_COUNT_ALL; i++) {
+		snprintf(file, sizeof(file), "%s_input", cmpsu_state_name(i));
+		if (read_value(dirfd, file, &value))
+			continue;
+		psu->present[i] = 1;
+		psu->values[i] = value;
+		snprintf(file, sizeof(file), "%s_seq", cmpsu_state_name(i));
+		if (!read_value(dirfd, file, &value))
+			psu->seq[i] = value;
+	}
+	if (!read_value(dirfd, "energy1_input", &value)) {
+		psu->energy = value;
+		psu->has_energy = 1;
+	}
+	
+	close(dirfd);
+}
+
+static void collect_sysfs(void)
+{
+	struct dirent *entry;
+	char path[300];
+	char link[300];
+	char name[32];
+	const char *device;
+	ssize_t len;
+	FILE *file;
+	DIR *dir;
+	int i;
+	
+	psu_count = 0;
+	for (i = 0; i < dir_count; i++) {
+		device = strrchr(dirs[i], '/') ? strrchr(dirs[i], '/') + 1 : dirs[i];
+		collect_dir(dirs[i], device);
+	}
+	if (dir_count)
+		return;
+	
+	dir = opendir("/sys/class/hwmon");
+	if (!dir)
+		return;
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/hwmon/%s/name",
+					entry->d_name);
+		file = fopen(path, "r");
+		if (!file)
+			continue;
+		if (!fgets(name, sizeof(name), file) || strcmp(name, "cmpsu\n")) {
+			fclose(file);
+			continue;
+		}
+		fclose(file);
+	
+		/* Same device name as in the netlink messages */
+		snprintf(path, sizeof(path), "/sys/class/hwmon/%s/device",
+					entry->d_name);
+		len = readlink(path, link, sizeof(link) - 1);
+		if (len > 0) {
+			link[len] = 0;
+			device = strrchr(link, '/') ? strrchr(link, '/') + 1 : link;
+		} else {
+			device = entry->d_name;
+		}
+		snprintf(path, sizeof(path), "/sys/class/hwmon/%s", entry->d_name);
+		collect_dir(path, device);
+	}
+	closedir(dir);
+}
+
+static void collect(void)
+{
+	if (dir_count || collect_netlink())
+		collect_sysfs();
+}
+
+static uint64_t now_ns(clockid_t clock)
+{
+	struct timespec ts;
+	
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct push_slot *push_find(const char *device)
+{
+	int n;
+	
+	for (n = 0; n < MAX_PSUS; n++) {
+		if (push_slots[n].device[0] && !strcmp(push_slots[n].device, device))
+			return &push_slots[n];
+	}
+	
+	return NULL;
+}
+
+static struct push_slot *push_slot(const struct snapshot *psu)
+{
+	struct push_slot *slot;
+	int n;
+	
+	slot = push_find(psu->device);
+	if (slot)
+		return slot;
+	for (n = 0; n < MAX_PSUS; n++) {
+		slot = &push_slots[n];
+		if (slot->device[0])
+			continue;
+		memcpy(slot->device, psu->device, sizeof(slot->device));
+		slot->fill = 0;
+		slot->seq = 0;
+		return slot;
+	}
+	
+	return NULL;
+}
+
+/* Sends up to a full batch and keeps the cycles that didn't fit */
+static void push_send(struct push_slot *slot)
+{
+	static uint8_t buf[CMPSU_WIRE_MAX];
+	struct cmpsu_wire_header hdr = {
+		.host = push_host,
+		.psu = slot - push_slots,
+		.product = slot->product,
+		.seq = slot->seq,
+	};
+	int len;
+	
+	len = cmpsu_wire_encode(buf, sizeof(buf), &hdr, slot->cycles, slot->fill);
+	memmove(slot->cycles, slot->cycles + hdr.count,
+				(slot->fill - hdr.count) * sizeof(slot->cycles[0]));
+	slot->fill -= hdr.count;
+	slot->seq += hdr.count;
+	/* Lost packets show up as gaps in the sequence numbers */
+	send(push_fd, buf, len, 0);
+}
+
+/* Adds a cycle of every PSU to its batch and sends the full batches */
+static void push(void)
+{
+	struct cmpsu_wire_cycle *cycle;
+	struct push_slot *slot;
+	uint64_t timestamp = now_ns(CLOCK_REALTIME);
+	int n;
+	int i;
+	
+	collect();
+	
+	/*
+	 * Flush the cycles of PSUs that are gone and free their slots first, so
+	 * PSUs that appeared at the same time find a free slot
+	 */
+	for (n = 0; n < MAX_PSUS; n++)
+		push_slots[n].seen = 0;
+	for (n = 0; n < psu_count; n++) {
+		slot = push_find(psus[n].device);
+		if (slot)
+			slot->seen = 1;
+	}
+	for (n = 0; n < MAX_PSUS; n++) {
+		slot = &push_slots[n];
+		if (!slot->device[0] || slot->seen)
+			continue;
+		while (slot->fill)
+			push_send(slot);
+		slot->device[0] = 0;
+	}
+	
+	for (n = 0; n < psu_count; n++) {
+		slot = push_slot(&psus[n]);
+		if (!slot) {
+			/* Not expected, PSUs that are gone released their slot */
+			fprintf(stderr, "%s: no free slot, not sending it\n",
+						psus[n].device);
+			continue;
+		}
+		slot->product = psus[n].product;
+		cycle = &slot->cycles[slot->fill++];
+		cycle->timestamp = timestamp;
+		cycle->present = 0;
+		for (i = 0; i < CMPSU_COUNT_ALL; i++) {
+			cycle->values[i] = psus[n].present[i] ? psus[n].values[i] : -1;
+			if (cycle->values[i] >= 0)
+				cycle->present |= 1U << i;
+		}
+		cycle->energy = psus[n].energy;
+		if (slot->fill >= push_batch)
+			push_send(slot);
+	}
+}
+
+/* Parses HOST, HOST:PORT or [HOST]:PORT and connects to it */
+static int push_open(const char *arg)
+{
+	struct addrinfo hints = { .ai_socktype = SOCK_DGRAM };
+	struct addrinfo *res;
+	char address[256];
+	char port[16];
+	char *colon;
+	int fd;
+	
+	snprintf(address, sizeof(address), "%s", arg);
+	snprintf(port, sizeof(port), "%d", CMPSU_WIRE_PORT);
+	colon = strrchr(address, ':');
+	if (address[0] == '[') {
+		memmove(address, address + 1, strlen(address));
+		colon = strchr(address, ']');
+		if (!colon)
+			return -1;
+		*colon++ = 0;
+		if (*colon == ':')
+			snprintf(port, sizeof(port), "%s", colon + 1);
+	} else if (colon && colon == strchr(address, ':')) {
+		*colon = 0;
+		snprintf(port, sizeof(port), "%s", colon + 1);
+	}
+	
+	if (getaddrinfo(address, port, &hints, &res))
+		return -1;
+	fd = socket(res->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen)) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	
+	return fd;
+}
+
+/* FNV-1a of the hostname, so the ID stays the same across restarts */
+static uint64_t default_host(void)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	char name[256] = "";
+	const char *p;
+	
+	gethostname(name, sizeof(name) - 1);
+	for (p = name; *p; p++)
+		hash = (hash ^ (uint8_t) *p) * 0x100000001b3ULL;
+	
+	return hash ? hash : 1;
+}
+
+static void serve(int fd)
+{
+	static const char not_found[] =
+		"HTTP/1.1 404 Not Found\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n\r\n";
+	struct timeval timeout = { .tv_sec = 2 };
+	char header[256];
+	char req[2048];
+	struct iovec iov[2];
+	size_t len = 0;
+	ssize_t ret;
+	
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	
+	/* Only the request line matters, the rest of the request is ignored */
+	while (len < sizeof(req) - 1) {
+		ret = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+		if (ret <= 0)
+			return;
+		len += ret;
+		req[len] = 0;
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+	
+	if (strncmp(req, "GET /metrics ", 13) && strncmp(req, "GET / ", 6)) {
+		send(fd, not_found, sizeof(not_found) - 1, MSG_NOSIGNAL);
+		return;
+	}
+	
+	collect();
+	format_metrics();
+	
+	iov[0].iov_base = header;
+	iov[0].iov_len = snprintf(header, sizeof(header),
+				"HTTP/1.1 200 OK\r\n"
+				"Content-Type: application/openmetrics-text; "
+				"version=1.0.0; charset=utf-8\r\n"
+				"Content-Length: %d\r\n"
+				"Connection: close\r\n\r\n", out_len);
+	iov[1].iov_base = out;
+	iov[1].iov_len = out_len;
+	writev(fd, iov, 2);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -p PORT       Port to listen on (default: 9563)\n"
+		"  -l            Only listen on localhost\n"
+		"  -d DIR        Read this hwmon-style directory instead of using\n"
+		"                netlink, e.g. from cmpsu-hidraw (can be repeated,\n"
+		"                directories that don't exist are skipped)\n"
+		"  -u HOST[:PORT] Also send the readings to cmpsu-collector\n"
+		"  -H ID         Host ID sent to the collector (default: hash of the\n"
+		"                hostname)\n"
+		"  -i MS         Interval between cycles sent (default: 1000)\n"
+		"  -b CYCLES     Cycles per packet (default: 5)\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in6 addr = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = IN6ADDR_ANY_INIT,
+	};
+	struct pollfd pfd = { .events = POLLIN };
+	const char *collector = NULL;
+	uint64_t interval = 1000000000;
+	uint64_t next = 0;
+	uint64_t now;
+	int timeout;
+	int port = 9563;
+	int one = 1;
+	int sock;
+	int opt;
+	int fd;
+	
+	push_host = default_host();
+	while ((opt = getopt(argc, argv, "p:ld:u:H:i:b:h")) != -1) {
+		switch (opt) {
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'l':
+				addr.sin6_addr = in6addr_loopback;
+				break;
+			case 'd':
+				if (dir_count < MAX_DIRS)
+					dirs[dir_count++] = optarg;
+				break;
+			case 'u':
+				collector = optarg;
+				break;
+			case 'H':
+				push_host = strtoull(optarg, NULL, 0);
+				break;
+			case 'i':
+				interval = strtoull(optarg, NULL, 0) * 1000000;
+				break;
+			case 'b':
+				push_batch = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	
+	if (!push_host || !interval || push_batch < 1
+	    || push_batch > CMPSU_WIRE_CYCLES) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (collector) {
+		push_fd = push_open(collector);
+		if (push_fd < 0) {
+			fprintf(stderr, "%s: invalid collector address\n", collector);
+			return 1;
+		}
+	}
+	
+	signal(SIGPIPE, SIG_IGN);
+	addr.sin6_port = htons(port);
+	sock = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("socket");
+		return 1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr))
+	    || listen(sock, 16)) {
+		perror("failed to listen");
+		return 1;
+	}
+	if (!dir_count && nl_init())
+		fprintf(stderr, "netlink family %s not found, using sysfs\n",
+					CMPSU_GENL_NAME);
+	
+	pfd.fd = sock;
+	for (;;) {
+		timeout = -1;
+		if (push_fd >= 0) {
+			now = now_ns(CLOCK_MONOTONIC);
+			if (now >= next) {
+				push();
+				/* Skip cycles that were missed instead of catching up */
+				next = next ? next + interval : now + interval;
+				if (next <= now)
+					next = now + interval;
+			}
+			timeout = (next - now + 999999) / 1000000;
+		}
+		if (poll(&pfd, 1, timeout) <= 0)
+			continue;
+		
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			return 1;
+		}
+		serve(fd);
+		close(fd);
+	}
+}
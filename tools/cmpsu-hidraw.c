@@ -0,0 +1,378 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cmpsu-hidraw.c - Reads PSUs through hidraw, for hosts without the driver
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libcmpsu.h"
+
+/*
+ * Each PSU gets a directory <output>/<hidrawN> with the same files as the
+ * driver's hwmon directory: name, {sensor}_input, {sensor}_label,
+ * {sensor}_seq and energy1_input. Values are decoded as soon as a report
+ * arrives and the files are rewritten every interval, each one replaced
+ * atomically so readers never see a partial value.
+ *
+ * All state is allocated up front, reading and decoding a report doesn't
+ * allocate memory.
+ */
+
+#define MAX_PSUS 8
+#define RESCAN_INTERVAL 5000 /* ms */
+
+struct psu {
+	int fd; /* -1 if unused */
+	int dirfd;
+	char name[16];
+	uint16_t product;
+	struct cmpsu_state state;
+};
+
+static struct psu psus[MAX_PSUS];
+static const char *output = "/run/cmpsu";
+static int epfd;
+
+static const char *base_name(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	
+	return slash ? slash + 1 : path;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Replaces a file in the PSU's directory with new contents */
+static void psu_write(struct psu *psu, const char *file, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void psu_write(struct psu *psu, const char *file, const char *fmt, ...)
+{
+	char tmp[64];
+	char buf[64];
+	va_list args;
+	int len;
+	int fd;
+	
+	va_start(args, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	
+	snprintf(tmp, sizeof(tmp), ".%s.tmp", file);
+	fd = openat(psu->dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+				0644);
+	if (fd < 0)
+		return;
+	if (write(fd, buf, len) != len) {
+		close(fd);
+		unlinkat(psu->dirfd, tmp, 0);
+		return;
+	}
+	close(fd);
+	renameat(psu->dirfd, tmp, psu->dirfd, file);
+}
+
+static void psu_publish(struct psu *psu)
+{
+	const struct cmpsu_state *state = &psu->state;
+	char file[32];
+	int i;
+	
+	for (i = 0; i < CMPSU_COUNT_ALL; i++) {
+		/* Like the driver, values that weren't received yet are missing */
+		if (state->values[i] < 0)
+			continue;
+		snprintf(file, sizeof(file), "%s_input", cmpsu_state_name(i));
+		psu_write(psu, file, "%lld\n", (long long) state->values[i]);
+		snprintf(file, sizeof(file), "%s_seq", cmpsu_state_name(i));
+		psu_write(psu, file, "%llu\n", (unsigned long long) state->seq[i]);
+	}
+	psu_write(psu, "energy1_input", "%llu\n",
+				(unsigned long long) state->energy);
+}
+
+static void psu_remove(struct psu *psu)
+{
+	struct dirent *entry;
+	char path[256];
+	DIR *dir;
+	
+	fprintf(stderr, "%s: removed\n", psu->name);
+	close(psu->fd);
+	psu->fd = -1;
+	
+	/* Stale values would look like a working PSU */
+	dir = fdopendir(psu->dirfd);
+	if (dir) {
+		while ((entry = readdir(dir))) {
+			if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+				unlinkat(psu->dirfd, entry->d_name, 0);
+		}
+		closedir(dir);
+	} else {
+		close(psu->dirfd);
+	}
+	snprintf(path, sizeof(path), "%s/%s", output, psu->name);
+	rmdir(path);
+	psu->dirfd = -1;
+}
+
+static int psu_add(const char *path, int fd, uint16_t product)
+{
+	const char *name = base_name(path);
+	struct epoll_event ev = { .events = EPOLLIN };
+	char dir[256];
+	struct psu *psu = NULL;
+	int i;
+	
+	for (i = 0; i < MAX_PSUS; i++) {
+		if (psus[i].fd < 0) {
+			psu = &psus[i];
+			break;
+		}
+	}
+	if (!psu) {
+		fprintf(stderr, "%s: too many PSUs\n", path);
+		return -1;
+	}
+	
+	snprintf(dir, sizeof(dir), "%s/%s", output, name);
+	mkdir(output, 0755);
+	mkdir(dir, 0755);
+	psu->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (psu->dirfd < 0) {
+		perror(dir);
+		return -1;
+	}
+	
+	psu->fd = fd;
+	psu->product = product;
+	snprintf(psu->name, sizeof(psu->name), "%s", name);
+	cmpsu_state_init(&psu->state);
+	
+	ev.data.ptr = psu;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		perror("epoll_ctl");
+		close(psu->dirfd);
+		psu->fd = -1;
+		return -1;
+	}
+	
+	psu_write(psu, "name", "cmpsu\n");
+	psu_write(psu, "product", "0x%04x\n", product);
+	for (i = 0; i < CMPSU_COUNT_ALL; i++) {
+		char file[32];
+	
+		if (!cmpsu_state_label(i))
+			continue;
+		snprintf(file, sizeof(file), "%s_label", cmpsu_state_name(i));
+		psu_write(psu, file, "%s\n", cmpsu_state_label(i));
+	}
+	psu_write(psu, "energy1_label", "E_in\n");
+	
+	fprintf(stderr, "%s: %s\n", name, cmpsu_model_find(product)->name);
+	return 0;
+}
+
+static int psu_open(const char *path)
+{
+	uint16_t product;
+	int fd;
+	int i;
+	
+	for (i = 0; i < MAX_PSUS; i++) {
+		if (psus[i].fd >= 0 && !strcmp(psus[i].name, base_name(path)))
+			return 0;
+	}
+	
+	fd = cmpsu_hidraw_open(path, O_RDONLY | O_NONBLOCK, &product);
+	if (fd < 0)
+		return -1;
+	if (psu_add(path, fd, product)) {
+		close(fd);
+		return -1;
+	}
+	
+	return 0;
+}
+
+/* Opens all supported PSUs that aren't open yet */
+static void psu_scan(void)
+{
+	struct dirent *entry;
+	char path[300];
+	DIR *dir;
+	
+	dir = opendir("/dev");
+	if (!dir)
+		return;
+	while ((entry = readdir(dir))) {
+		if (strncmp(entry->d_name, "hidraw", 6))
+			continue;
+		snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+		psu_open(path);
+	}
+	closedir(dir);
+}
+
+static void psu_read(struct psu *psu, uint32_t events)
+{
+	uint8_t report[64];
+	ssize_t len;
+	
+	/* Removed earlier in the same batch of events */
+	if (psu->fd < 0)
+		return;
+	
+	/* Only one report per wakeup, hidraw returns one per read() */
+	len = read(psu->fd, report, sizeof(report));
+	if (len > 0) {
+		cmpsu_state_feed(&psu->state, report, len, now_ns());
+		return;
+	}
+	if ((len < 0 && errno != EAGAIN && errno != EINTR)
+	    || (events & (EPOLLHUP | EPOLLERR)))
+		psu_remove(psu);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] [DEVICE...]\n"
+		"Publishes the readings of PSUs read from hidraw as files\n"
+		"  -o DIR        Output directory (default: /run/cmpsu)\n"
+		"  -i MS         Update interval (default: 1000)\n"
+		"Without devices, all supported PSUs are used, including ones that\n"
+		"are connected later.\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	struct epoll_event events[MAX_PSUS + 2];
+	struct itimerspec interval = { 0 };
+	struct signalfd_siginfo info;
+	unsigned long ms = 1000;
+	unsigned long elapsed = 0;
+	uint64_t ticks;
+	sigset_t mask;
+	int timerfd;
+	int sigfd;
+	int fixed;
+	int stop = 0;
+	int opt;
+	int n;
+	int i;
+	int j;
+	
+	while ((opt = getopt(argc, argv, "o:i:h")) != -1) {
+		switch (opt) {
+			case 'o':
+				output = optarg;
+				break;
+			case 'i':
+				ms = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (!ms) {
+		usage(argv[0]);
+		return 1;
+	}
+	
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		return 1;
+	}
+	for (i = 0; i < MAX_PSUS; i++)
+		psus[i].fd = -1;
+	
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	interval.it_interval.tv_sec = ms / 1000;
+	interval.it_interval.tv_nsec = (ms % 1000) * 1000000;
+	interval.it_value = interval.it_interval;
+	if (sigfd < 0 || timerfd < 0 || timerfd_settime(timerfd, 0, &interval, NULL)
+	    || epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd,
+				&(struct epoll_event) { .events = EPOLLIN,
+							.data.ptr = &sigfd })
+	    || epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd,
+				&(struct epoll_event) { .events = EPOLLIN,
+							.data.ptr = &timerfd })) {
+		perror("failed to set up event loop");
+		return 1;
+	}
+	
+	fixed = optind < argc;
+	for (i = optind; i < argc; i++) {
+		if (psu_open(argv[i]))
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+	}
+	if (!fixed)
+		psu_scan();
+	
+	while (!stop) {
+		n = epoll_wait(epfd, events, MAX_PSUS + 2, -1);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			break;
+		}
+	
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &sigfd) {
+				if (read(sigfd, &info, sizeof(info)) == sizeof(info))
+					stop = 1;
+			} else if (events[i].data.ptr == &timerfd) {
+				if (read(timerfd, &ticks, sizeof(ticks)) != sizeof(ticks))
+					continue;
+				for (j = 0; j < MAX_PSUS; j++) {
+					if (psus[j].fd >= 0)
+						psu_publish(&psus[j]);
+				}
+				elapsed += ms * ticks;
+				if (!fixed && elapsed >= RESCAN_INTERVAL) {
+					psu_scan();
+					elapsed = 0;
+				}
+			} else {
+				psu_read(events[i].data.ptr, events[i].events);
+			}
+		}
+	}
+	
+	for (i = 0; i < MAX_PSUS; i++) {
+		if (psus[i].fd >= 0)
+			psu_remove(&psus[i]);
+	}
+	
+	return 0;
+}
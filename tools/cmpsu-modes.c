@@ -0,0 +1,316 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cmpsu-modes.c - Compares direct and deferred decoding in userspace
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#define _GNU_SOURCE /* SCHED_IDLE */
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libcmpsu.h"
+
+/*
+ * A model of the two modes of the driver's raw_event, for choosing between
+ * them without a PSU. The producer thread plays the USB completion path and
+ * times each report like the driver's raw_event histogram:
+ * - direct: takes the lock and decodes the report (cmpsu_state_feed() uses
+ *   the same decoder as the driver)
+ * - deferred: copies the report into a single-producer/single-consumer ring
+ *   of the same size as the driver's and wakes the consumer thread, which
+ *   plays decode_work. The wakeup is skipped while the consumer is already
+ *   pending, like queue_work() on a pending work item. The wakeup is a
+ *   futex system call, so it costs more than waking a kworker does.
+ *
+ * The consumer runs with SCHED_IDLE, so like a kworker woken from the USB
+ * completion path it doesn't preempt the producer, also on a single CPU.
+ * The producer sleeps between reports for the same reason.
+ *
+ * The reports are a cycle of a V850 GOLD i MULTI like cmpsu-emu sends. The
+ * kernel numbers of a real PSU are in the driver's debugfs timing file.
+ */
+
+/* Same as in the driver */
+#define RING_LEN 64
+
+#define HIST_SUB 8
+#define HIST_LEN (64 * HIST_SUB)
+
+struct hist {
+	unsigned long long count;
+	unsigned long long sum;
+	uint64_t max;
+	unsigned long long buckets[HIST_LEN];
+};
+
+static const char * const reports[] = {
+	"[V1230.0]", "[V2005.0]", "[V3003.3]", "[V4012.1]", "[V5012.0]",
+	"[I1001.2]", "[I2003.1]", "[I3002.0]", "[I4010.4]", "[I5010.2]",
+	"[P20250/0230]", "[T1038.5]", "[T2042.5]", "[R10650]",
+};
+#define REPORT_COUNT ((int) (sizeof(reports) / sizeof(reports[0])))
+
+static uint8_t frames[REPORT_COUNT][CMPSU_EVENT_LEN];
+static struct cmpsu_state state;
+static pthread_spinlock_t lock;
+
+static uint8_t ring[RING_LEN][CMPSU_EVENT_LEN];
+static _Atomic unsigned int ring_head;
+static _Atomic unsigned int ring_tail;
+static _Atomic int pending;
+static _Atomic int running;
+static unsigned long long dropped;
+static unsigned long long wakeups;
+static struct hist decode_hist;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Log-linear bucket: power of two plus 3 bits below the top bit */
+static int hist_bucket(uint64_t ns)
+{
+	int log;
+	
+	if (ns < HIST_SUB)
+		return ns;
+	log = 63 - __builtin_clzll(ns);
+	return (log - 2) * HIST_SUB + ((ns >> (log - 3)) & (HIST_SUB - 1));
+}
+
+/* Lower bound of a bucket */
+static uint64_t hist_value(int bucket)
+{
+	int log = bucket / HIST_SUB + 2;
+	
+	if (bucket < HIST_SUB)
+		return bucket;
+	return (1ULL << log) + ((uint64_t) (bucket % HIST_SUB) << (log - 3));
+}
+
+static void hist_add(struct hist *hist, uint64_t ns)
+{
+	hist->buckets[hist_bucket(ns)]++;
+	hist->count++;
+	hist->sum += ns;
+	if (ns > hist->max)
+		hist->max = ns;
+}
+
+static uint64_t percentile(const struct hist *hist, double p)
+{
+	unsigned long long target = hist->count * p;
+	unsigned long long sum = 0;
+	int i;
+	
+	for (i = 0; i < HIST_LEN; i++) {
+		sum += hist->buckets[i];
+		if (sum > target)
+			return hist_value(i);
+	}
+	
+	return hist_value(HIST_LEN - 1);
+}
+
+static void hist_print(const char *name, const struct hist *hist)
+{
+	if (!hist->count)
+		return;
+	printf("%-10s %10llu %9.1f %9llu %9llu %9llu %9llu\n", name,
+				hist->count, (double) hist->sum / hist->count,
+				(unsigned long long) percentile(hist, 0.5),
+				(unsigned long long) percentile(hist, 0.99),
+				(unsigned long long) percentile(hist, 0.999),
+				(unsigned long long) hist->max);
+}
+
+static void futex(_Atomic int *addr, int op, int value)
+{
+	syscall(SYS_futex, addr, op, value, NULL, NULL, 0);
+}
+
+static void decode(const uint8_t *data)
+{
+	pthread_spin_lock(&lock);
+	cmpsu_state_feed(&state, data, CMPSU_EVENT_LEN, now_ns());
+	pthread_spin_unlock(&lock);
+}
+
+/* decode_work: drains the ring, then sleeps until it's queued again */
+static void *consumer_run(void *arg)
+{
+	unsigned int head;
+	unsigned int tail = 0;
+	uint64_t start;
+	
+	while (atomic_load(&running) || tail != atomic_load(&ring_head)) {
+		/* The pending bit is cleared before the work item runs */
+		atomic_store(&pending, 0);
+		head = atomic_load_explicit(&ring_head, memory_order_acquire);
+		while (tail != head) {
+			start = now_ns();
+			decode(ring[tail & (RING_LEN - 1)]);
+			hist_add(&decode_hist, now_ns() - start);
+			atomic_store_explicit(&ring_tail, ++tail, memory_order_release);
+			if (tail == head)
+				head = atomic_load_explicit(&ring_head,
+							memory_order_acquire);
+		}
+		/* run() clears running before it sets pending for the last time */
+		if (atomic_load(&running))
+			futex(&pending, FUTEX_WAIT_PRIVATE, 0);
+	}
+	
+	return NULL;
+}
+
+/* raw_event with defer_decode=1 */
+static void defer(const uint8_t *data)
+{
+	unsigned int head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	
+	if (head - atomic_load_explicit(&ring_tail, memory_order_acquire)
+	    >= RING_LEN) {
+		dropped++;
+		return;
+	}
+	memcpy(ring[head & (RING_LEN - 1)], data, CMPSU_EVENT_LEN);
+	atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+	if (!atomic_exchange(&pending, 1)) {
+		wakeups++;
+		futex(&pending, FUTEX_WAKE_PRIVATE, 1);
+	}
+}
+
+static void run(int deferred, unsigned long long count, unsigned int rate)
+{
+	struct sched_param param = { .sched_priority = 0 };
+	struct timespec next = { 0 };
+	struct hist *hist;
+	pthread_attr_t attr;
+	pthread_t consumer;
+	long interval = rate ? 1000000000L / rate : 0;
+	uint64_t start;
+	unsigned long long i;
+	
+	hist = calloc(1, sizeof(*hist));
+	if (!hist) {
+		perror("calloc");
+		exit(1);
+	}
+	memset(&decode_hist, 0, sizeof(decode_hist));
+	dropped = 0;
+	wakeups = 0;
+	cmpsu_state_init(&state);
+	atomic_store(&ring_head, 0);
+	atomic_store(&ring_tail, 0);
+	atomic_store(&pending, 0);
+	atomic_store(&running, 1);
+	if (deferred) {
+		pthread_attr_init(&attr);
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_IDLE);
+		pthread_attr_setschedparam(&attr, &param);
+		if (pthread_create(&consumer, &attr, consumer_run, NULL)) {
+			fprintf(stderr, "failed to start the consumer thread\n");
+			exit(1);
+		}
+		pthread_attr_destroy(&attr);
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (i = 0; i < count; i++) {
+		if (interval) {
+			next.tv_nsec += interval;
+			if (next.tv_nsec >= 1000000000L) {
+				next.tv_sec++;
+				next.tv_nsec -= 1000000000L;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+		start = now_ns();
+		if (deferred)
+			defer(frames[i % REPORT_COUNT]);
+		else
+			decode(frames[i % REPORT_COUNT]);
+		hist_add(hist, now_ns() - start);
+	}
+	
+	if (deferred) {
+		atomic_store(&running, 0);
+		atomic_store(&pending, 1);
+		futex(&pending, FUTEX_WAKE_PRIVATE, 1);
+		pthread_join(consumer, NULL);
+	}
+	
+	hist_print(deferred ? "deferred" : "direct", hist);
+	if (deferred) {
+		hist_print("  decode", &decode_hist);
+		printf("  %llu wakeups, %.1f reports per batch, %llu dropped\n",
+					wakeups, wakeups ? (double) decode_hist.count
+					/ wakeups : 0, dropped);
+	}
+	free(hist);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -n COUNT      Reports per mode (default: 1000000)\n"
+		"  -r RATE       Reports per second, 0 for no limit (default: 10000)\n"
+		"Times each report of the producer thread in both modes, and the\n"
+		"decoding in the consumer thread for the deferred mode.\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long count = 1000000;
+	unsigned int rate = 10000;
+	int opt;
+	int i;
+	
+	while ((opt = getopt(argc, argv, "n:r:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				count = strtoull(optarg, NULL, 0);
+				break;
+			case 'r':
+				rate = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (!count) {
+		usage(argv[0]);
+		return 1;
+	}
+	
+	for (i = 0; i < REPORT_COUNT; i++)
+		memcpy(frames[i], reports[i], strlen(reports[i]));
+	pthread_spin_init(&lock, PTHREAD_PROCESS_PRIVATE);
+	
+	printf("mode          reports  mean(ns)   p50(ns)   p99(ns) p99.9(ns)"
+				"   max(ns)\n");
+	run(0, count, rate);
+	run(1, count, rate);
+	
+	return 0;
+}
@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cmpsu-record.c - Records the raw reports of a PSU from hidraw
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmpsu-capture.h"
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] FILE\n"
+		"Records the reports of a PSU to FILE (- for stdout)\n"
+		"  -d DEVICE     hidraw node (default: first supported PSU)\n"
+		"  -n COUNT      Stop after this many reports\n"
+		"  -t SECONDS    Stop after this time\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = NULL;
+	unsigned long long count = 0;
+	unsigned long long recorded = 0;
+	uint8_t report[64];
+	char path[32];
+	uint16_t product;
+	uint64_t start;
+	uint64_t now;
+	double duration = 0;
+	ssize_t len;
+	FILE *file;
+	int ret = 0;
+	int opt;
+	int fd;
+	
+	while ((opt = getopt(argc, argv, "d:n:t:h")) != -1) {
+		switch (opt) {
+			case 'd':
+				device = optarg;
+				break;
+			case 'n':
+				count = strtoull(optarg, NULL, 0);
+				break;
+			case 't':
+				duration = atof(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	
+	if (device) {
+		fd = cmpsu_hidraw_open(device, O_RDONLY, &product);
+		if (fd < 0)
+			perror(device);
+	} else {
+		fd = cmpsu_hidraw_find(O_RDONLY, &product, path, sizeof(path));
+		if (fd < 0)
+			fprintf(stderr, "no supported PSU found\n");
+		else
+			fprintf(stderr, "recording from %s\n", path);
+	}
+	if (fd < 0)
+		return 1;
+	
+	if (!strcmp(argv[optind], "-"))
+		file = stdout;
+	else
+		file = fopen(argv[optind], "wb");
+	if (!file || cmpsu_capture_write_header(file, product)) {
+		perror(argv[optind]);
+		return 1;
+	}
+	
+	/* No SA_RESTART, so a signal interrupts the blocking read */
+	sigaction(SIGINT, &(struct sigaction) { .sa_handler = on_signal }, NULL);
+	sigaction(SIGTERM, &(struct sigaction) { .sa_handler = on_signal }, NULL);
+	
+	start = now_ns();
+	while (!stop && (!count || recorded < count)) {
+		len = read(fd, report, sizeof(report));
+		now = now_ns();
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("failed to read report");
+			ret = 1;
+			break;
+		}
+		if (cmpsu_capture_write(file, now, report, len)) {
+			perror(argv[optind]);
+			ret = 1;
+			break;
+		}
+		recorded++;
+	
+		if (duration > 0 && now - start >= duration * 1e9)
+			break;
+	}
+	
+	if (fclose(file)) {
+		perror(argv[optind]);
+		ret = 1;
+	}
+	close(fd);
+	fprintf(stderr, "recorded %llu reports\n", recorded);
+	
+	return ret;
+}
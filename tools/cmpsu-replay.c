@@ -0,0 +1,171 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cmpsu-replay.c - Replays recorded PSU reports through uhid
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmpsu-capture.h"
+#include "cmpsu-uhid.h"
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+	
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR
+				&& !stop)
+		;
+}
+
+/*
+ * Replays the file once. The timestamps of the file are mapped to the clock
+ * starting at *base, which is moved to the end of the file for the next loop.
+ */
+static int replay(FILE *file, int version, struct cmpsu_uhid *dev,
+			double speed, uint64_t *base, unsigned long long *sent)
+{
+	struct cmpsu_capture_record record;
+	uint64_t first = 0;
+	uint64_t offset = 0;
+	int ret = 0;
+	
+	while (!stop && (ret = cmpsu_capture_read(file, version, &record)) > 0) {
+		if (!first)
+			first = record.timestamp;
+		/* Timestamps could only go backwards in a hand-edited file */
+		if (record.timestamp > first)
+			offset = record.timestamp - first;
+		if (speed > 0)
+			sleep_until(*base + offset / speed);
+	
+		if (cmpsu_uhid_poll(dev) < 0
+		    || cmpsu_uhid_send(dev, record.data, record.size))
+			return -1;
+		(*sent)++;
+	}
+	
+	*base += offset / (speed > 0 ? speed : 1);
+	return ret < 0 ? -1 : 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] FILE\n"
+		"Replays the reports in FILE using a virtual PSU\n"
+		"  -s SPEED      Speed relative to the recording, 0 for no delays\n"
+		"                (default: 1)\n"
+		"  -l LOOPS      Number of times to replay the file, 0 for endless\n"
+		"                (default: 1)\n"
+		"  -p PID        USB product ID (default: from the file)\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	struct cmpsu_uhid dev;
+	unsigned long long sent = 0;
+	unsigned long loops = 1;
+	unsigned long loop;
+	unsigned int product = 0;
+	uint16_t recorded;
+	uint64_t start;
+	uint64_t base;
+	double speed = 1;
+	double elapsed;
+	FILE *file;
+	int version;
+	int ret = 0;
+	int opt;
+	
+	while ((opt = getopt(argc, argv, "s:l:p:h")) != -1) {
+		switch (opt) {
+			case 's':
+				speed = atof(optarg);
+				break;
+			case 'l':
+				loops = strtoul(optarg, NULL, 0);
+				break;
+			case 'p':
+				product = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	
+	file = fopen(argv[optind], "rb");
+	if (!file || cmpsu_capture_read_header(file, &recorded, &version)) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (!product)
+		product = recorded;
+	if (!cmpsu_model_find(product)) {
+		fprintf(stderr, "unsupported product ID: 0x%04x\n", product);
+		return 1;
+	}
+	
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	
+	if (cmpsu_uhid_create(&dev, product)) {
+		perror("failed to create uhid device");
+		return 1;
+	}
+	
+	start = now_ns();
+	base = start;
+	for (loop = 0; !stop && (!loops || loop < loops); loop++) {
+		if (loop && fseek(file, sizeof(struct cmpsu_capture_header),
+					SEEK_SET)) {
+			perror(argv[optind]);
+			ret = 1;
+			break;
+		}
+		if (replay(file, version, &dev, speed, &base, &sent)) {
+			perror("replay failed");
+			ret = 1;
+			break;
+		}
+	}
+	
+	elapsed = (now_ns() - start) / 1e9;
+	fprintf(stderr, "sent %llu reports in %.2f s (%.0f/s)\n", sent, elapsed,
+				elapsed > 0 ? sent / elapsed : 0);
+	cmpsu_uhid_destroy(&dev);
+	fclose(file);
+	
+	return ret;
+}
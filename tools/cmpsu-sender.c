@@ -0,0 +1,302 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cmpsu-sender.c - Simulates many hosts sending PSU readings to a collector
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cmpsu-capture.h"
+#include "cmpsu-wire.h"
+
+/*
+ * Every simulated host decodes the reports of a capture file with libcmpsu,
+ * each one starting at a different position, and sends a cycle per interval
+ * the same way cmpsu-exporter -u does. Each host has its own socket like a
+ * real one would, and the hosts are spread evenly over the interval.
+ */
+
+struct host {
+	int fd;
+	size_t pos;        /* Next record in the capture */
+	uint64_t time;     /* Position in the capture in ns */
+	uint64_t wrap;     /* Added to timestamps after the capture wrapped */
+	uint32_t seq;
+	int fill;
+	struct cmpsu_state state;
+	struct cmpsu_wire_cycle *batch;
+};
+
+static struct cmpsu_capture_record *records;
+static size_t record_count;
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static uint64_t now_ns(clockid_t clock)
+{
+	struct timespec ts;
+	
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+	
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR
+				&& !stop)
+		;
+}
+
+static int load_capture(const char *path, uint16_t *product)
+{
+	struct cmpsu_capture_record record;
+	size_t size = 0;
+	void *tmp;
+	FILE *file;
+	int version;
+	int ret;
+	
+	file = fopen(path, "rb");
+	if (!file || cmpsu_capture_read_header(file, product, &version))
+		return -1;
+	while ((ret = cmpsu_capture_read(file, version, &record)) > 0) {
+		if (record_count == size) {
+			size = size ? size * 2 : 4096;
+			tmp = realloc(records, size * sizeof(*records));
+			if (!tmp) {
+				fclose(file);
+				return -1;
+			}
+			records = tmp;
+		}
+		records[record_count++] = record;
+	}
+	fclose(file);
+	
+	if (ret < 0)
+		return -1;
+	if (!record_count) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Feeds the reports of the next interval to the host's decoder */
+static void advance(struct host *host, uint64_t interval)
+{
+	uint64_t first = records[0].timestamp;
+	uint64_t last = records[record_count - 1].timestamp;
+	
+	host->time += interval;
+	while (records[host->pos].timestamp - first + host->wrap <= host->time) {
+		cmpsu_state_feed(&host->state, records[host->pos].data,
+					records[host->pos].size,
+					records[host->pos].timestamp + host->wrap);
+		if (++host->pos == record_count) {
+			/* One interval between the last and the first record */
+			host->pos = 0;
+			host->wrap += last - first + interval;
+		}
+	}
+}
+
+static int open_socket(const char *address, const char *port)
+{
+	struct addrinfo hints = {
+		.ai_socktype = SOCK_DGRAM,
+	};
+	struct addrinfo *res;
+	int fd;
+	
+	if (getaddrinfo(address, port, &hints, &res)) {
+		errno = EINVAL;
+		return -1;
+	}
+	fd = socket(res->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen)) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	
+	return fd;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] FILE\n"
+		"Sends the reports in the capture FILE to a collector as many hosts\n"
+		"  -a ADDRESS    Collector address (default: localhost)\n"
+		"  -p PORT       Collector port (default: %d)\n"
+		"  -n HOSTS      Number of hosts (default: 1000)\n"
+		"  -H ID         ID of the first host (default: 1)\n"
+		"  -i MS         Interval between cycles (default: 1000)\n"
+		"  -b CYCLES     Cycles per packet (default: 10)\n"
+		"  -d PERCENT    Packets to drop before sending (default: 0)\n"
+		"  -t SECONDS    Stop after this time (default: endless)\n",
+		name, CMPSU_WIRE_PORT);
+}
+
+int main(int argc, char **argv)
+{
+	static uint8_t buf[CMPSU_WIRE_MAX];
+	struct cmpsu_wire_header hdr = { 0 };
+	const char *address = "localhost";
+	char port[16];
+	struct rlimit limit;
+	struct host *hosts;
+	struct host *host;
+	unsigned long long packets = 0;
+	unsigned long long bytes = 0;
+	unsigned long long cycles = 0;
+	unsigned long long sent = 0;
+	unsigned long long tick;
+	unsigned long long first_host = 1;
+	unsigned long count = 1000;
+	unsigned long n;
+	uint64_t interval = 1000000000;
+	uint64_t start;
+	uint16_t product;
+	double duration = 0;
+	double drop = 0;
+	double elapsed;
+	int batch = 10;
+	int len;
+	int opt;
+	
+	snprintf(port, sizeof(port), "%d", CMPSU_WIRE_PORT);
+	while ((opt = getopt(argc, argv, "a:p:n:H:i:b:d:t:h")) != -1) {
+		switch (opt) {
+			case 'a':
+				address = optarg;
+				break;
+			case 'p':
+				snprintf(port, sizeof(port), "%s", optarg);
+				break;
+			case 'n':
+				count = strtoul(optarg, NULL, 0);
+				break;
+			case 'H':
+				first_host = strtoull(optarg, NULL, 0);
+				break;
+			case 'i':
+				interval = strtoull(optarg, NULL, 0) * 1000000;
+				break;
+			case 'b':
+				batch = atoi(optarg);
+				break;
+			case 'd':
+				drop = atof(optarg) / 100;
+				break;
+			case 't':
+				duration = atof(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1 || !count || !first_host || !interval
+	    || batch < 1 || batch > CMPSU_WIRE_CYCLES) {
+		usage(argv[0]);
+		return 1;
+	}
+	
+	if (load_capture(argv[optind], &product)) {
+		perror(argv[optind]);
+		return 1;
+	}
+	
+	/* One socket per host */
+	if (!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < count + 16) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	
+	hosts = calloc(count, sizeof(*hosts));
+	if (!hosts) {
+		perror("calloc");
+		return 1;
+	}
+	for (n = 0; n < count; n++) {
+		host = &hosts[n];
+		host->fd = open_socket(address, port);
+		host->batch = calloc(batch, sizeof(*host->batch));
+		if (host->fd < 0 || !host->batch) {
+			fprintf(stderr, "host %lu: %s\n", n, strerror(errno));
+			return 1;
+		}
+		host->pos = record_count * n / count;
+		/* Start where the capture is at that record */
+		host->time = records[host->pos].timestamp - records[0].timestamp;
+		cmpsu_state_init(&host->state);
+	}
+	
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	srand(1);
+	
+	start = now_ns(CLOCK_MONOTONIC);
+	for (tick = 0; !stop; tick++) {
+		if (duration && tick * interval >= duration * 1e9)
+			break;
+		for (n = 0; n < count && !stop; n++) {
+			host = &hosts[n];
+			sleep_until(start + tick * interval + interval * n / count);
+			advance(host, interval);
+			cmpsu_wire_cycle_from_state(&host->batch[host->fill++],
+						&host->state, now_ns(CLOCK_REALTIME));
+			cycles++;
+			if (host->fill < batch)
+				continue;
+	
+			hdr.host = first_host + n;
+			hdr.product = product;
+			hdr.seq = host->seq;
+			len = cmpsu_wire_encode(buf, sizeof(buf), &hdr, host->batch,
+						host->fill);
+			/* Whatever didn't fit goes into the next packet */
+			memmove(host->batch, host->batch + hdr.count,
+						(host->fill - hdr.count) * sizeof(*host->batch));
+			host->fill -= hdr.count;
+			host->seq += hdr.count;
+			if (drop && rand() < drop * RAND_MAX)
+				continue;
+			if (send(host->fd, buf, len, 0) == len) {
+				packets++;
+				bytes += len;
+				sent += hdr.count;
+			}
+		}
+	}
+	
+	elapsed = (now_ns(CLOCK_MONOTONIC) - start) / 1e9;
+	fprintf(stderr, "%lu hosts sent %llu cycles in %llu packets "
+				"(%.1f bytes per cycle) in %.2f s (%.0f packets/s)\n",
+				count, cycles, packets,
+				sent ? (double) bytes / sent : 0, elapsed,
+				elapsed > 0 ? packets / elapsed : 0);
+	
+	return 0;
+}
@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cmpsu-uhid.c - Virtual Cooler Master PSUs using uhid
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/uhid.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cmpsu-uhid.h"
+
+/*
+ * Vendor defined 16 byte input and output reports without a report ID. The
+ * driver doesn't look at the descriptor, it only needs to parse.
+ */
+static const uint8_t cmpsu_rdesc[] = {
+	0x06, 0x00, 0xff, /* Usage Page (Vendor Defined 0xFF00) */
+	0x09, 0x01,       /* Usage (0x01) */
+	0xa1, 0x01,       /* Collection (Application) */
+	0x15, 0x00,       /*   Logical Minimum (0) */
+	0x26, 0xff, 0x00, /*   Logical Maximum (255) */
+	0x75, 0x08,       /*   Report Size (8) */
+	0x95, 0x10,       /*   Report Count (16) */
+	0x09, 0x02,       /*   Usage (0x02) */
+	0x81, 0x02,       /*   Input (Data, Variable, Absolute) */
+	0x09, 0x03,       /*   Usage (0x03) */
+	0x91, 0x02,       /*   Output (Data, Variable, Absolute) */
+	0xc0,             /* End Collection */
+};
+
+static int cmpsu_uhid_write(int fd, const struct uhid_event *ev)
+{
+	ssize_t ret = write(fd, ev, sizeof(*ev));
+	
+	if (ret < 0)
+		return -1;
+	if (ret != sizeof(*ev)) {
+		errno = EIO;
+		return -1;
+	}
+	
+	return 0;
+}
+
+/* Reads and handles one event, returns its type or -1 */
+static int cmpsu_uhid_read(struct cmpsu_uhid *dev)
+{
+	struct uhid_event ev;
+	ssize_t ret;
+	
+	ret = read(dev->fd, &ev, sizeof(ev));
+	if (ret < 0)
+		return -1;
+	
+	switch (ev.type) {
+		case UHID_OPEN:
+			dev->open = 1;
+			break;
+		case UHID_CLOSE:
+			dev->open = 0;
+			dev->closes++;
+			break;
+		case UHID_GET_REPORT:
+			/* The PSU doesn't have any feature reports */
+			memset(&ev, 0, sizeof(ev));
+			ev.type = UHID_GET_REPORT_REPLY;
+			ev.u.get_report_reply.err = EIO;
+			if (cmpsu_uhid_write(dev->fd, &ev))
+				return -1;
+			return UHID_GET_REPORT;
+		case UHID_SET_REPORT:
+			memset(&ev, 0, sizeof(ev));
+			ev.type = UHID_SET_REPORT_REPLY;
+			ev.u.set_report_reply.err = EIO;
+			if (cmpsu_uhid_write(dev->fd, &ev))
+				return -1;
+			return UHID_SET_REPORT;
+	}
+	
+	return ev.type;
+}
+
+int cmpsu_uhid_create(struct cmpsu_uhid *dev, uint16_t product)
+{
+	const struct cmpsu_model *model = cmpsu_model_find(product);
+	struct uhid_event ev;
+	int type;
+	
+	dev->open = 0;
+	dev->closes = 0;
+	dev->fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (dev->fd < 0)
+		return -1;
+	
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *) ev.u.create2.name, sizeof(ev.u.create2.name),
+				"Cooler Master %s", model ? model->name : "PSU");
+	snprintf((char *) ev.u.create2.phys, sizeof(ev.u.create2.phys),
+				"cmpsu-uhid-%d", (int) getpid());
+	snprintf((char *) ev.u.create2.uniq, sizeof(ev.u.create2.uniq),
+				"EMU%04X%d", product, (int) getpid());
+	memcpy(ev.u.create2.rd_data, cmpsu_rdesc, sizeof(cmpsu_rdesc));
+	ev.u.create2.rd_size = sizeof(cmpsu_rdesc);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = CMPSU_VENDOR;
+	ev.u.create2.product = product;
+	if (cmpsu_uhid_write(dev->fd, &ev))
+		goto fail;
+	
+	/* The device can't receive input before it has been started */
+	do {
+		type = cmpsu_uhid_read(dev);
+		if (type < 0)
+			goto fail;
+	} while (type != UHID_START);
+	
+	return 0;
+	
+fail:
+	type = errno;
+	close(dev->fd);
+	errno = type;
+	return -1;
+}
+
+int cmpsu_uhid_send(struct cmpsu_uhid *dev, const void *data, size_t size)
+{
+	struct uhid_event ev;
+	
+	if (size > UHID_DATA_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = size;
+	memcpy(ev.u.input2.data, data, size);
+	/* Only the used part of the event needs to be written */
+	if (write(dev->fd, &ev, offsetof(struct uhid_event, u.input2.data)
+				+ size) < 0)
+		return -1;
+	
+	return 0;
+}
+
+int cmpsu_uhid_poll(struct cmpsu_uhid *dev)
+{
+	struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+	
+	while (poll(&pfd, 1, 0) > 0) {
+		if (cmpsu_uhid_read(dev) < 0)
+			return -1;
+	}
+	
+	return dev->open;
+}
+
+void cmpsu_uhid_destroy(struct cmpsu_uhid *dev)
+{
+	struct uhid_event ev;
+	
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	cmpsu_uhid_write(dev->fd, &ev);
+	close(dev->fd);
+}
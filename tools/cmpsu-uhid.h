@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * cmpsu-uhid.h - Virtual Cooler Master PSUs using uhid
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#ifndef _CMPSU_UHID_H
+#define _CMPSU_UHID_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libcmpsu.h"
+
+struct cmpsu_uhid {
+	int fd;
+	int open; /* Opened by a driver or hidraw */
+	/* Number of UHID_CLOSE events, also counts a close that was followed by
+	 * an open in the same cmpsu_uhid_poll() */
+	unsigned long closes;
+};
+
+/*
+ * Creates a virtual PSU with the given product ID and waits until the HID
+ * core has started it. Returns 0 or -1 with errno set.
+ */
+int cmpsu_uhid_create(struct cmpsu_uhid *dev, uint16_t product);
+
+/* Sends one input report (at most UHID_DATA_MAX bytes) */
+int cmpsu_uhid_send(struct cmpsu_uhid *dev, const void *data, size_t size);
+
+/*
+ * Handles all pending events from the HID core without blocking. Returns the
+ * new value of dev->open or -1 on errors.
+ */
+int cmpsu_uhid_poll(struct cmpsu_uhid *dev);
+
+void cmpsu_uhid_destroy(struct cmpsu_uhid *dev);
+
+#endif /* _CMPSU_UHID_H */
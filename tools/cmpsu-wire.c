@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * cmpsu-wire.c - Binary protocol for sending PSU readings to a collector
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#include <endian.h>
+#include <string.h>
+
+#include "cmpsu-wire.h"
+
+/* Header as it is sent, all fields are naturally aligned */
+struct cmpsu_wire_packet {
+	char magic[4];
+	uint8_t version;
+	uint8_t psu;
+	uint8_t count;
+	uint8_t reserved;
+	uint64_t host;
+	uint32_t seq;
+	uint16_t product;
+	uint16_t reserved2;
+	uint64_t timestamp;
+};
+
+_Static_assert(sizeof(struct cmpsu_wire_packet) == CMPSU_WIRE_HEADER_LEN,
+			"wrong header size");
+
+/* Longest possible encoding of a cycle */
+#define CYCLE_MAX (10 + 3 + 10 * CMPSU_COUNT_ALL + 10)
+
+static uint8_t *put_varint(uint8_t *p, uint64_t value)
+{
+	while (value >= 0x80) {
+		*p++ = value | 0x80;
+		value >>= 7;
+	}
+	*p++ = value;
+	
+	return p;
+}
+
+static uint8_t *put_zigzag(uint8_t *p, int64_t value)
+{
+	return put_varint(p, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+/* Returns NULL if the varint is truncated or too long */
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end,
+			uint64_t *value)
+{
+	int shift;
+	
+	*value = 0;
+	for (shift = 0; shift < 64 && p < end; shift += 7) {
+		*value |= (uint64_t) (*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+	
+	return NULL;
+}
+
+static const uint8_t *get_zigzag(const uint8_t *p, const uint8_t *end,
+			int64_t *value)
+{
+	uint64_t raw;
+	
+	p = get_varint(p, end, &raw);
+	*value = (int64_t) (raw >> 1) ^ -(int64_t) (raw & 1);
+	
+	return p;
+}
+
+void cmpsu_wire_cycle_from_state(struct cmpsu_wire_cycle *cycle,
+			const struct cmpsu_state *state, uint64_t timestamp)
+{
+	int i;
+	
+	cycle->timestamp = timestamp;
+	cycle->present = 0;
+	for (i = 0; i < CMPSU_COUNT_ALL; i++) {
+		cycle->values[i] = state->values[i];
+		if (state->values[i] >= 0)
+			cycle->present |= 1U << i;
+	}
+	cycle->energy = state->energy;
+}
+
+int cmpsu_wire_encode(uint8_t *buf, int size, struct cmpsu_wire_header *hdr,
+			const struct cmpsu_wire_cycle *cycles, int count)
+{
+	struct cmpsu_wire_packet packet = { 0 };
+	int64_t prev[CMPSU_COUNT_ALL] = { 0 };
+	uint64_t energy = 0;
+	uint64_t time;
+	uint64_t delta;
+	uint8_t *p = buf + sizeof(packet);
+	int n;
+	int i;
+	
+	if (count > CMPSU_WIRE_CYCLES)
+		count = CMPSU_WIRE_CYCLES;
+	
+	time = count ? cycles[0].timestamp : 0;
+	for (n = 0; n < count && buf + size - p >= CYCLE_MAX; n++) {
+		/* Relative to the rounded time the receiver will see */
+		delta = 0;
+		if (cycles[n].timestamp > time)
+			delta = (cycles[n].timestamp - time + 500000) / 1000000;
+		time += delta * 1000000;
+		p = put_varint(p, delta);
+	
+		p = put_varint(p, cycles[n].present);
+		for (i = 0; i < CMPSU_COUNT_ALL; i++) {
+			if (!(cycles[n].present & (1U << i)))
+				continue;
+			p = put_zigzag(p, cycles[n].values[i] - prev[i]);
+			prev[i] = cycles[n].values[i];
+		}
+		p = put_zigzag(p, cycles[n].energy - energy);
+		energy = cycles[n].energy;
+	}
+	
+	hdr->count = n;
+	memcpy(packet.magic, CMPSU_WIRE_MAGIC, sizeof(packet.magic));
+	packet.version = CMPSU_WIRE_VERSION;
+	packet.psu = hdr->psu;
+	packet.count = n;
+	packet.host = htole64(hdr->host);
+	packet.seq = htole32(hdr->seq);
+	packet.product = htole16(hdr->product);
+	packet.timestamp = htole64(count ? cycles[0].timestamp : 0);
+	memcpy(buf, &packet, sizeof(packet));
+	
+	return p - buf;
+}
+
+int cmpsu_wire_decode(const uint8_t *buf, int len,
+			struct cmpsu_wire_header *hdr,
+			struct cmpsu_wire_cycle *cycles, int max)
+{
+	struct cmpsu_wire_packet packet;
+	const uint8_t *end = buf + len;
+	const uint8_t *p = buf + sizeof(packet);
+	int64_t prev[CMPSU_COUNT_ALL] = { 0 };
+	uint64_t energy = 0;
+	uint64_t time;
+	uint64_t value;
+	int64_t delta;
+	int n;
+	int i;
+	
+	if (len < (int) sizeof(packet))
+		return -1;
+	memcpy(&packet, buf, sizeof(packet));
+	if (memcmp(packet.magic, CMPSU_WIRE_MAGIC, sizeof(packet.magic))
+	    || packet.version != CMPSU_WIRE_VERSION || packet.count > max)
+		return -1;
+	
+	hdr->host = le64toh(packet.host);
+	hdr->psu = packet.psu;
+	hdr->count = packet.count;
+	hdr->product = le16toh(packet.product);
+	hdr->seq = le32toh(packet.seq);
+	
+	time = le64toh(packet.timestamp);
+	for (n = 0; n < packet.count; n++) {
+		if (!(p = get_varint(p, end, &value)))
+			return -1;
+		time += value * 1000000;
+		cycles[n].timestamp = time;
+	
+		if (!(p = get_varint(p, end, &value))
+		    || value >= (1U << CMPSU_COUNT_ALL))
+			return -1;
+		cycles[n].present = value;
+		for (i = 0; i < CMPSU_COUNT_ALL; i++) {
+			cycles[n].values[i] = -1;
+			if (!(cycles[n].present & (1U << i)))
+				continue;
+			if (!(p = get_zigzag(p, end, &delta)))
+				return -1;
+			/* Wraps instead of overflowing on garbage */
+			prev[i] = (uint64_t) prev[i] + (uint64_t) delta;
+			cycles[n].values[i] = prev[i];
+		}
+	
+		if (!(p = get_zigzag(p, end, &delta)))
+			return -1;
+		energy += delta;
+		cycles[n].energy = energy;
+	}
+	
+	/* Trailing data would mean the sender uses a different format */
+	if (p != end)
+		return -1;
+	
+	return n;
+}
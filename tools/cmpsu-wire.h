@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * cmpsu-wire.h - Binary protocol for sending PSU readings to a collector
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#ifndef _CMPSU_WIRE_H
+#define _CMPSU_WIRE_H
+
+#include <stdint.h>
+
+#include "libcmpsu.h"
+
+/*
+ * Each UDP packet carries a batch of consecutive cycles of one PSU. All
+ * values are little endian:
+ * - Header (32 bytes): magic "CMPW", u8 version (1), u8 PSU index on the
+ *   host, u8 number of cycles, u8 reserved (0), u64 host ID, u32 sequence
+ *   number of the first cycle, u16 USB product ID, u16 reserved (0), u64
+ *   CLOCK_REALTIME timestamp of the first cycle in ns
+ * - For each cycle: varint time since the previous cycle in ms (0 for the
+ *   first), varint bitmap of the channels that have a value (bit n is the
+ *   n-th channel in the order of libcmpsu.h), a zigzag varint for each of
+ *   these channels with the difference to its value in the previous cycle
+ *   and a zigzag varint with the difference of the energy counter (uJ). The
+ *   first cycle in a packet is relative to 0, so packets can be decoded on
+ *   their own.
+ *
+ * Sequence numbers count cycles, so a receiver can tell lost and reordered
+ * packets apart. They start at 0 when the sender starts.
+ */
+
+#define CMPSU_WIRE_MAGIC "CMPW"
+#define CMPSU_WIRE_VERSION 1
+#define CMPSU_WIRE_PORT 9564
+#define CMPSU_WIRE_HEADER_LEN 32
+#define CMPSU_WIRE_MAX 1400 /* Fits into an Ethernet frame */
+#define CMPSU_WIRE_CYCLES 64 /* Maximum number of cycles per packet */
+
+struct cmpsu_wire_header {
+	uint64_t host;
+	uint8_t psu;
+	uint8_t count;
+	uint16_t product;
+	uint32_t seq;
+};
+
+struct cmpsu_wire_cycle {
+	uint64_t timestamp; /* CLOCK_REALTIME in ns, ms resolution on the wire */
+	uint32_t present;   /* Bit per channel that has a value */
+	int64_t values[CMPSU_COUNT_ALL];
+	uint64_t energy;    /* uJ */
+};
+
+/* Takes the values that were received so far */
+void cmpsu_wire_cycle_from_state(struct cmpsu_wire_cycle *cycle,
+			const struct cmpsu_state *state, uint64_t timestamp);
+
+/*
+ * Encodes as many of the cycles as fit into size bytes (at least
+ * CMPSU_WIRE_MAX for a whole batch). hdr->count is set to the number of
+ * encoded cycles. Returns the length of the packet.
+ */
+int cmpsu_wire_encode(uint8_t *buf, int size, struct cmpsu_wire_header *hdr,
+			const struct cmpsu_wire_cycle *cycles, int count);
+
+/* Returns the number of cycles or -1 if the packet is invalid */
+int cmpsu_wire_decode(const uint8_t *buf, int len,
+			struct cmpsu_wire_header *hdr,
+			struct cmpsu_wire_cycle *cycles, int max);
+
+#endif /* _CMPSU_WIRE_H */
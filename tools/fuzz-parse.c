@@ -0,0 +1,355 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * fuzz-parse.c - Fuzzing harness for the decoder in cm-psu-proto.h
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ *
+ * Every record passed to the callback of cmpsu_parse() is checked against
+ * the ranges documented in struct cmpsu_record, and 16 byte reports are also
+ * decoded by the scanner alone (the reference decoder) to check that the
+ * fast path finds exactly the same records.
+ *
+ * Built with -DCMPSU_LIBFUZZER -fsanitize=fuzzer it is a libFuzzer target.
+ * Otherwise it checks the files given on the command line or stdin (like an
+ * AFL target) and can mutate them by itself with -n.
+ */
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../cm-psu-proto.h"
+
+/* Longer inputs are cut off, the driver drops reports over REPORT_MAX too */
+#define INPUT_MAX 64
+
+/* Every record takes at least 5 bytes */
+#define RECORDS_MAX (INPUT_MAX / 5 + 1)
+
+struct records {
+	struct cmpsu_record list[RECORDS_MAX];
+	int count;
+};
+
+static void fail(const char *what, const uint8_t *data, size_t size)
+{
+	size_t i;
+	
+	fprintf(stderr, "%s, input:", what);
+	for (i = 0; i < size; i++)
+		fprintf(stderr, " %02x", data[i]);
+	fprintf(stderr, "\n");
+	abort();
+}
+
+static void add_record(void *ctx, const struct cmpsu_record *record)
+{
+	struct records *records = ctx;
+	
+	if (records->count == RECORDS_MAX)
+		abort();
+	records->list[records->count++] = *record;
+}
+
+/* Same ranges as the comments of struct cmpsu_record */
+static const char *check_record(const struct cmpsu_record *record)
+{
+	int64_t scaled;
+	
+	/* A single digit starting at 1, so channel -= 1 can't wrap */
+	if (record->channel > 8)
+		return "channel out of range";
+	
+	switch (record->type) {
+		case 'V':
+		case 'I':
+		case 'T':
+			if (record->value1 > 999 || record->value2 > 9)
+				return "value out of range";
+			/* Converted to milli-units in an int by the driver */
+			scaled = record->value1 * 1000LL
+				 + record->value2 * 100LL;
+			if (scaled > INT32_MAX)
+				return "scaled value overflows";
+			break;
+		case 'R':
+			if (record->value1 > 9999 || record->value2 != 0)
+				return "value out of range";
+			break;
+		case 'P':
+			if (record->channel != 1)
+				return "power channel other than P2";
+			if (record->value1 > 9999 || record->value2 > 9999)
+				return "value out of range";
+			break;
+		default:
+			return "unknown type";
+	}
+	
+	return NULL;
+}
+
+static void check_classify(const uint8_t *data, size_t size)
+{
+	enum cmpsu_layout layout;
+	int close = -1;
+	int sep = -1;
+	
+	layout = cmpsu_classify(data, &close, &sep);
+	if (layout == CMPSU_LAYOUT_INVALID)
+		return;
+	if (close < 0 || close >= CMPSU_EVENT_LEN || data[close] != ']')
+		fail("cmpsu_classify() returned a bad ']' position", data, size);
+	
+	switch (layout) {
+		case CMPSU_LAYOUT_DECIMAL:
+			if (sep <= 3 || sep >= close - 1 || data[sep] != '.')
+				fail("cmpsu_classify() returned a bad '.' position",
+							data, size);
+			break;
+		case CMPSU_LAYOUT_SLASH:
+			if (sep <= 3 || sep >= close - 1 || data[sep] != '/')
+				fail("cmpsu_classify() returned a bad '/' position",
+							data, size);
+			break;
+		default:
+			break;
+	}
+}
+
+static void check_input(const uint8_t *data, size_t size)
+{
+	/* One more byte, so the scanner doesn't take the fast path */
+	uint8_t ref_data[INPUT_MAX + 1] = { 0 };
+	struct records records = { .count = 0 };
+	struct records ref = { .count = 0 };
+	const char *error;
+	int i;
+	
+	if (size > INPUT_MAX)
+		size = INPUT_MAX;
+	
+	cmpsu_parse(data, size, add_record, &records);
+	for (i = 0; i < records.count; i++) {
+		error = check_record(&records.list[i]);
+		if (error)
+			fail(error, data, size);
+	}
+	
+	if (size != CMPSU_EVENT_LEN || data[0] != '[')
+		return;
+	check_classify(data, size);
+	
+	/* A trailing zero byte can't be part of a record, so it finds the same */
+	memcpy(ref_data, data, size);
+	cmpsu_parse(ref_data, size + 1, add_record, &ref);
+	if (records.count != ref.count)
+		fail("fast path and scanner found a different number of records",
+					data, size);
+	for (i = 0; i < records.count; i++) {
+		if (memcmp(&records.list[i], &ref.list[i], sizeof(ref.list[i])))
+			fail("fast path and scanner decoded differently", data,
+						size);
+	}
+}
+
+#ifdef CMPSU_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	check_input(data, size);
+	return 0;
+}
+
+#else
+
+/* Used when no seeds are given for -n */
+static const char *builtin_seeds[] = {
+	"[V1226.2]", "[I1000.8]", "[T1038.5]", "[R10650]", "[P20145/0137]",
+};
+#define BUILTIN_SEEDS ((int)(sizeof(builtin_seeds) / sizeof(*builtin_seeds)))
+
+/* Bytes that are likely to make the decoder take a different path */
+static const char alphabet[] = "[]./0123456789VITRP\xff";
+
+struct seed {
+	uint8_t data[INPUT_MAX];
+	size_t size;
+};
+
+static struct seed *seeds;
+static int seed_count;
+
+static int add_seed(const uint8_t *data, size_t size)
+{
+	struct seed *new;
+	
+	new = realloc(seeds, (seed_count + 1) * sizeof(*seeds));
+	if (!new)
+		return -1;
+	seeds = new;
+	
+	if (size > INPUT_MAX)
+		size = INPUT_MAX;
+	memset(seeds[seed_count].data, 0, INPUT_MAX);
+	memcpy(seeds[seed_count].data, data, size);
+	seeds[seed_count].size = size;
+	seed_count++;
+	return 0;
+}
+
+static int read_file(const char *path, FILE *file)
+{
+	uint8_t data[INPUT_MAX];
+	size_t size;
+	
+	size = fread(data, 1, sizeof(data), file);
+	if (ferror(file)) {
+		perror(path);
+		return -1;
+	}
+	
+	check_input(data, size);
+	return add_seed(data, size);
+}
+
+static int read_path(const char *path)
+{
+	char name[4096];
+	struct dirent *entry;
+	FILE *file;
+	DIR *dir;
+	int ret = 0;
+	
+	dir = opendir(path);
+	if (!dir) {
+		file = fopen(path, "rb");
+		if (!file) {
+			perror(path);
+			return -1;
+		}
+		ret = read_file(path, file);
+		fclose(file);
+		return ret;
+	}
+	
+	while (!ret && (entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+		ret = read_path(name);
+	}
+	closedir(dir);
+	return ret;
+}
+
+static void mutate(uint8_t *data, size_t *size)
+{
+	const struct seed *other;
+	size_t pos;
+	int count = 1 + rand() % 4;
+	
+	while (count--) {
+		pos = rand() % INPUT_MAX;
+		switch (rand() % 6) {
+			case 0:
+			case 1:
+				data[pos] = alphabet[rand() % (sizeof(alphabet) - 1)];
+				break;
+			case 2:
+				data[pos] = rand();
+				break;
+			case 3:
+				data[pos] = 0;
+				break;
+			case 4:
+				/* Splice in another seed, often giving two records */
+				other = &seeds[rand() % seed_count];
+				memcpy(data + pos, other->data,
+							other->size < INPUT_MAX - pos
+							? other->size : INPUT_MAX - pos);
+				break;
+			case 5:
+				/* Mostly keep the length of real reports */
+				*size = rand() % 4 ? CMPSU_EVENT_LEN
+							: rand() % (INPUT_MAX + 1);
+				break;
+		}
+		if (pos >= *size && pos < CMPSU_EVENT_LEN)
+			*size = CMPSU_EVENT_LEN;
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] [FILE|DIR...]\n"
+		"  -n COUNT      Check COUNT mutations of the inputs\n"
+		"  -s SEED       Seed for the mutations (default: 1)\n"
+		"Checks each input file, or stdin without any files. Exits with\n"
+		"SIGABRT on the first record that is out of range or decoded\n"
+		"differently by the fast path and the scanner.\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t data[INPUT_MAX];
+	unsigned long long count = 0;
+	unsigned long long i;
+	unsigned int seed = 1;
+	size_t size;
+	int opt;
+	int n;
+	
+	while ((opt = getopt(argc, argv, "n:s:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				count = strtoull(optarg, NULL, 0);
+				break;
+			case 's':
+				seed = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	
+	if (optind == argc && !count) {
+		if (read_file("stdin", stdin))
+			return 1;
+	}
+	for (n = optind; n < argc; n++) {
+		if (read_path(argv[n]))
+			return 1;
+	}
+	if (!count)
+		return 0;
+	
+	if (!seed_count) {
+		for (n = 0; n < BUILTIN_SEEDS; n++) {
+			memset(data, 0, CMPSU_EVENT_LEN);
+			memcpy(data, builtin_seeds[n], strlen(builtin_seeds[n]));
+			if (add_seed(data, CMPSU_EVENT_LEN))
+				return 1;
+		}
+	}
+	
+	srand(seed);
+	for (i = 0; i < count; i++) {
+		n = rand() % seed_count;
+		memcpy(data, seeds[n].data, INPUT_MAX);
+		size = seeds[n].size;
+		mutate(data, &size);
+		check_input(data, size);
+	}
+	fprintf(stderr, "%d inputs, %llu mutations checked\n", seed_count, count);
+	
+	free(seeds);
+	return 0;
+}
+
+#endif /* CMPSU_LIBFUZZER */
@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * libcmpsu.c - Decodes the reports of Cooler Master PSUs in userspace
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/hidraw.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "libcmpsu.h"
+
+static const char * const cmpsu_names[CMPSU_COUNT_ALL] = {
+	"in0", "in1", "in2", "in3", "in4",
+	"curr1", "curr2", "curr3", "curr4", "curr5",
+	"power1", "power2",
+	"temp1", "temp2",
+	"fan1",
+};
+
+static const char * const cmpsu_labels[CMPSU_COUNT_ALL] = {
+	"V_AC", "+5V", "+3.3V", "+12V2", "+12V1",
+	"I_AC", "I_+5V", "I_+3.3V", "I_+12V2", "I_+12V1",
+	"P_in", "P_out",
+};
+
+void cmpsu_state_init(struct cmpsu_state *state)
+{
+	int i;
+	
+	memset(state, 0, sizeof(*state));
+	for (i = 0; i < CMPSU_COUNT_ALL; i++)
+		state->values[i] = -1;
+}
+
+static void cmpsu_state_power(struct cmpsu_state *state, int64_t p_in,
+			int64_t p_out)
+{
+	uint64_t energy;
+	
+	cmpsu_energy_step(state->values[CMPSU_CHAN_POWER_FIRST],
+				state->now - state->energy_updated, &energy);
+	state->energy += energy;
+	state->energy_updated = state->now;
+	
+	state->values[CMPSU_CHAN_POWER_FIRST] = p_in;
+	state->values[CMPSU_CHAN_POWER_FIRST + 1] = p_out;
+	state->seq[CMPSU_CHAN_POWER_FIRST]++;
+	state->seq[CMPSU_CHAN_POWER_FIRST + 1]++;
+}
+
+/* Same conversions and energy step as cmpsu_store() in the driver */
+static void cmpsu_state_store(void *ctx, const struct cmpsu_record *record)
+{
+	struct cmpsu_state *state = ctx;
+	int64_t values[2];
+	int index;
+	
+	index = cmpsu_record_convert(record, values);
+	if (index < 0)
+		return;
+	
+	if (record->type == 'P') {
+		cmpsu_state_power(state, values[0], values[1]);
+		return;
+	}
+	state->values[index] = values[0];
+	state->seq[index]++;
+}
+
+void cmpsu_state_feed(struct cmpsu_state *state, const uint8_t *data,
+			int size, uint64_t now)
+{
+	state->now = now;
+	cmpsu_parse(data, size, cmpsu_state_store, state);
+}
+
+enum cmpsu_channel_type cmpsu_state_channel(int index, int *channel)
+{
+	if (index >= CMPSU_CHAN_FAN_FIRST) {
+		*channel = index - CMPSU_CHAN_FAN_FIRST;
+		return CMPSU_TYPE_FAN;
+	}
+	if (index >= CMPSU_CHAN_TEMP_FIRST) {
+		*channel = index - CMPSU_CHAN_TEMP_FIRST;
+		return CMPSU_TYPE_TEMP;
+	}
+	if (index >= CMPSU_CHAN_POWER_FIRST) {
+		*channel = index - CMPSU_CHAN_POWER_FIRST;
+		return CMPSU_TYPE_POWER;
+	}
+	if (index >= CMPSU_CHAN_CURRENT_FIRST) {
+		*channel = index - CMPSU_CHAN_CURRENT_FIRST;
+		return CMPSU_TYPE_CURRENT;
+	}
+	*channel = index;
+	return CMPSU_TYPE_VOLTAGE;
+}
+
+const char *cmpsu_state_name(int index)
+{
+	return cmpsu_names[index];
+}
+
+const char *cmpsu_state_label(int index)
+{
+	return cmpsu_labels[index];
+}
+
+int cmpsu_hidraw_open(const char *path, int flags, uint16_t *product)
+{
+	struct hidraw_devinfo info;
+	int fd;
+	
+	fd = open(path, flags | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0)
+		goto fail;
+	if ((uint16_t) info.vendor != CMPSU_VENDOR
+	    || !cmpsu_model_find(info.product)) {
+		errno = ENODEV;
+		goto fail;
+	}
+	
+	*product = info.product;
+	return fd;
+	
+fail:
+	flags = errno;
+	close(fd);
+	errno = flags;
+	return -1;
+}
+
+int cmpsu_hidraw_find(int flags, uint16_t *product, char *path, int size)
+{
+	struct dirent *entry;
+	DIR *dir;
+	int fd = -1;
+	
+	dir = opendir("/dev");
+	if (!dir)
+		return -1;
+	while (fd < 0 && (entry = readdir(dir))) {
+		if (strncmp(entry->d_name, "hidraw", 6))
+			continue;
+		snprintf(path, size, "/dev/%s", entry->d_name);
+		fd = cmpsu_hidraw_open(path, flags, product);
+	}
+	closedir(dir);
+	
+	if (fd < 0)
+		errno = ENODEV;
+	return fd;
+}
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * libcmpsu.h - Decodes the reports of Cooler Master PSUs in userspace
+ * Copyright (C) 2023 Jannis Mast <jannis@ctrl-c.xyz>
+ */
+
+#ifndef _LIBCMPSU_H
+#define _LIBCMPSU_H
+
+#include <stdint.h>
+
+#include "../cm-psu.h"
+#include "../cm-psu-proto.h"
+
+/*
+ * Same channels, order and units as the driver's hwmon attributes
+ * (CMPSU_COUNT_*), using the decoder in cm-psu-proto.h.
+ */
+struct cmpsu_state {
+	int64_t values[CMPSU_COUNT_ALL]; /* -1 until the first value */
+	uint64_t seq[CMPSU_COUNT_ALL];
+	uint64_t energy; /* uJ, integrated from P_in like in the driver */
+	uint64_t energy_updated;
+	uint64_t now; /* Timestamp of the report being decoded */
+};
+
+void cmpsu_state_init(struct cmpsu_state *state);
+
+/* Decodes one report received at now (CLOCK_MONOTONIC in ns) */
+void cmpsu_state_feed(struct cmpsu_state *state, const uint8_t *data,
+			int size, uint64_t now);
+
+/* Returns the type and index (see enum cmpsu_channel_type) of a channel */
+enum cmpsu_channel_type cmpsu_state_channel(int index, int *channel);
+
+/* hwmon attribute name of a channel, e.g. "in0" or "power2" */
+const char *cmpsu_state_name(int index);
+
+/* Label like the driver's {name}_label, NULL for the temperatures */
+const char *cmpsu_state_label(int index);
+
+/*
+ * Opens a hidraw node if it belongs to a supported PSU. Returns the file
+ * descriptor or -1 with errno set (ENODEV for other devices).
+ */
+int cmpsu_hidraw_open(const char *path, int flags, uint16_t *product);
+
+/* Opens the first supported PSU in /dev, path receives its name */
+int cmpsu_hidraw_find(int flags, uint16_t *product, char *path, int size);
+
+#endif /* _LIBCMPSU_H */